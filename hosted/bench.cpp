@@ -0,0 +1,468 @@
+#include "host.hpp"
+#include "uhda/uhda.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+
+using namespace hosted;
+
+// a laptop codec with speakers, a headphone jack, a line out, s/pdif and a microphone
+static constexpr const char* DEFAULT_CODEC_SCRIPT = R"(
+codec 0 vendor=10EC0269 revision=100100
+afg pcm=000E07E0 formats=1
+
+# dacs and a digital converter
+widget 02 caps=5 out_amp=55757
+widget 03 caps=5 out_amp=55757
+widget 06 caps=211 pcm=E0160 formats=5
+
+# adc and its input mixer
+widget 08 caps=100003 in_amp=80053F00 conn=23
+widget 23 caps=200003 in_amp=80051F17 conn=18
+
+# output mixers, the first one mixes both dacs
+widget 0C caps=200007 out_amp=55757 in_amp=80050000 conn=02,83
+widget 0D caps=200007 out_amp=55757 conn=03
+
+# speaker, headphone, line out, s/pdif out and microphone pins
+widget 14 caps=400005 pin=10010 out_amp=80050000 conn=0C,0D config=90100010
+widget 15 caps=400085 pin=1C out_amp=80050000 conn=0C,0D config=02214020
+widget 16 caps=400005 pin=10 conn=0C,0D config=01011011
+widget 1E caps=400201 pin=10 conn=06 config=01430040
+widget 18 caps=400083 pin=2024 in_amp=50300 config=02A19030
+)";
+
+static constexpr uint64_t NS_PER_MS = 1000000;
+static constexpr uint32_t SAMPLE_RATE = 48000;
+static constexpr uint32_t CHANNELS = 2;
+// 10ms periods of 16-bit stereo
+static constexpr uint32_t PERIOD_SIZE = 1920;
+static constexpr uint32_t PERIOD_COUNT = 16;
+static constexpr uint32_t TARGET_LATENCY_US = 20000;
+static constexpr uint32_t RING_SIZE = 16384;
+// the scenarios run on the first output stream
+static constexpr uint32_t STREAM_TRACE_ID = 0x100;
+
+static constexpr uint64_t WARMUP_NS = 100 * NS_PER_MS;
+static constexpr uint64_t RUN_NS = 2000 * NS_PER_MS;
+// how often the client queues more data
+static constexpr uint64_t CLIENT_INTERVAL_NS = 5 * NS_PER_MS;
+
+#define CHECK_STATUS(expr) check_status((expr), #expr)
+
+static void check_status(UhdaStatus status, const char* expr) {
+	if (status != UHDA_STATUS_SUCCESS) {
+		fprintf(stderr, "bench: %s failed with status %d\n", expr, status);
+		exit(1);
+	}
+}
+
+static uint64_t wall_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the client side of a scenario, it generates a triangle wave in the source format
+struct Client {
+	uint32_t fill(void* buffer, uint32_t space) {
+		auto* samples = static_cast<int16_t*>(buffer);
+		auto count = space / 2;
+		for (uint32_t i = 0; i < count; ++i) {
+			samples[i] = next_sample();
+		}
+		bytes += count * 2;
+		return count * 2;
+	}
+
+	int16_t next_sample() {
+		phase += 0x400;
+		return static_cast<int16_t>(phase < 0x8000 ? phase - 0x4000 : 0xC000 - phase);
+	}
+
+	// generates `size` bytes of the source format into `data`
+	void generate(std::vector<uint8_t>& data, uint32_t size) {
+		data.resize(size);
+		if (float_source) {
+			auto* samples = reinterpret_cast<float*>(data.data());
+			for (uint32_t i = 0; i < size / 4; ++i) {
+				samples[i] = static_cast<float>(next_sample()) / 32768.0F;
+			}
+		}
+		else {
+			fill(data.data(), size);
+			bytes -= size;
+		}
+	}
+
+	static uint32_t fill_fn(void* arg, void* buffer, uint32_t space) {
+		return static_cast<Client*>(arg)->fill(buffer, space);
+	}
+
+	uint16_t phase {};
+	bool float_source {};
+	uint64_t bytes {};
+};
+
+enum class Feed {
+	// the buffer fill function is called from the irq
+	Fill,
+	// the client queues data every few milliseconds
+	Queue,
+	// the client queues to two virtual streams
+	Mixer
+};
+
+struct Scenario {
+	const char* name;
+	uint32_t ring_size;
+	Feed feed;
+	// conversion from a different source format, zero rate for none
+	UhdaStreamParams source;
+	bool gain_ramps;
+};
+
+static constexpr Scenario SCENARIOS[] {
+	{"ring, fill fn", RING_SIZE, Feed::Fill, {}, false},
+	{"zero-copy, fill fn", 0, Feed::Fill, {}, false},
+	{"ring, queue", RING_SIZE, Feed::Queue, {}, false},
+	{"zero-copy, queue", 0, Feed::Queue, {}, false},
+	{"ring, gain ramps", RING_SIZE, Feed::Queue, {}, true},
+	{"ring, float source", RING_SIZE, Feed::Queue, {SAMPLE_RATE, CHANNELS, UHDA_FORMAT_FLOAT32}, false},
+	{"ring, 44.1k source", RING_SIZE, Feed::Queue, {44100, CHANNELS, UHDA_FORMAT_PCM16}, false},
+	{"zero-copy, 2 virtual", 0, Feed::Mixer, {}, false}
+};
+
+struct Result {
+	uint64_t periods;
+	uint64_t irqs;
+	double avg_irq_ns;
+	uint32_t p99_irq_ns;
+	uint32_t max_irq_ns;
+	double copied_per_period;
+	double client_per_period;
+	uint64_t max_irq_off_ns;
+	uint64_t max_irq_off_delay_ns;
+	uint64_t underruns;
+};
+
+static void queue_client_data(
+	UhdaStream* stream,
+	UhdaVirtualStream* const* virtual_streams,
+	Client& client,
+	std::vector<uint8_t>& pending) {
+	while (true) {
+		if (pending.empty()) {
+			client.generate(pending, PERIOD_SIZE);
+		}
+
+		auto size = static_cast<uint32_t>(pending.size());
+		if (virtual_streams) {
+			// both virtual streams get the same data so that they stay in step
+			uint32_t remaining[2];
+			CHECK_STATUS(uhda_virtual_stream_get_remaining(virtual_streams[0], &remaining[0]));
+			CHECK_STATUS(uhda_virtual_stream_get_remaining(virtual_streams[1], &remaining[1]));
+			if (std::max(remaining[0], remaining[1]) + size > RING_SIZE) {
+				return;
+			}
+			for (int i = 0; i < 2; ++i) {
+				auto written = size;
+				CHECK_STATUS(uhda_virtual_stream_queue_data(virtual_streams[i], pending.data(), &written));
+			}
+		}
+		else {
+			CHECK_STATUS(uhda_stream_queue_data(stream, pending.data(), &size));
+		}
+
+		client.bytes += size;
+		pending.erase(pending.begin(), pending.begin() + size);
+		if (!size || !pending.empty()) {
+			return;
+		}
+	}
+}
+
+static Result run_scenario(const Scenario& scenario, UhdaStream* stream) {
+	UhdaStreamParams params {SAMPLE_RATE, CHANNELS, UHDA_FORMAT_PCM16};
+	UhdaStreamBufferParams buffer_params {PERIOD_SIZE, PERIOD_COUNT, TARGET_LATENCY_US, 0, 0};
+
+	Client client {};
+	client.float_source = scenario.source.fmt == UHDA_FORMAT_FLOAT32;
+	bool fill = scenario.feed == Feed::Fill;
+	CHECK_STATUS(uhda_stream_setup(
+		stream,
+		&params,
+		&buffer_params,
+		scenario.ring_size,
+		fill ? Client::fill_fn : nullptr,
+		fill ? &client : nullptr,
+		0,
+		nullptr,
+		nullptr));
+
+	if (scenario.source.sample_rate) {
+		CHECK_STATUS(uhda_stream_set_source_format(stream, &scenario.source));
+	}
+
+	UhdaVirtualStream* virtual_streams[2] {};
+	if (scenario.feed == Feed::Mixer) {
+		CHECK_STATUS(uhda_stream_create_virtual(stream, RING_SIZE, &virtual_streams[0]));
+		CHECK_STATUS(uhda_stream_create_virtual(stream, RING_SIZE, &virtual_streams[1]));
+		CHECK_STATUS(uhda_virtual_stream_set_volume(virtual_streams[1], 50));
+	}
+	auto* virtual_ptrs = scenario.feed == Feed::Mixer ? virtual_streams : nullptr;
+
+	std::vector<uint8_t> pending;
+	if (!fill) {
+		queue_client_data(stream, virtual_ptrs, client, pending);
+	}
+	CHECK_STATUS(uhda_stream_play(stream, true));
+
+	UhdaStreamStats stream_stats;
+	auto start = host_get_time_ns();
+	bool measuring = false;
+	bool gain_low = false;
+	uint32_t client_steps = 0;
+	while (host_get_time_ns() - start < WARMUP_NS + RUN_NS) {
+		if (!measuring && host_get_time_ns() - start >= WARMUP_NS) {
+			measuring = true;
+			host_reset_stats();
+			CHECK_STATUS(uhda_stream_get_stats(stream, &stream_stats, true));
+			client.bytes = 0;
+		}
+
+		host_run(CLIENT_INTERVAL_NS);
+		++client_steps;
+
+		if (!fill) {
+			queue_client_data(stream, virtual_ptrs, client, pending);
+		}
+		// a 20ms fade every 100ms
+		if (scenario.gain_ramps && client_steps % 20 == 0) {
+			gain_low = !gain_low;
+			CHECK_STATUS(uhda_stream_set_gain(stream, gain_low ? 30 : 100, 20000));
+		}
+	}
+
+	auto& stats = host_get_stats();
+	CHECK_STATUS(uhda_stream_get_stats(stream, &stream_stats, true));
+
+	CHECK_STATUS(uhda_stream_play(stream, false));
+	for (auto* virtual_stream : virtual_streams) {
+		if (virtual_stream) {
+			CHECK_STATUS(uhda_virtual_stream_destroy(virtual_stream));
+		}
+	}
+	if (scenario.source.sample_rate) {
+		CHECK_STATUS(uhda_stream_set_source_format(stream, nullptr));
+	}
+	if (scenario.gain_ramps) {
+		CHECK_STATUS(uhda_stream_set_gain(stream, 100, 0));
+	}
+	CHECK_STATUS(uhda_stream_shutdown(stream));
+
+	Result result {};
+	result.periods = stats.stream_irqs[STREAM_TRACE_ID];
+	result.irqs = stats.irq_count;
+	result.max_irq_off_ns = stats.max_irq_off_ns;
+	result.max_irq_off_delay_ns = stats.max_irq_off_delay_ns;
+	result.underruns = stream_stats.underruns;
+	if (stats.irq_count) {
+		auto samples = stats.irq_samples_ns;
+		std::sort(samples.begin(), samples.end());
+		result.avg_irq_ns = static_cast<double>(stats.irq_ns) / static_cast<double>(stats.irq_count);
+		result.p99_irq_ns = samples[samples.size() * 99 / 100];
+		result.max_irq_ns = samples.back();
+	}
+	if (result.periods) {
+		auto periods = static_cast<double>(result.periods);
+		result.copied_per_period = static_cast<double>(stats.dma_write_bytes[STREAM_TRACE_ID]) / periods;
+		result.client_per_period = static_cast<double>(client.bytes) / periods;
+	}
+	return result;
+}
+
+struct InitResult {
+	uint64_t verbs;
+	uint64_t batches;
+	uint64_t simulated_us;
+	uint64_t wall_us;
+	uint64_t max_irq_off_ns;
+	uint64_t max_irq_off_delay_ns;
+};
+
+static InitResult run_init(Controller& controller, const void* topology, size_t topology_size, UhdaController** res) {
+	host_reset_stats();
+	auto verbs = controller.get_verb_count();
+	auto simulated_start = host_get_time_ns();
+	auto wall_start = wall_ns();
+
+	if (topology) {
+		CHECK_STATUS(uhda_init_with_topology(&controller, topology, topology_size, res));
+	}
+	else {
+		CHECK_STATUS(uhda_init(&controller, res));
+	}
+
+	auto& stats = host_get_stats();
+	return {
+		controller.get_verb_count() - verbs,
+		stats.verb_batches,
+		(host_get_time_ns() - simulated_start) / 1000,
+		(wall_ns() - wall_start) / 1000,
+		stats.max_irq_off_ns,
+		stats.max_irq_off_delay_ns
+	};
+}
+
+static void print_init(const char* name, const InitResult& result) {
+	printf(
+		"%-22s %8llu %8llu %10llu %10llu %14llu %14llu\n",
+		name,
+		static_cast<unsigned long long>(result.verbs),
+		static_cast<unsigned long long>(result.batches),
+		static_cast<unsigned long long>(result.simulated_us),
+		static_cast<unsigned long long>(result.wall_us),
+		static_cast<unsigned long long>(result.max_irq_off_ns),
+		static_cast<unsigned long long>(result.max_irq_off_delay_ns / 1000));
+}
+
+static const UhdaOutput* find_speaker(UhdaController* controller) {
+	const UhdaCodec* const* codecs;
+	size_t codec_count;
+	uhda_get_codecs(controller, &codecs, &codec_count);
+
+	const UhdaOutput* first = nullptr;
+	for (size_t i = 0; i < codec_count; ++i) {
+		const UhdaOutputGroup* const* groups;
+		size_t group_count;
+		uhda_codec_get_output_groups(codecs[i], &groups, &group_count);
+		for (size_t j = 0; j < group_count; ++j) {
+			const UhdaOutput* const* outputs;
+			size_t output_count;
+			uhda_output_group_get_outputs(groups[j], &outputs, &output_count);
+			for (size_t k = 0; k < output_count; ++k) {
+				if (uhda_output_get_info(outputs[k]).type == UHDA_OUTPUT_TYPE_SPEAKER) {
+					return outputs[k];
+				}
+				if (!first) {
+					first = outputs[k];
+				}
+			}
+		}
+	}
+	return first;
+}
+
+int main(int argc, char** argv) {
+	std::string script = DEFAULT_CODEC_SCRIPT;
+	if (argc > 1) {
+		std::ifstream file {argv[1]};
+		if (!file) {
+			fprintf(stderr, "bench: failed to open %s\n", argv[1]);
+			return 1;
+		}
+		std::stringstream stream;
+		stream << file.rdbuf();
+		script = stream.str();
+	}
+
+	std::vector<Codec> codecs;
+	std::string error;
+	if (!Codec::parse(script, codecs, error)) {
+		fprintf(stderr, "bench: invalid codec script: %s\n", error.c_str());
+		return 1;
+	}
+
+	Controller controller {std::move(codecs), 4, 4};
+	host_add_controller(&controller);
+
+	printf(
+		"%-22s %8s %8s %10s %10s %14s %14s\n",
+		"init",
+		"verbs",
+		"batches",
+		"sim us",
+		"wall us",
+		"max irq-off ns",
+		"irq-off wait us");
+
+	UhdaController* uhda;
+	auto init = run_init(controller, nullptr, 0, &uhda);
+	print_init("enumerate", init);
+
+	size_t topology_size = 0;
+	uhda_get_topology(uhda, nullptr, &topology_size);
+	std::vector<uint8_t> topology(topology_size);
+	CHECK_STATUS(uhda_get_topology(uhda, topology.data(), &topology_size));
+	CHECK_STATUS(uhda_destroy(uhda));
+
+	init = run_init(controller, topology.data(), topology_size, &uhda);
+	print_init("cached topology", init);
+
+	auto* output = find_speaker(uhda);
+	if (!output) {
+		fprintf(stderr, "bench: the codec script has no outputs\n");
+		return 1;
+	}
+
+	UhdaPath* path;
+	CHECK_STATUS(uhda_find_path(output, nullptr, 0, false, &path));
+
+	UhdaStream** streams;
+	size_t stream_count;
+	uhda_get_output_streams(uhda, &streams, &stream_count);
+	if (!stream_count) {
+		fprintf(stderr, "bench: the controller has no output streams\n");
+		return 1;
+	}
+
+	UhdaStreamParams params {SAMPLE_RATE, CHANNELS, UHDA_FORMAT_PCM16};
+	CHECK_STATUS(uhda_path_setup(path, &params, streams[0]));
+
+	printf(
+		"\n%-22s %8s %8s %8s %8s %8s %10s %10s %14s %14s %9s\n",
+		"stream",
+		"periods",
+		"irqs",
+		"avg ns",
+		"p99 ns",
+		"max ns",
+		"copied B",
+		"client B",
+		"max irq-off ns",
+		"irq-off wait us",
+		"underruns");
+
+	for (auto& scenario : SCENARIOS) {
+		auto result = run_scenario(scenario, streams[0]);
+		printf(
+			"%-22s %8llu %8llu %8.0f %8u %8u %10.0f %10.0f %14llu %14llu %9llu\n",
+			scenario.name,
+			static_cast<unsigned long long>(result.periods),
+			static_cast<unsigned long long>(result.irqs),
+			result.avg_irq_ns,
+			result.p99_irq_ns,
+			result.max_irq_ns,
+			result.copied_per_period,
+			result.client_per_period,
+			static_cast<unsigned long long>(result.max_irq_off_ns),
+			static_cast<unsigned long long>(result.max_irq_off_delay_ns / 1000),
+			static_cast<unsigned long long>(result.underruns));
+	}
+
+	printf(
+		"\nperiods of %u bytes, copied B and client B are per period: the bytes uHDA wrote to the DMA buffer\n"
+		"and the bytes the client produced. the times are wall time of this host, the simulation runs\n"
+		"%llu ms of audio per stream after %llu ms of warmup.\n",
+		PERIOD_SIZE,
+		static_cast<unsigned long long>(RUN_NS / NS_PER_MS),
+		static_cast<unsigned long long>(WARMUP_NS / NS_PER_MS));
+
+	CHECK_STATUS(uhda_path_shutdown(path));
+	CHECK_STATUS(uhda_destroy(uhda));
+	host_remove_controller(&controller);
+	return 0;
+}
@@ -0,0 +1,445 @@
+#include "codec_script.hpp"
+#include "spec.hpp"
+#include <algorithm>
+#include <stdlib.h>
+
+using namespace uhda;
+using namespace hosted;
+
+// the verbs and parameters that uHDA only sends, but the emulated codec also has to answer
+static constexpr uint16_t GET_POWER_STATE = 0xF05;
+static constexpr uint8_t SUPPORTED_POWER_STATES = 0xF;
+
+static constexpr uint8_t AFG_NID = 1;
+
+static bool parse_hex(std::string_view str, uint32_t& value) {
+	if (str.empty() || str.size() > 8) {
+		return false;
+	}
+
+	value = 0;
+	for (char c : str) {
+		uint32_t digit;
+		if (c >= '0' && c <= '9') {
+			digit = c - '0';
+		}
+		else if (c >= 'a' && c <= 'f') {
+			digit = c - 'a' + 10;
+		}
+		else if (c >= 'A' && c <= 'F') {
+			digit = c - 'A' + 10;
+		}
+		else {
+			return false;
+		}
+		value = value << 4 | digit;
+	}
+	return true;
+}
+
+static std::vector<std::string_view> split(std::string_view str, char separator) {
+	std::vector<std::string_view> parts;
+	while (!str.empty()) {
+		auto end = std::min(str.find(separator), str.size());
+		if (end) {
+			parts.push_back(str.substr(0, end));
+		}
+		str.remove_prefix(end == str.size() ? end : end + 1);
+	}
+	return parts;
+}
+
+// the widgets are only known after all the lines of a codec were parsed
+struct ScriptWidget {
+	uint8_t nid;
+	Widget widget;
+};
+
+static void finish_codec(Codec& codec, std::vector<ScriptWidget>& script_widgets) {
+	if (script_widgets.empty()) {
+		return;
+	}
+
+	uint8_t first = 0xFF;
+	uint8_t last = 0;
+	for (auto& script_widget : script_widgets) {
+		first = std::min(first, script_widget.nid);
+		last = std::max(last, script_widget.nid);
+	}
+
+	codec.start_nid = first;
+	codec.widgets.resize(last - first + 1);
+	for (auto& script_widget : script_widgets) {
+		codec.widgets[script_widget.nid - first] = std::move(script_widget.widget);
+	}
+	script_widgets.clear();
+}
+
+bool Codec::parse(std::string_view script, std::vector<Codec>& codecs, std::string& error) {
+	std::vector<ScriptWidget> script_widgets;
+	Codec* codec = nullptr;
+
+	uint32_t line_number = 0;
+	for (auto line : split(script, '\n')) {
+		++line_number;
+		auto comment = line.find('#');
+		if (comment != std::string_view::npos) {
+			line = line.substr(0, comment);
+		}
+
+		auto words = split(line, ' ');
+		if (words.empty()) {
+			continue;
+		}
+
+		auto fail = [&](std::string_view msg) {
+			error = "line " + std::to_string(line_number) + ": " + std::string {msg};
+			return false;
+		};
+
+		auto keyword = words[0];
+		if (keyword == "codec") {
+			uint32_t cid;
+			if (words.size() < 2 || !parse_hex(words[1], cid) || cid > 14) {
+				return fail("expected a codec address");
+			}
+			if (codec) {
+				finish_codec(*codec, script_widgets);
+			}
+			codec = &codecs.emplace_back();
+			codec->cid = cid;
+		}
+		else if (!codec) {
+			return fail("expected a codec line first");
+		}
+
+		Widget* widget = nullptr;
+		size_t first_attr = 1;
+		if (keyword == "codec") {
+			first_attr = 2;
+		}
+		else if (keyword == "widget") {
+			uint32_t nid;
+			if (words.size() < 2 || !parse_hex(words[1], nid) || nid <= AFG_NID || nid > 0xFF) {
+				return fail("expected a widget nid");
+			}
+			for (auto& script_widget : script_widgets) {
+				if (script_widget.nid == nid) {
+					return fail("duplicate widget");
+				}
+			}
+			widget = &script_widgets.emplace_back(static_cast<uint8_t>(nid)).widget;
+			first_attr = 2;
+		}
+		else if (keyword != "afg") {
+			return fail("unknown keyword");
+		}
+
+		for (size_t i = first_attr; i < words.size(); ++i) {
+			auto attr = words[i];
+			if (widget && attr == "present") {
+				widget->present = true;
+				continue;
+			}
+
+			auto equals = attr.find('=');
+			if (equals == std::string_view::npos) {
+				return fail("expected a key=value attribute");
+			}
+			auto key = attr.substr(0, equals);
+			auto value_str = attr.substr(equals + 1);
+
+			if (widget && key == "conn") {
+				for (auto nid_str : split(value_str, ',')) {
+					uint32_t nid;
+					if (!parse_hex(nid_str, nid) || nid > 0xFF) {
+						return fail("malformed connection list");
+					}
+					widget->conns.push_back(static_cast<uint8_t>(nid));
+				}
+				continue;
+			}
+
+			uint32_t value;
+			if (!parse_hex(value_str, value)) {
+				return fail("malformed hex value");
+			}
+
+			uint32_t* field = nullptr;
+			if (keyword == "codec") {
+				if (key == "vendor") {
+					field = &codec->vendor_id;
+				}
+				else if (key == "revision") {
+					field = &codec->revision_id;
+				}
+			}
+			else if (keyword == "afg") {
+				if (key == "pcm") {
+					field = &codec->afg_pcm_size_rate;
+				}
+				else if (key == "formats") {
+					field = &codec->afg_stream_formats;
+				}
+				else if (key == "in_amp") {
+					field = &codec->afg_in_amp_caps;
+				}
+				else if (key == "out_amp") {
+					field = &codec->afg_out_amp_caps;
+				}
+			}
+			else if (key == "caps") {
+				field = &widget->audio_caps;
+			}
+			else if (key == "pcm") {
+				field = &widget->pcm_size_rate;
+			}
+			else if (key == "formats") {
+				field = &widget->stream_formats;
+			}
+			else if (key == "pin") {
+				field = &widget->pin_caps;
+			}
+			else if (key == "in_amp") {
+				field = &widget->in_amp_caps;
+			}
+			else if (key == "out_amp") {
+				field = &widget->out_amp_caps;
+			}
+			else if (key == "config") {
+				field = &widget->config;
+			}
+
+			if (!field) {
+				return fail("unknown attribute");
+			}
+			*field = value;
+		}
+	}
+
+	if (!codec) {
+		error = "no codecs";
+		return false;
+	}
+	finish_codec(*codec, script_widgets);
+	return true;
+}
+
+Widget* Codec::get_widget(uint8_t nid) {
+	if (nid < start_nid || static_cast<size_t>(nid - start_nid) >= widgets.size()) {
+		return nullptr;
+	}
+	return &widgets[nid - start_nid];
+}
+
+void Codec::reset() {
+	afg_power_state = 0;
+	for (auto& widget : widgets) {
+		widget.state = {};
+	}
+}
+
+bool Codec::set_presence(uint8_t nid, bool present, uint32_t& res) {
+	auto* widget = get_widget(nid);
+	if (!widget || widget->present == present) {
+		return false;
+	}
+
+	widget->present = present;
+	if (!(widget->state.unsol & 1 << 7)) {
+		return false;
+	}
+	// the tag is in the top 6 bits of the response
+	res = static_cast<uint32_t>(widget->state.unsol & 0x3F) << 26;
+	return true;
+}
+
+static uint32_t get_amp(const WidgetState& state, uint16_t data) {
+	bool output = data & 1 << 15;
+	int side = data & 1 << 13 ? 0 : 1;
+	return output ? state.out_amp[side] : state.in_amp[data & 0xF][side];
+}
+
+static void set_amp(WidgetState& state, uint16_t data) {
+	auto value = static_cast<uint8_t>(data);
+	auto index = data >> 8 & 0xF;
+	for (int side = 0; side < 2; ++side) {
+		if (!(data & 1 << (13 - side))) {
+			continue;
+		}
+		if (data & 1 << 15) {
+			state.out_amp[side] = value;
+		}
+		if (data & 1 << 14) {
+			state.in_amp[index][side] = value;
+		}
+	}
+}
+
+uint32_t Codec::handle_verb(uint8_t nid, uint32_t payload) {
+	++stats.verbs;
+
+	// the verbs with a 12-bit command start with 7 or F, the rest have a 4-bit command and 16-bit data
+	uint16_t command;
+	uint16_t data;
+	if ((payload >> 16) == 0x7 || (payload >> 16) == 0xF) {
+		command = payload >> 8;
+		data = payload & 0xFF;
+	}
+	else {
+		command = payload >> 16;
+		data = payload & 0xFFFF;
+	}
+
+	if (command == cmd::SET_CONVERTER_FORMAT || command == cmd::SET_AMP_GAIN_MUTE || (command >> 8) == 0x7) {
+		++stats.set_verbs;
+	}
+
+	if (nid == 0) {
+		if (command != cmd::GET_PARAM) {
+			return 0;
+		}
+		switch (data) {
+			case param::VENDOR_ID:
+				return vendor_id;
+			case param::REVISION_ID:
+				return revision_id;
+			case param::NODE_COUNT:
+				return AFG_NID << 16 | 1;
+			default:
+				return 0;
+		}
+	}
+
+	if (nid == AFG_NID) {
+		switch (command) {
+			case cmd::GET_PARAM:
+				switch (data) {
+					case param::VENDOR_ID:
+						return vendor_id;
+					case param::REVISION_ID:
+						return revision_id;
+					case param::NODE_COUNT:
+						return static_cast<uint32_t>(start_nid) << 16 | widgets.size();
+					case param::FUNC_GROUP_TYPE:
+						return func_group_type::AUDIO;
+					case param::PCM_SIZE_RATE:
+						return afg_pcm_size_rate;
+					case param::STREAM_FORMATS:
+						return afg_stream_formats;
+					case param::IN_AMP_CAPS:
+						return afg_in_amp_caps;
+					case param::OUT_AMP_CAPS:
+						return afg_out_amp_caps;
+					case SUPPORTED_POWER_STATES:
+						return 0xF;
+					default:
+						return 0;
+				}
+			case cmd::SET_POWER_STATE:
+				afg_power_state = data & 0xF;
+				return 0;
+			case GET_POWER_STATE:
+				// the actual state is reached immediately
+				return afg_power_state << 4 | afg_power_state;
+			default:
+				return 0;
+		}
+	}
+
+	auto* widget = get_widget(nid);
+	if (!widget) {
+		return 0;
+	}
+	auto& state = widget->state;
+
+	switch (command) {
+		case cmd::GET_PARAM:
+			switch (data) {
+				case param::AUDIO_CAPS:
+					return widget->audio_caps;
+				case param::PCM_SIZE_RATE:
+					return widget->pcm_size_rate;
+				case param::STREAM_FORMATS:
+					return widget->stream_formats;
+				case param::PIN_CAPS:
+					return widget->pin_caps;
+				case param::IN_AMP_CAPS:
+					return widget->in_amp_caps;
+				case param::OUT_AMP_CAPS:
+					return widget->out_amp_caps;
+				case param::CONN_LIST_LEN:
+					return widget->conns.size();
+				case SUPPORTED_POWER_STATES:
+					return 0xF;
+				default:
+					return 0;
+			}
+		case cmd::GET_CONN_LIST:
+		{
+			// four short form entries per response starting from the index in the data
+			uint32_t res = 0;
+			for (uint32_t i = 0; i < 4 && data + i < widget->conns.size(); ++i) {
+				res |= static_cast<uint32_t>(widget->conns[data + i]) << (i * 8);
+			}
+			return res;
+		}
+		case cmd::GET_CONFIG_DEFAULT:
+			return widget->config;
+		case cmd::GET_PIN_SENSE:
+			return widget->present ? 1U << 31 : 0;
+		case cmd::GET_AMP_GAIN_MUTE:
+			return get_amp(state, data);
+		case cmd::SET_AMP_GAIN_MUTE:
+			set_amp(state, data);
+			return 0;
+		case cmd::GET_CONVERTER_FORMAT:
+			return state.converter_format;
+		case cmd::SET_CONVERTER_FORMAT:
+			state.converter_format = data;
+			return 0;
+		case cmd::GET_CONN_SELECT:
+			return state.conn_select;
+		case cmd::SET_CONN_SELECT:
+			state.conn_select = data;
+			return 0;
+		case GET_POWER_STATE:
+			return state.power_state << 4 | state.power_state;
+		case cmd::SET_POWER_STATE:
+			state.power_state = data & 0xF;
+			return 0;
+		case cmd::GET_CONVERTER_CONTROL:
+			return state.converter_control;
+		case cmd::SET_CONVERTER_CONTROL:
+			state.converter_control = data;
+			return 0;
+		case cmd::GET_CONVERTER_CHANNEL_COUNT:
+			return state.channel_count;
+		case cmd::SET_CONVERTER_CHANNEL_COUNT:
+			state.channel_count = data;
+			return 0;
+		case cmd::GET_PIN_CONTROL:
+			return state.pin_control;
+		case cmd::SET_PIN_CONTROL:
+			state.pin_control = data;
+			return 0;
+		case cmd::SET_UNSOL_ENABLE:
+			state.unsol = data;
+			return 0;
+		case cmd::GET_EAPD_ENABLE:
+			return state.eapd;
+		case cmd::SET_EAPD_ENABLE:
+			state.eapd = data;
+			return 0;
+		case cmd::GET_DIGI_CONVERTER:
+			return state.digi[0] | state.digi[1] << 8;
+		case cmd::SET_DIGI_CONVERTER_1:
+			state.digi[0] = data;
+			return 0;
+		case cmd::SET_DIGI_CONVERTER_2:
+			state.digi[1] = data;
+			return 0;
+		default:
+			return 0;
+	}
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace hosted {
+	// state written by the verbs, the amps start muted like on most codecs
+	struct WidgetState {
+		uint8_t out_amp[2] {0x80, 0x80};
+		uint8_t in_amp[16][2] {};
+		uint16_t converter_format {};
+		uint8_t conn_select {};
+		uint8_t power_state {};
+		uint8_t converter_control {};
+		uint8_t channel_count {};
+		uint8_t pin_control {};
+		uint8_t unsol {};
+		uint8_t eapd {};
+		uint8_t digi[2] {};
+	};
+
+	// parameters from the script
+	struct Widget {
+		uint32_t audio_caps {0xFU << 20};
+		uint32_t pcm_size_rate {};
+		uint32_t stream_formats {};
+		uint32_t pin_caps {};
+		uint32_t in_amp_caps {};
+		uint32_t out_amp_caps {};
+		uint32_t config {};
+		std::vector<uint8_t> conns;
+		bool present {};
+		WidgetState state {};
+	};
+
+	struct CodecStats {
+		// verbs answered and how many of them changed the codec state
+		uint64_t verbs;
+		uint64_t set_verbs;
+	};
+
+	// an emulated codec with a single audio function group at node 1,
+	// its widgets are described by a script:
+	//
+	//   # comment
+	//   codec <address> [vendor=<hex>] [revision=<hex>]
+	//   afg [pcm=<hex>] [formats=<hex>] [in_amp=<hex>] [out_amp=<hex>]
+	//   widget <nid> caps=<hex> [pcm=<hex>] [formats=<hex>] [pin=<hex>] [in_amp=<hex>] [out_amp=<hex>]
+	//          [config=<hex>] [conn=<nid>,<nid>...] [present]
+	//
+	// the values are the raw parameters the codec returns, with the nids in hex.
+	// the widgets of a codec form a contiguous range of nids, the gaps are vendor defined widgets.
+	class Codec {
+	public:
+		// parses all the codecs in a script, returns false and sets `error` if it's malformed
+		static bool parse(std::string_view script, std::vector<Codec>& codecs, std::string& error);
+
+		// handles a verb sent to the codec and returns the response
+		uint32_t handle_verb(uint8_t nid, uint32_t payload);
+
+		// puts the widgets back to their power-on state, done when the link is reset
+		void reset();
+
+		// changes the presence of a pin, returns true and sets `res` if an unsolicited response is sent
+		bool set_presence(uint8_t nid, bool present, uint32_t& res);
+
+		Widget* get_widget(uint8_t nid);
+
+		uint8_t cid {};
+		uint32_t vendor_id {0x10EC0269};
+		uint32_t revision_id {0x100100};
+		uint32_t afg_pcm_size_rate {0x000E07E0};
+		uint32_t afg_stream_formats {1};
+		uint32_t afg_in_amp_caps {};
+		uint32_t afg_out_amp_caps {};
+		uint8_t afg_power_state {};
+		uint8_t start_nid {};
+		std::vector<Widget> widgets;
+		CodecStats stats {};
+	};
+}
@@ -0,0 +1,348 @@
+#include "emulator.hpp"
+#include "spec.hpp"
+#include <stdlib.h>
+#include <string.h>
+
+using namespace uhda;
+using namespace hosted;
+
+static constexpr size_t REGISTER_FILE_SIZE = 0x4000;
+// the time is advanced in steps that are shorter than a link frame
+static constexpr uint64_t STEP_NS = 10000;
+static constexpr uint64_t NS_PER_SECOND = 1000000000;
+static constexpr uint64_t LINK_FRAME_RATE = 48000;
+static constexpr uint32_t WALL_CLOCK_MHZ = 24;
+
+// both rings support only 256 entries
+static constexpr uint8_t RING_SIZE_CAPS = corbsize::SZCAP(0b100) | corbsize::SIZE(0b10);
+
+Controller::Controller(std::vector<Codec> codecs, uint8_t in_stream_count, uint8_t out_stream_count)
+	: in_stream_count {in_stream_count}, out_stream_count {out_stream_count},
+	registers {static_cast<uint8_t*>(aligned_alloc(0x1000, REGISTER_FILE_SIZE))},
+	space {reinterpret_cast<uintptr_t>(registers)}, codecs {std::move(codecs)},
+	streams(in_stream_count + out_stream_count) {
+	memset(registers, 0, REGISTER_FILE_SIZE);
+	reset();
+}
+
+Controller::~Controller() {
+	free(registers);
+}
+
+void Controller::reset() {
+	in_reset = true;
+
+	// everything except the bits that uHDA sets to take the controller out of reset goes back to the defaults
+	memset(registers, 0, REGISTER_FILE_SIZE);
+	space.store(
+		regs::GCAP,
+		gcap::OK64(true) | gcap::ISS(in_stream_count) | gcap::OSS(out_stream_count));
+	space.store(regs::VMAJ, 1);
+	space.store(regs::OUTPAY, 0x3C);
+	space.store(regs::INPAY, 0x1D);
+	space.store(regs::CORBSIZE, RING_SIZE_CAPS);
+	space.store(regs::RIRBSIZE, RING_SIZE_CAPS);
+
+	for (uint32_t i = 0; i < streams.size(); ++i) {
+		streams[i] = {};
+		auto stream_space = space.subspace(0x80 + i * 0x20);
+		stream_space.store(regs::stream::FIFOS, i < in_stream_count ? 0x77 : 0xFF);
+	}
+
+	for (auto& codec : codecs) {
+		codec.reset();
+	}
+	pending_unsol.clear();
+	responses_since_irq = 0;
+}
+
+Codec* Controller::get_codec(uint8_t cid) {
+	for (auto& codec : codecs) {
+		if (codec.cid == cid) {
+			return &codec;
+		}
+	}
+	return nullptr;
+}
+
+uint64_t Controller::get_verb_count() const {
+	uint64_t count = 0;
+	for (auto& codec : codecs) {
+		count += codec.stats.verbs;
+	}
+	return count;
+}
+
+void Controller::set_presence(uint8_t cid, uint8_t nid, bool present) {
+	auto* codec = get_codec(cid);
+	uint32_t res;
+	if (codec && codec->set_presence(nid, present, res)) {
+		pending_unsol.push_back({res, static_cast<uint32_t>(cid) | 1 << 4});
+	}
+}
+
+void Controller::push_response(uint32_t res, uint32_t res_ex, bool last) {
+	auto rirbctl = space.load(regs::RIRBCTL);
+	if (!(rirbctl & rirbctl::DMAEN)) {
+		return;
+	}
+
+	auto rirb_phys = space.load(regs::RIRBLBASE) | static_cast<uint64_t>(space.load(regs::RIRBUBASE)) << 32;
+	auto* rirb = reinterpret_cast<ResponseDescriptor*>(rirb_phys);
+
+	// the write pointer is the last entry written
+	auto wp = static_cast<uint8_t>((space.load(regs::RIRBWP) & rirbwp::WP) + 1);
+	rirb[wp] = {res, res_ex};
+	space.store(regs::RIRBWP, wp);
+
+	// the interrupt comes after the response count or once there are no more responses
+	uint32_t count = space.load(regs::RINTCNT) & 0xFF;
+	if (++responses_since_irq >= (count ? count : 256) || last) {
+		responses_since_irq = 0;
+		if (rirbctl & rirbctl::INTCTL) {
+			space.store(regs::RIRBSTS, space.load(regs::RIRBSTS) | rirbsts::INTFL(true));
+		}
+	}
+}
+
+void Controller::run_link_frame() {
+	// a write of the reset bit holds the read pointer at zero until it's cleared
+	auto corbrp = space.load(regs::CORBRP);
+	if (corbrp & corbrp::RST) {
+		space.store(regs::CORBRP, corbrp::RST(true));
+		return;
+	}
+
+	if (space.load(regs::RIRBWP) & rirbwp::RST) {
+		space.store(regs::RIRBWP, 0);
+	}
+
+	// unsolicited responses take the place of a solicited one in the frame
+	if (!pending_unsol.empty() && (space.load(regs::GCTL) & gctl::UNSOL)) {
+		auto response = pending_unsol.front();
+		pending_unsol.erase(pending_unsol.begin());
+		push_response(response.res, response.res_ex, true);
+		return;
+	}
+
+	if (!(space.load(regs::CORBCTL) & corbctl::RUN)) {
+		return;
+	}
+
+	uint8_t rp = corbrp & corbrp::RP;
+	uint8_t wp = space.load(regs::CORBWP) & corbwp::WP;
+	if (rp == wp) {
+		return;
+	}
+
+	auto corb_phys = space.load(regs::CORBLBASE) | static_cast<uint64_t>(space.load(regs::CORBUBASE)) << 32;
+	auto* corb = reinterpret_cast<const volatile uint32_t*>(corb_phys);
+
+	++rp;
+	BitValue<uint32_t> verb_value {corb[rp]};
+	space.store(regs::CORBRP, rp);
+
+	auto cid = verb_value & verb::CODEC_ADDRESS;
+	auto* codec = get_codec(cid);
+	// a verb to an address without a codec is never answered
+	if (codec) {
+		auto res = codec->handle_verb(verb_value & verb::NODE_ID, verb_value & verb::PAYLOAD);
+		push_response(res, cid, rp == wp);
+	}
+}
+
+// bytes of a sample in memory, the 20 and 24-bit samples are in 32-bit containers
+static uint32_t get_container_size(uint8_t bits) {
+	switch (bits) {
+		case sdfmt::BITS_8:
+			return 1;
+		case sdfmt::BITS_16:
+			return 2;
+		default:
+			return 4;
+	}
+}
+
+void Controller::run_stream(uint32_t index, uint64_t delta_ns) {
+	auto stream_space = space.subspace(0x80 + index * 0x20);
+	auto& stream = streams[index];
+	auto ctl0 = stream_space.load(regs::stream::CTL0);
+	auto sts = stream_space.load(regs::stream::STS);
+
+	auto dplbase = space.load(regs::DPLBASE);
+	uint32_t* dma_pos = nullptr;
+	if (dplbase & dplbase::DPBE) {
+		auto dpl_phys = (dplbase & ~0x7FU) | static_cast<uint64_t>(space.load(regs::DPUBASE)) << 32;
+		dma_pos = reinterpret_cast<uint32_t*>(dpl_phys) + index * 2;
+	}
+
+	if (ctl0 & sdctl0::RST) {
+		stream = {};
+		stream_space.store(regs::stream::LPIB, 0);
+		stream_space.store(regs::stream::STS, 0);
+		if (dma_pos) {
+			*dma_pos = 0;
+		}
+		return;
+	}
+
+	bool output = index >= in_stream_count;
+	if (!(ctl0 & sdctl0::RUN)) {
+		if (sts & sdsts::FIFORDY) {
+			sts &= ~sdsts::FIFORDY;
+			stream_space.store(regs::stream::STS, sts);
+		}
+		return;
+	}
+
+	// the fifo of an output stream is filled as soon as it runs, it's then held by the stream synchronization
+	if (output && !(sts & sdsts::FIFORDY)) {
+		sts |= sdsts::FIFORDY(true);
+		stream_space.store(regs::stream::STS, sts);
+	}
+	if (space.load(regs::SSYNC) & 1U << index) {
+		return;
+	}
+
+	auto fmt = stream_space.load(regs::stream::FMT);
+	uint64_t rate_mul = (fmt & sdfmt::BASE ? 44100 : 48000) * ((fmt & sdfmt::MULT) + 1);
+	uint64_t rate_div = ((fmt & sdfmt::DIV) + 1) * NS_PER_SECOND;
+	uint32_t frame_size = ((fmt & sdfmt::CHAN) + 1) * get_container_size(fmt & sdfmt::BITS);
+
+	auto time = delta_ns * rate_mul + stream.time_remainder;
+	uint64_t size = time / rate_div * frame_size;
+	stream.time_remainder = time % rate_div;
+
+	auto bdl_phys = stream_space.load(regs::stream::BDPL) |
+		static_cast<uint64_t>(stream_space.load(regs::stream::BDPU)) << 32;
+	auto* bdl = reinterpret_cast<const BufferDescriptor*>(bdl_phys);
+	uint32_t lvi = stream_space.load(regs::stream::LVI) & 0xFF;
+	auto cbl = stream_space.load(regs::stream::CBL);
+	if (!bdl || !cbl) {
+		return;
+	}
+
+	while (size) {
+		auto& desc = bdl[stream.entry];
+		auto chunk = desc.length - stream.entry_offset;
+		if (chunk > size) {
+			chunk = size;
+		}
+
+		// the input streams capture a counting pattern
+		if (!output) {
+			auto* ptr = reinterpret_cast<uint8_t*>(desc.address) + stream.entry_offset;
+			for (uint32_t i = 0; i < chunk; ++i) {
+				ptr[i] = static_cast<uint8_t>(stream.bytes + i);
+			}
+		}
+
+		stream.bytes += chunk;
+		stream.entry_offset += chunk;
+		stream.lpib += chunk;
+		if (stream.lpib >= cbl) {
+			stream.lpib -= cbl;
+		}
+		size -= chunk;
+
+		if (stream.entry_offset == desc.length) {
+			stream.entry_offset = 0;
+			stream.entry = stream.entry == lvi ? 0 : stream.entry + 1;
+			++stream.completions;
+			if ((desc.ioc & 1) && (ctl0 & sdctl0::IOCE)) {
+				sts |= sdsts::BCIS(true);
+				stream_space.store(regs::stream::STS, sts);
+			}
+		}
+	}
+
+	stream_space.store(regs::stream::LPIB, stream.lpib);
+	if (dma_pos) {
+		*dma_pos = stream.lpib;
+	}
+}
+
+void Controller::update_intsts() {
+	uint32_t sis = 0;
+	for (uint32_t i = 0; i < streams.size(); ++i) {
+		if (space.subspace(0x80 + i * 0x20).load(regs::stream::STS) & sdsts::BCIS) {
+			sis |= 1U << i;
+		}
+	}
+
+	BitValue<uint32_t> intsts {};
+	intsts |= intsts::SIS(sis);
+	intsts |= intsts::CIS(space.load(regs::RIRBSTS) & rirbsts::INTFL);
+	intsts |= intsts::GIS(intsts != 0);
+	space.store(regs::INTSTS, intsts);
+}
+
+bool Controller::irq_pending() {
+	auto intctl = space.load(regs::INTCTL);
+	auto intsts = space.load(regs::INTSTS);
+	if (!(intctl & intctl::GIE)) {
+		return false;
+	}
+	return (intsts & intsts::SIS) & (intctl & intctl::SIE) ||
+		((intsts & intsts::CIS) && (intctl & intctl::CIE));
+}
+
+void Controller::ack_irq() {
+	auto intsts = space.load(regs::INTSTS);
+	auto sis = intsts & intsts::SIS;
+	for (uint32_t i = 0; i < streams.size(); ++i) {
+		if (sis & 1U << i) {
+			auto stream_space = space.subspace(0x80 + i * 0x20);
+			auto sts = stream_space.load(regs::stream::STS);
+			sts &= ~sdsts::BCIS;
+			stream_space.store(regs::stream::STS, sts);
+		}
+	}
+	if (intsts & intsts::CIS) {
+		auto rirbsts = space.load(regs::RIRBSTS);
+		rirbsts &= ~rirbsts::INTFL;
+		space.store(regs::RIRBSTS, rirbsts);
+	}
+	update_intsts();
+}
+
+void Controller::advance(uint64_t target_ns) {
+	while (now_ns < target_ns) {
+		auto step = target_ns - now_ns;
+		if (step > STEP_NS) {
+			step = STEP_NS;
+		}
+		now_ns += step;
+
+		if (!(space.load(regs::GCTL) & gctl::CRST)) {
+			if (!in_reset) {
+				reset();
+			}
+			continue;
+		}
+
+		// the codecs request a state change once the link comes out of reset
+		if (in_reset) {
+			in_reset = false;
+			link_frames = now_ns * LINK_FRAME_RATE / NS_PER_SECOND;
+			uint16_t statests = 0;
+			for (auto& codec : codecs) {
+				statests |= 1 << codec.cid;
+			}
+			space.store(regs::STATESTS, statests);
+		}
+
+		auto frames = now_ns * LINK_FRAME_RATE / NS_PER_SECOND;
+		for (; link_frames < frames; ++link_frames) {
+			run_link_frame();
+		}
+
+		space.store(regs::WALCLK, static_cast<uint32_t>(now_ns * WALL_CLOCK_MHZ / 1000));
+
+		for (uint32_t i = 0; i < streams.size(); ++i) {
+			run_stream(i, step);
+		}
+
+		update_intsts();
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "codec_script.hpp"
+#include "reg.hpp"
+#include <stdint.h>
+#include <vector>
+
+namespace hosted {
+	struct EmulatedStream {
+		// the position of the dma engine in the buffer descriptor list
+		uint32_t entry;
+		uint32_t entry_offset;
+		uint32_t lpib;
+		// frames owed to the stream from the time that didn't add up to a whole frame
+		uint64_t time_remainder;
+		// bytes moved by the dma engine and the buffer completions
+		uint64_t bytes;
+		uint64_t completions;
+	};
+
+	// emulates the registers, the corb/rirb and the dma engines of a controller in memory.
+	// the cpu reads and writes the register file directly, the controller side
+	// only reacts to it when the simulated time is advanced.
+	//
+	// the status bits are write-1-to-clear on real hardware, which plain memory can't emulate.
+	// instead the bits that caused an interrupt are cleared by `ack_irq` once the handler has run,
+	// uHDA always writes them back in its handler.
+	class Controller {
+	public:
+		Controller(std::vector<Codec> codecs, uint8_t in_stream_count, uint8_t out_stream_count);
+		~Controller();
+
+		Controller(const Controller&) = delete;
+		Controller& operator=(const Controller&) = delete;
+
+		[[nodiscard]] void* get_registers() const {
+			return registers;
+		}
+
+		// runs the controller until `now_ns` of simulated time
+		void advance(uint64_t now_ns);
+
+		[[nodiscard]] bool irq_pending();
+		void ack_irq();
+
+		// changes the presence of a pin, which is reported with an unsolicited response if enabled
+		void set_presence(uint8_t cid, uint8_t nid, bool present);
+
+		[[nodiscard]] uint64_t get_verb_count() const;
+
+		Codec* get_codec(uint8_t cid);
+
+		// the streams are indexed like the registers, the input streams come first
+		[[nodiscard]] const EmulatedStream& get_stream(uint32_t index) const {
+			return streams[index];
+		}
+
+		const uint8_t in_stream_count;
+		const uint8_t out_stream_count;
+
+	private:
+		struct Response {
+			uint32_t res;
+			uint32_t res_ex;
+		};
+
+		void reset();
+		void run_link_frame();
+		void run_stream(uint32_t index, uint64_t delta_ns);
+		void push_response(uint32_t res, uint32_t res_ex, bool last);
+		void update_intsts();
+
+		uint8_t* registers;
+		uhda::MemSpace space;
+		std::vector<Codec> codecs;
+		std::vector<EmulatedStream> streams;
+		std::vector<Response> pending_unsol;
+		uint64_t now_ns {};
+		// the link frames are 48 KHz, one verb is sent in each
+		uint64_t link_frames {};
+		uint32_t responses_since_irq {};
+		bool in_reset {};
+	};
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "emulator.hpp"
+#include <stdint.h>
+#include <vector>
+
+namespace hosted {
+	// collected by the kernel api, the streams are indexed by their trace id
+	struct HostStats {
+		// irqs delivered to uHDA and the wall time spent in its handler
+		uint64_t irq_count;
+		uint64_t irq_ns;
+		std::vector<uint32_t> irq_samples_ns;
+
+		// the longest wall time with interrupts disabled, in the irq handler or with a spinlock held,
+		// and the longest simulated time uHDA busy-waited in such a section
+		uint64_t max_irq_off_ns;
+		uint64_t max_irq_off_delay_ns;
+
+		// from the tracepoints
+		uint64_t stream_irqs[0x200];
+		uint64_t dma_write_bytes[0x200];
+		uint64_t verb_batches;
+
+		uint64_t scheduled_work;
+		uint64_t allocations;
+		uint64_t physical_allocations;
+	};
+
+	// the controller is passed to uHDA as the pci device
+	void host_add_controller(Controller* controller);
+	void host_remove_controller(Controller* controller);
+
+	[[nodiscard]] uint64_t host_get_time_ns();
+
+	// advances the simulated time with interrupts enabled,
+	// delivering the irqs of the controllers and running the scheduled work.
+	void host_run(uint64_t duration_ns);
+
+	HostStats& host_get_stats();
+	void host_reset_stats();
+}
@@ -0,0 +1,337 @@
+#include "host.hpp"
+#include "uhda/kernel_api.h"
+#include <chrono>
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace hosted;
+
+// everything runs on one thread like on a uniprocessor kernel: taking a spinlock disables interrupts
+// and the irqs are only delivered while no spinlock is held, so taking a lock that is already held
+// would deadlock on real hardware and aborts here.
+
+static constexpr uint64_t DELAY_STEP_NS = 10000;
+static constexpr uint16_t PCI_VENDOR_ID = 0x8086;
+static constexpr uint16_t PCI_DEVICE_ID = 0xA0C8;
+
+struct Device {
+	Controller* controller;
+	// the configuration space, only written and read back
+	uint8_t config[256];
+	UhdaIrqHandlerFn irq_fn;
+	void* irq_arg;
+	bool irq_enabled;
+};
+
+struct Spinlock {
+	bool locked;
+};
+
+struct Work {
+	UhdaWorkFn fn;
+	void* arg;
+};
+
+using Clock = std::chrono::steady_clock;
+
+static std::deque<Device> devices;
+static std::deque<Work> work_queue;
+static HostStats stats;
+static uint64_t now_ns;
+
+static uint32_t irq_off_depth;
+static bool in_irq;
+static Clock::time_point irq_off_start;
+static uint64_t irq_off_delay_ns;
+
+static uint64_t get_elapsed_ns(Clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+static Device& get_device(void* pci_device) {
+	for (auto& device : devices) {
+		if (device.controller == pci_device) {
+			return device;
+		}
+	}
+	fprintf(stderr, "hosted: unknown pci device %p\n", pci_device);
+	abort();
+}
+
+static void disable_irqs() {
+	if (irq_off_depth++ == 0) {
+		irq_off_start = Clock::now();
+		irq_off_delay_ns = 0;
+	}
+}
+
+static void deliver_irqs();
+
+static void enable_irqs() {
+	if (--irq_off_depth) {
+		return;
+	}
+
+	auto elapsed = get_elapsed_ns(irq_off_start);
+	if (elapsed > stats.max_irq_off_ns) {
+		stats.max_irq_off_ns = elapsed;
+	}
+	if (irq_off_delay_ns > stats.max_irq_off_delay_ns) {
+		stats.max_irq_off_delay_ns = irq_off_delay_ns;
+	}
+
+	// an irq that was raised while they were disabled is taken right away
+	deliver_irqs();
+}
+
+static void deliver_irqs() {
+	if (in_irq || irq_off_depth) {
+		return;
+	}
+
+	bool pending = true;
+	while (pending) {
+		pending = false;
+		for (auto& device : devices) {
+			if (!device.irq_enabled || !device.irq_fn || !device.controller->irq_pending()) {
+				continue;
+			}
+			pending = true;
+
+			// the handler runs with interrupts disabled, its spinlocks nest inside that
+			in_irq = true;
+			disable_irqs();
+			auto start = Clock::now();
+			device.irq_fn(device.irq_arg);
+			auto elapsed = get_elapsed_ns(start);
+			device.controller->ack_irq();
+
+			++stats.irq_count;
+			stats.irq_ns += elapsed;
+			stats.irq_samples_ns.push_back(static_cast<uint32_t>(elapsed));
+
+			enable_irqs();
+			in_irq = false;
+		}
+	}
+}
+
+static void advance(uint64_t duration_ns) {
+	auto end = now_ns + duration_ns;
+	while (now_ns < end) {
+		auto step = end - now_ns;
+		if (step > DELAY_STEP_NS) {
+			step = DELAY_STEP_NS;
+		}
+		now_ns += step;
+
+		for (auto& device : devices) {
+			device.controller->advance(now_ns);
+		}
+		deliver_irqs();
+	}
+}
+
+void hosted::host_add_controller(Controller* controller) {
+	auto& device = devices.emplace_back();
+	device.controller = controller;
+	memcpy(device.config, &PCI_VENDOR_ID, 2);
+	memcpy(device.config + 2, &PCI_DEVICE_ID, 2);
+	// multimedia device, hd audio
+	device.config[0xB] = 4;
+	device.config[0xA] = 3;
+	controller->advance(now_ns);
+}
+
+void hosted::host_remove_controller(Controller* controller) {
+	for (auto it = devices.begin(); it != devices.end(); ++it) {
+		if (it->controller == controller) {
+			devices.erase(it);
+			return;
+		}
+	}
+}
+
+uint64_t hosted::host_get_time_ns() {
+	return now_ns;
+}
+
+void hosted::host_run(uint64_t duration_ns) {
+	auto end = now_ns + duration_ns;
+	while (now_ns < end) {
+		auto step = end - now_ns;
+		if (step > DELAY_STEP_NS) {
+			step = DELAY_STEP_NS;
+		}
+		advance(step);
+
+		// the work runs outside of the irq like a dpc, it may schedule more work
+		for (auto count = work_queue.size(); count; --count) {
+			auto work = work_queue.front();
+			work_queue.pop_front();
+			work.fn(work.arg);
+		}
+	}
+}
+
+HostStats& hosted::host_get_stats() {
+	return stats;
+}
+
+void hosted::host_reset_stats() {
+	stats = {};
+}
+
+extern "C" {
+	UhdaStatus uhda_kernel_pci_read(void* pci_device, uint8_t offset, uint8_t size, uint32_t* res) {
+		auto& device = get_device(pci_device);
+		if (offset + size > 256) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+		*res = 0;
+		memcpy(res, device.config + offset, size);
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	UhdaStatus uhda_kernel_pci_write(void* pci_device, uint8_t offset, uint8_t size, uint32_t value) {
+		auto& device = get_device(pci_device);
+		// the ids are read-only
+		if (offset + size > 256 || offset < 4) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+		memcpy(device.config + offset, &value, size);
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	UhdaStatus uhda_kernel_pci_allocate_irq(
+		void* pci_device,
+		UhdaIrqHint,
+		UhdaIrqHandlerFn fn,
+		void* arg,
+		void** opaque_irq) {
+		auto& device = get_device(pci_device);
+		device.irq_fn = fn;
+		device.irq_arg = arg;
+		*opaque_irq = &device;
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	void uhda_kernel_pci_deallocate_irq(void* pci_device, void*) {
+		auto& device = get_device(pci_device);
+		device.irq_fn = nullptr;
+		device.irq_arg = nullptr;
+	}
+
+	void uhda_kernel_pci_enable_irq(void* pci_device, void*, bool enable) {
+		get_device(pci_device).irq_enabled = enable;
+	}
+
+	UhdaStatus uhda_kernel_pci_map_bar(void* pci_device, uint32_t bar, void** virt) {
+		if (bar != 0) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+		*virt = get_device(pci_device).controller->get_registers();
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	void uhda_kernel_pci_unmap_bar(void*, uint32_t, void*) {}
+
+	UhdaStatus uhda_kernel_schedule_work(UhdaWorkFn fn, void* arg) {
+		++stats.scheduled_work;
+		work_queue.push_back({fn, arg});
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	void* uhda_kernel_malloc(size_t size) {
+		++stats.allocations;
+		return malloc(size ? size : 1);
+	}
+
+	void uhda_kernel_free(void* ptr, size_t) {
+		free(ptr);
+	}
+
+	void uhda_kernel_delay(uint32_t microseconds) {
+		uint64_t duration = microseconds * 1000ULL;
+		if (irq_off_depth) {
+			irq_off_delay_ns += duration;
+		}
+		advance(duration);
+	}
+
+	void uhda_kernel_log(const char* str) {
+		fprintf(stderr, "uhda: %s\n", str);
+	}
+
+	// the physical addresses are the virtual addresses, the emulated controller accesses them directly
+	UhdaStatus uhda_kernel_allocate_physical(size_t size, uintptr_t* res) {
+		++stats.physical_allocations;
+		auto* ptr = aligned_alloc(0x1000, (size + 0xFFF) & ~size_t {0xFFF});
+		if (!ptr) {
+			return UHDA_STATUS_NO_MEMORY;
+		}
+		// the memory isn't cleared by the kernel either
+		memset(ptr, 0xCC, size);
+		*res = reinterpret_cast<uintptr_t>(ptr);
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	void uhda_kernel_deallocate_physical(uintptr_t phys, size_t) {
+		free(reinterpret_cast<void*>(phys));
+	}
+
+	UhdaStatus uhda_kernel_map(uintptr_t phys, size_t, void** virt) {
+		*virt = reinterpret_cast<void*>(phys);
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	UhdaStatus uhda_kernel_map_write_combining(uintptr_t phys, size_t, void** virt) {
+		*virt = reinterpret_cast<void*>(phys);
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	void uhda_kernel_unmap(void*, size_t) {}
+
+	UhdaStatus uhda_kernel_create_spinlock(void** spinlock) {
+		*spinlock = new Spinlock {};
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	void uhda_kernel_free_spinlock(void* spinlock) {
+		delete static_cast<Spinlock*>(spinlock);
+	}
+
+	UhdaIrqState uhda_kernel_lock_spinlock(void* spinlock) {
+		auto* lock = static_cast<Spinlock*>(spinlock);
+		if (lock->locked) {
+			fprintf(stderr, "hosted: spinlock %p is already held\n", spinlock);
+			abort();
+		}
+		disable_irqs();
+		lock->locked = true;
+		return 0;
+	}
+
+	void uhda_kernel_unlock_spinlock(void* spinlock, UhdaIrqState) {
+		static_cast<Spinlock*>(spinlock)->locked = false;
+		enable_irqs();
+	}
+
+	void uhda_kernel_trace(UhdaTraceEvent event, uint32_t a, uint32_t b) {
+		switch (event) {
+			case UHDA_TRACE_STREAM_IRQ:
+				++stats.stream_irqs[a & 0x1FF];
+				break;
+			case UHDA_TRACE_DMA_WRITE:
+				stats.dma_write_bytes[a & 0x1FF] += b;
+				break;
+			case UHDA_TRACE_VERB_BATCH:
+				++stats.verb_batches;
+				break;
+			default:
+				break;
+		}
+	}
+}
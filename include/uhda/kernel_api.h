@@ -53,6 +53,16 @@ UhdaStatus uhda_kernel_pci_map_bar(void* pci_device, uint32_t bar, void** virt);
  */
 void uhda_kernel_pci_unmap_bar(void* pci_device, uint32_t bar, void* virt);
 
+/*
+ * Schedules `fn` to be called with `arg` outside of the interrupt context as soon as possible,
+ * for example from a DPC, a softirq or a worker thread.
+ *
+ * This is only used by streams with deferred filling enabled, which have at most one call pending at a time.
+ * Until `fn` runs the stream is only filled two periods ahead of the hardware.
+ * If this returns anything other than success the stream is filled in the irq instead.
+ */
+UhdaStatus uhda_kernel_schedule_work(UhdaWorkFn fn, void* arg);
+
 /*
  * Allocates `size` bytes of memory.
  */
@@ -90,6 +100,16 @@ void uhda_kernel_deallocate_physical(uintptr_t phys, size_t size);
  */
 UhdaStatus uhda_kernel_map(uintptr_t phys, size_t size, void** virt);
 
+/*
+ * Maps `size` bytes starting at physical address `phys` in virtual memory as write-combining.
+ *
+ * This is only used for stream buffers which are written by the cpu and read by the controller.
+ * If write-combining mappings are not supported this should return UHDA_STATUS_UNSUPPORTED,
+ * in which case the memory is mapped using `uhda_kernel_map` instead.
+ * The mapping is freed using `uhda_kernel_unmap`.
+ */
+UhdaStatus uhda_kernel_map_write_combining(uintptr_t phys, size_t size, void** virt);
+
 /*
  * Unmaps previously mapped memory.
  */
@@ -119,6 +139,15 @@ UhdaIrqState uhda_kernel_lock_spinlock(void* spinlock);
  */
 void uhda_kernel_unlock_spinlock(void* spinlock, UhdaIrqState irq_state);
 
+#ifdef UHDA_TRACE
+/*
+ * Called at the tracepoints listed in `UhdaTraceEvent`, only used if uHDA is built with UHDA_TRACE defined.
+ *
+ * Note: this may be called from the irq handler with spinlocks held.
+ */
+void uhda_kernel_trace(UhdaTraceEvent event, uint32_t a, uint32_t b);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,6 +23,8 @@ typedef uintptr_t UhdaIrqState;
 
 typedef bool (*UhdaIrqHandlerFn)(void* arg);
 
+typedef void (*UhdaWorkFn)(void* arg);
+
 typedef struct UhdaController UhdaController;
 typedef struct UhdaCodec UhdaCodec;
 
@@ -30,6 +32,8 @@ typedef struct UhdaPath UhdaPath;
 typedef struct UhdaStream UhdaStream;
 typedef struct UhdaOutput UhdaOutput;
 typedef struct UhdaOutputGroup UhdaOutputGroup;
+typedef struct UhdaInput UhdaInput;
+typedef struct UhdaVirtualStream UhdaVirtualStream;
 
 typedef enum UhdaOutputType {
 	UHDA_OUTPUT_TYPE_LINE_OUT,
@@ -81,24 +85,162 @@ typedef struct UhdaOutputInfo {
 	UhdaLocation location;
 } UhdaOutputInfo;
 
+typedef enum UhdaInputType {
+	UHDA_INPUT_TYPE_LINE_IN,
+	UHDA_INPUT_TYPE_MIC_IN,
+	UHDA_INPUT_TYPE_AUX,
+	UHDA_INPUT_TYPE_CD,
+	UHDA_INPUT_TYPE_SPDIF_IN,
+	UHDA_INPUT_TYPE_OTHER_DIGITAL_IN,
+	UHDA_INPUT_TYPE_UNKNOWN
+} UhdaInputType;
+
+typedef struct UhdaInputInfo {
+	UhdaInputType type;
+	UhdaColor color;
+	UhdaLocation location;
+} UhdaInputInfo;
+
 typedef uint32_t (*UhdaBufferFillFn)(void* arg, void* buffer, uint32_t space);
 
 typedef void (*UhdaBufferTripFn)(void* arg, uint32_t remaining);
 
+typedef void (*UhdaPresenceFn)(void* arg, const UhdaOutput* output, bool presence);
+
 typedef enum UhdaFormat {
 	UHDA_FORMAT_PCM8,
 	UHDA_FORMAT_PCM16,
 	UHDA_FORMAT_PCM20,
 	UHDA_FORMAT_PCM24,
-	UHDA_FORMAT_PCM32
+	UHDA_FORMAT_PCM32,
+	/* 32-bit float in the range [-1, 1], only supported as a source format for conversion */
+	UHDA_FORMAT_FLOAT32,
+	/*
+	 * IEC 61937 data bursts of compressed audio in 16-bit frames, which the codec passes through as is.
+	 * Only supported on digital outputs and without conversion or mixing, see `uhda_iec61937_pack_burst`.
+	 */
+	UHDA_FORMAT_IEC61937
 } UhdaFormat;
 
+#define UHDA_SAMPLE_RATE_COUNT 12
+
+typedef struct UhdaFormatCaps {
+	/* bit `i` is set if `UHDA_SAMPLE_RATES[i]` is supported */
+	uint32_t rates;
+	/* `formats & 1 << fmt` is set for each `UhdaFormat` that the converter takes without conversion */
+	uint32_t formats;
+	/* whether the converter is digital, for example S/PDIF or HDMI */
+	bool digital;
+} UhdaFormatCaps;
+
+typedef enum UhdaIec61937Type {
+	UHDA_IEC61937_AC3 = 1,
+	UHDA_IEC61937_MPEG1_LAYER1 = 4,
+	UHDA_IEC61937_MPEG1_LAYER23 = 5,
+	UHDA_IEC61937_DTS_TYPE_I = 11,
+	UHDA_IEC61937_DTS_TYPE_II = 12,
+	UHDA_IEC61937_DTS_TYPE_III = 13,
+	UHDA_IEC61937_EAC3 = 21
+} UhdaIec61937Type;
+
 typedef struct UhdaStreamParams {
 	uint32_t sample_rate;
 	uint32_t channels;
 	UhdaFormat fmt;
 } UhdaStreamParams;
 
+typedef struct UhdaStreamBufferParams {
+	/* size of one period in bytes, an interrupt is generated at the end of each period */
+	uint32_t period_size;
+	/* number of periods in the stream's DMA buffer */
+	uint32_t period_count;
+	/* how far ahead of the hardware data is queued to the DMA buffer in microseconds */
+	uint32_t target_latency_us;
+	/* set to the latency that was actually achieved in microseconds */
+	uint32_t actual_latency_us;
+	/*
+	 * if nonzero the latency of an output stream is adjusted while it runs,
+	 * starting from the target latency and staying below this many microseconds.
+	 */
+	uint32_t max_latency_us;
+} UhdaStreamBufferParams;
+
+typedef struct UhdaStreamPosition {
+	/* number of frames the hardware has played or captured since the stream was set up */
+	uint64_t frames;
+	/*
+	 * number of frames queued ahead of the hardware in the DMA buffer and the ring buffer,
+	 * for input streams the number of captured frames that haven't been read yet
+	 */
+	uint32_t queued_frames;
+	/* the controller's 24 MHz wall clock sampled together with the position */
+	uint32_t wall_clock;
+} UhdaStreamPosition;
+
+/* the times are in ticks of the controller's 24 MHz wall clock */
+typedef struct UhdaStreamStats {
+	/* number of irqs handled for the stream */
+	uint64_t irq_count;
+	/* number of times an output stream ran out of queued data */
+	uint64_t underruns;
+	/* bytes played by an output stream while no data was queued */
+	uint64_t silence_bytes;
+	/* number of times an input stream dropped captured data because it wasn't read in time */
+	uint64_t overruns;
+	/* bytes dropped by an input stream */
+	uint64_t dropped_bytes;
+	/* shortest and longest time between two irqs while the stream was running, 0 before the second irq */
+	uint32_t min_irq_interval;
+	uint32_t max_irq_interval;
+	/* calls to the buffer fill function and the time spent in it */
+	uint64_t callback_count;
+	uint64_t callback_time;
+	uint32_t max_callback_time;
+	/*
+	 * bytes queued ahead of the hardware position of an output stream, including the data in its ring buffer,
+	 * this is a snapshot that isn't affected by resetting.
+	 */
+	uint32_t fill_ahead;
+	/* how far ahead the stream is filled to in bytes, changed by the adaptive latency and not reset */
+	uint32_t fill_target;
+} UhdaStreamStats;
+
+#define UHDA_VERB_LATENCY_BUCKETS 8
+
+typedef struct UhdaControllerStats {
+	/* number of responses received to verbs */
+	uint64_t verbs;
+	/* number of times a codec stopped responding */
+	uint64_t timeouts;
+	/*
+	 * verb batches by the time from writing their first verb to receiving their last response,
+	 * bucket i counts the batches that took less than 16 << i microseconds and the last bucket the rest.
+	 */
+	uint32_t latency_histogram[UHDA_VERB_LATENCY_BUCKETS];
+	uint32_t max_latency_us;
+} UhdaControllerStats;
+
+/*
+ * Events passed to `uhda_kernel_trace`, `a` and `b` are:
+ * - STREAM_IRQ: the stream and its position in the DMA buffer
+ * - UNDERRUN: the stream and the number of bytes played without data
+ * - OVERRUN: the stream and the number of bytes dropped
+ * - FILL: the stream and the time spent in the buffer fill function
+ * - VERB_BATCH: the codec address and the latency of the batch in microseconds
+ * - VERB_TIMEOUT: the codec address and 0
+ * - DMA_WRITE: the stream and the number of bytes uHDA copied, converted or zeroed into its DMA buffer
+ * streams are identified by their index with bit 8 set for output streams.
+ */
+typedef enum UhdaTraceEvent {
+	UHDA_TRACE_STREAM_IRQ,
+	UHDA_TRACE_UNDERRUN,
+	UHDA_TRACE_OVERRUN,
+	UHDA_TRACE_FILL,
+	UHDA_TRACE_VERB_BATCH,
+	UHDA_TRACE_VERB_TIMEOUT,
+	UHDA_TRACE_DMA_WRITE
+} UhdaTraceEvent;
+
 typedef enum UhdaStreamStatus {
 	UHDA_STREAM_STATUS_UNINITIALIZED,
 	UHDA_STREAM_STATUS_RUNNING,
@@ -16,6 +16,10 @@
  *  A stream of audio data either going from the controller to the codecs or
  *  from the codecs to the controller (in case of input).
  *
+ * Virtual stream
+ *  A software stream that is mixed together with the other virtual streams of the same output stream,
+ *  used when there are more clients playing at the same time than there are streams.
+ *
  * Output group
  *  A group of logically-related outputs sorted by their sequence,
  *  used for multichannel output (likely surround) or just
@@ -26,6 +30,9 @@
  * Output
  *  A physical output, for an example a speaker or a headphone jack.
  *
+ * Input
+ *  A physical input that can be recorded from, for an example a microphone or a line in jack.
+ *
  * Path
  *  A path from the codec to an input/output.
  *  In case of an output the audio is picked up from a stream by the other end of the path,
@@ -71,6 +78,19 @@ bool uhda_class_matches(uint16_t clazz, uint16_t subclass);
  */
 UhdaStatus uhda_init(void* pci_device, UhdaController** res);
 
+/*
+ * Initializes HDA for the PCI device using a codec topology previously returned by `uhda_get_topology`.
+ *
+ * The codecs found in the topology are not enumerated, which makes the initialization faster.
+ * Codecs that are missing from the topology or don't match it are enumerated normally.
+ * The topology is only used during this call.
+ */
+UhdaStatus uhda_init_with_topology(
+	void* pci_device,
+	const void* topology,
+	size_t topology_size,
+	UhdaController** res);
+
 /*
  * Destroys a previously initialized HDA controller instance.
  *
@@ -94,9 +114,67 @@ UhdaStatus uhda_suspend(UhdaController* controller);
  *
  * Note: uHDA expects the kernel to restore the PCI BARs before calling this function.
  * Note: it is safe to call this function multiple times in case it fails.
+ * Note: the codecs are enumerated again, so all codecs, outputs and paths
+ * obtained before the call are invalidated.
  */
 UhdaStatus uhda_resume(UhdaController* controller);
 
+/*
+ * Resumes the HDA controller after system suspend without enumerating the codecs again.
+ *
+ * The existing codecs, outputs and paths are kept valid and the codec state
+ * that was last written is restored, after which the streams that were playing are restarted.
+ * Data that was queued in the DMA buffer of a stream is dropped, data in the ring buffer is kept.
+ *
+ * If the codecs attached to the controller have changed UHDA_STATUS_UNSUPPORTED is returned,
+ * in which case `uhda_resume` should be used instead.
+ */
+UhdaStatus uhda_resume_fast(UhdaController* controller);
+
+/*
+ * Sets the time after which an idle controller is suspended by `uhda_autosuspend_poll`, 0 disables autosuspend.
+ *
+ * Widgets and function groups that aren't used by any set up path are always powered down,
+ * this additionally puts the whole link in reset while no path is set up and no stream is running.
+ * Autosuspend is disabled by default.
+ */
+void uhda_set_autosuspend_delay(UhdaController* controller, uint32_t delay_ms);
+
+/*
+ * Suspends the link if the controller has been idle for the autosuspend delay,
+ * `now_ms` is a monotonic time in milliseconds. Returns whether the link is suspended.
+ *
+ * This should be called periodically, for example from a timer. The functions that need the link
+ * bring it back up using the same state restore as `uhda_resume_fast`, which fails with
+ * UHDA_STATUS_UNSUPPORTED if the codecs have changed in the meantime.
+ * Presence changes that happen while the link is suspended are reported once it's brought back up.
+ *
+ * Note: this must not be called concurrently with the other functions of the controller.
+ */
+bool uhda_autosuspend_poll(UhdaController* controller, uint64_t now_ms);
+
+/*
+ * Resumes the HDA controller after system suspend using a codec topology
+ * previously returned by `uhda_get_topology`, see `uhda_init_with_topology`.
+ */
+UhdaStatus uhda_resume_with_topology(UhdaController* controller, const void* topology, size_t topology_size);
+
+/*
+ * Serializes the topology of the codecs attached to the controller into `buffer`.
+ *
+ * If `buffer` is null or `*size` is too small, the required size is written to `size`
+ * and UHDA_STATUS_NO_MEMORY is returned.
+ * Note: the topology is only valid for the same machine and uHDA version it was created with.
+ */
+UhdaStatus uhda_get_topology(UhdaController* controller, void* buffer, size_t* size);
+
+/*
+ * Gets the statistics of the controller collected since it was initialized or since they were last reset.
+ *
+ * The statistics are reset after they are read if `reset` is true.
+ */
+void uhda_get_stats(UhdaController* controller, UhdaControllerStats* stats, bool reset);
+
 /*
  * Gets a list of HDA codecs attached to the controller.
  */
@@ -107,6 +185,11 @@ void uhda_get_codecs(UhdaController* controller, const UhdaCodec* const** codecs
  */
 void uhda_get_output_streams(UhdaController* controller, UhdaStream*** streams, size_t* stream_count);
 
+/*
+ * Gets a list of HDA input streams.
+ */
+void uhda_get_input_streams(UhdaController* controller, UhdaStream*** streams, size_t* stream_count);
+
 /*
  * Gets a list of output groups that a codec has.
  */
@@ -125,14 +208,43 @@ void uhda_output_group_get_outputs(
 
 /*
  * Gets presence info of an output if available.
+ *
+ * If the codec reports presence changes of the output this only reads the cached presence,
+ * otherwise it is read from the codec.
  */
 UhdaStatus uhda_output_get_presence(const UhdaOutput* output, bool* presence);
 
+/*
+ * Sets a callback that is called when the presence of an output changes, null removes the callback.
+ *
+ * Returns UHDA_STATUS_UNSUPPORTED if the codec doesn't report presence changes of the output,
+ * in which case `uhda_output_get_presence` has to be polled instead.
+ *
+ * Note: the callback is usually run in an interrupt context and must not
+ * call functions that send verbs to the codec (e.g. `uhda_path_setup`).
+ */
+UhdaStatus uhda_output_set_presence_callback(const UhdaOutput* output, UhdaPresenceFn fn, void* arg);
+
 /*
  * Gets info about an output.
  */
 UhdaOutputInfo uhda_output_get_info(const UhdaOutput* output);
 
+/*
+ * Gets a list of inputs that a codec has.
+ */
+void uhda_codec_get_inputs(const UhdaCodec* codec, const UhdaInput* const** inputs, size_t* input_count);
+
+/*
+ * Gets presence info of an input if available, it is always read from the codec.
+ */
+UhdaStatus uhda_input_get_presence(const UhdaInput* input, bool* presence);
+
+/*
+ * Gets info about an input.
+ */
+UhdaInputInfo uhda_input_get_info(const UhdaInput* input);
+
 /*
  * A table mapping colors to strings.
  */
@@ -162,20 +274,86 @@ UhdaStatus uhda_find_path(
 	UhdaPath** res);
 
 /*
- * Sets up a path for playback.
+ * Finds a path to each of the `count` outputs so that all of them are usable at the same time,
+ * trying other combinations if the first path found for an output blocks a later one.
+ * The paths are stored to `res` in the same order as the outputs.
+ *
+ * All the outputs must be in the same codec, otherwise UHDA_STATUS_UNSUPPORTED is returned
+ * as paths of different codecs never conflict and can be found separately.
+ * `same_stream` means that all the paths are going to be playing the same stream.
+ */
+UhdaStatus uhda_find_paths(
+	const UhdaOutput* const* dests,
+	size_t count,
+	bool same_stream,
+	UhdaPath** res);
+
+/*
+ * Finds a path from the input that is usable at the same time as the other provided paths if provided.
+ */
+UhdaStatus uhda_find_input_path(
+	const UhdaInput* src,
+	const UhdaPath** other_paths,
+	size_t other_path_count,
+	UhdaPath** res);
+
+/*
+ * Gets the sample rates and formats that the converter of a path supports.
+ *
+ * These are read from the codec, so the lightest format that the hardware accepts
+ * can be picked before setting up the path.
+ */
+UhdaStatus uhda_path_get_format_caps(const UhdaPath* path, UhdaFormatCaps* caps);
+
+/*
+ * A table mapping the bits of `UhdaFormatCaps::rates` to sample rates.
+ */
+extern const uint32_t UHDA_SAMPLE_RATES[UHDA_SAMPLE_RATE_COUNT];
+
+/*
+ * Sets up a path for playback or recording.
  *
  * `params` contains hints for the stream parameters,
  * it's also updated to reflect the actual parameters.
+ * Paths to inputs have to be set up with an input stream and paths to outputs with an output stream.
+ * UHDA_FORMAT_IEC61937 is only supported on paths with a digital converter,
+ * which is then switched to non-audio mode.
  */
 UhdaStatus uhda_path_setup(UhdaPath* path, UhdaStreamParams* params, UhdaStream* stream);
 
+/*
+ * Sets up paths to play different channels of the same output stream, e.g. for surround.
+ *
+ * The converter of each path plays a pair of channels of the stream, the first path plays channels 0 and 1,
+ * the second 2 and 3 and so on. When the paths go to the outputs of an output group in the order of their
+ * sequence (front, center/lfe, rear, side) the channels are in the usual order of
+ * front left/right, center, lfe, rear left/right and side left/right.
+ * The paths have to be usable simultaneously with `same_stream` set to false, as each path needs its own converter.
+ *
+ * `params` contains hints for the stream parameters, the channel count is at most twice the number of paths.
+ * It's also updated to reflect the actual parameters, which is what the stream should be set up with.
+ * The paths are shut down and their volume is set individually.
+ */
+UhdaStatus uhda_path_setup_multichannel(
+	UhdaPath* const* paths,
+	size_t path_count,
+	UhdaStreamParams* params,
+	UhdaStream* stream);
+
 /*
  * Shuts down an already set up path.
+ *
+ * The widgets of the path that no other set up path uses are powered down (D3), as is the function group
+ * once none of its paths are set up, unless the codec reports presence changes.
  */
 UhdaStatus uhda_path_shutdown(UhdaPath* path);
 
 /*
- * Sets the volume on the path to `volume` (0-100)
+ * Sets the volume on the path to `volume` (0-100), rounded to the nearest step of the amp.
+ * Returns UHDA_STATUS_UNSUPPORTED if the converter of the path doesn't have a gain control.
+ *
+ * Setting it to the step that the amp already has doesn't send anything to the codec,
+ * so for fades it's best used for the coarse level together with `uhda_stream_set_gain`.
  */
 UhdaStatus uhda_path_set_volume(UhdaPath* path, int volume);
 
@@ -185,19 +363,43 @@ UhdaStatus uhda_path_set_volume(UhdaPath* path, int volume);
 UhdaStatus uhda_path_mute(UhdaPath* path, bool mute);
 
 /*
- * Sets up a stream for playback.
+ * Sets up a stream for playback or recording.
  *
  * `ring_buffer_size` is the size of an internal ring buffer that is used to queue output.
+ * If it's zero then no ring buffer is allocated and the stream is zero-copy,
+ * all data is written straight into the stream's DMA buffer either by `uhda_stream_queue_data`,
+ * by the client using `uhda_stream_acquire_write`/`uhda_stream_commit_write` or
+ * by `buffer_fill_fn` which is then passed a span of the DMA buffer.
  * `buffer_fill_fn` is an optional callback that is called when the ring buffer has space
  * and more data is needed.
  * `buffer_trip_threshold` is the trip threshold in bytes for the optional buffer trip function,
  * called once per data period when the buffer size is below the specified threshold.
  *
- * Note: all callback functions are run in an interrupt context.
+ * `buffer_params` optionally configures the geometry of the DMA buffer and the latency,
+ * zero fields and a null pointer select the defaults (4096 byte periods, 1 MiB buffer).
+ * The period size is rounded up to a multiple of 128 bytes and the period count
+ * is clamped to 2-256 (3-256 for input streams). Without a target latency data is queued 16 KiB ahead of the hardware,
+ * the latency is clamped to at least two periods and at most the size of the buffer.
+ * The ring buffer should be larger than the latency, otherwise it can't keep the DMA buffer filled.
+ * It's updated to reflect the actual values.
+ *
+ * With a `max_latency_us` the latency adapts to the irq jitter and the underruns seen at runtime,
+ * the smallest latency that hasn't underrun is used. The buffer is then only refilled once it drops
+ * below that latency and is filled a period further, so `buffer_fill_fn` is called about every other period.
+ *
+ * Input streams don't have a ring buffer or a `buffer_fill_fn`, the captured data is read straight
+ * from the DMA buffer using `uhda_stream_acquire_read`/`uhda_stream_commit_read`.
+ * For them the buffer trip function is called once per data period when
+ * at least `buffer_trip_threshold` bytes have been captured and not yet read, it is run without
+ * any locks held so it can read the data itself. The `target_latency_us` of `buffer_params` is ignored.
+ *
+ * Note: all callback functions are run in an interrupt context unless deferred filling is enabled,
+ * see `uhda_stream_set_deferred_fill`.
  */
 UhdaStatus uhda_stream_setup(
 	UhdaStream* stream,
 	const UhdaStreamParams* params,
+	UhdaStreamBufferParams* buffer_params,
 	uint32_t ring_buffer_size,
 	UhdaBufferFillFn buffer_fill_fn,
 	void* buffer_fill_arg,
@@ -208,22 +410,164 @@ UhdaStatus uhda_stream_setup(
 /*
  * Shuts down an already set up stream.
  *
+ * The DMA buffer and the ring buffer are kept and reused by the next `uhda_stream_setup`
+ * if they are large enough, they are freed when the controller is destroyed.
+ *
+ * Returns UHDA_STATUS_UNSUPPORTED without shutting the stream down if it still has virtual streams,
+ * they have to be destroyed with `uhda_virtual_stream_destroy` first.
+ *
  * Note: the stream must be stopped prior to shutting it down.
  */
 UhdaStatus uhda_stream_shutdown(UhdaStream* stream);
 
+/*
+ * Switches an output stream to a different sample rate or sample format without shutting it down.
+ *
+ * The data queued before this call is played in the old format and the data queued after it in the new one,
+ * a stream that is only fed without a format change (e.g. consecutive tracks) plays without any gap.
+ * The data in the old format is padded with silence to the end of its period, at which point the stream
+ * is stopped for a period of silence while the converters of the paths set up for the stream are reprogrammed.
+ * For zero-copy streams `uhda_stream_acquire_write` and `buffer_fill_fn` get no space until the padding fits
+ * in the DMA buffer. `params` is updated to the actual format like in `uhda_path_setup`.
+ *
+ * Returns UHDA_STATUS_UNSUPPORTED if the channel count differs, if only one of the formats is UHDA_FORMAT_IEC61937,
+ * if a switch is already pending or if the stream has a source format set or virtual streams.
+ */
+UhdaStatus uhda_stream_switch_format(UhdaStream* stream, UhdaStreamParams* params);
+
+/*
+ * Packs one frame of compressed audio of the given type into an IEC 61937 data burst.
+ *
+ * `burst_size` is the size of the whole burst in bytes, it's the repetition period of the format
+ * in 16-bit stereo frames times 4 (6144 for AC-3), the rest of the burst after the frame is zeroed.
+ * The frame is in the byte order of the bitstream and the burst in the order of UHDA_FORMAT_IEC61937.
+ * Returns UHDA_STATUS_UNSUPPORTED if the frame doesn't fit in the burst.
+ */
+UhdaStatus uhda_iec61937_pack_burst(
+	UhdaIec61937Type type,
+	const void* frame,
+	uint32_t frame_size,
+	void* burst,
+	uint32_t burst_size);
+
+/*
+ * Enables or disables deferred filling of the stream.
+ *
+ * When enabled the irq only copies the data that is needed for the next two periods
+ * from the ring buffer and schedules work using `uhda_kernel_schedule_work`,
+ * which runs `buffer_fill_fn`, `buffer_trip_fn` and the rest of the copy without holding any locks.
+ * While `buffer_fill_fn` is running `uhda_stream_acquire_write` reports no space,
+ * so it shouldn't be used together with it.
+ * If the work can't be scheduled, deferred filling is turned off.
+ * When it's disabled the irq only calls the client again once the work that is already scheduled has run.
+ */
+UhdaStatus uhda_stream_set_deferred_fill(UhdaStream* stream, bool deferred);
+
 /*
  * Begins/stops playback on the stream.
  */
 UhdaStatus uhda_stream_play(UhdaStream* stream, bool play);
 
+/*
+ * Begins/stops playback on all of the streams on the same frame, the streams must belong to the same controller.
+ * Output streams are prefilled before any of them is started, so they stay phase-aligned.
+ */
+UhdaStatus uhda_streams_play_synced(UhdaStream* const* streams, size_t count, bool play);
+
+/*
+ * Sets the software gain of an output stream to `volume` (0-100), ramping to it linearly over `ramp_us`.
+ *
+ * The gain is applied while the queued data is copied into the DMA buffer, so streams without a ring buffer
+ * that use a fill function, a source format or virtual streams return UHDA_STATUS_UNSUPPORTED,
+ * as do IEC 61937 streams.
+ * Data written with `uhda_stream_acquire_write` isn't scaled.
+ */
+UhdaStatus uhda_stream_set_gain(UhdaStream* stream, int volume, uint32_t ramp_us);
+
+/*
+ * Sets the format of the data passed to `uhda_stream_queue_data`, it's then converted
+ * to the format of the stream while it's being copied. A null `params` disables the conversion.
+ *
+ * The samples are converted from any format, including float, the channels are up or down mixed
+ * and the sample rate is resampled using a polyphase filter. The source rate can be at most four times
+ * the rate of the stream and both can have at most 8 channels. Only whole frames are consumed.
+ * The conversion state is owned by the producer, so this must not be called concurrently with
+ * `uhda_stream_queue_data`.
+ *
+ * Note: only integer arithmetic is used unless the library is built with SSE2 or NEON enabled,
+ * in which case the conversion from float uses them.
+ * The data written by `buffer_fill_fn` and `uhda_stream_acquire_write` isn't converted.
+ */
+UhdaStatus uhda_stream_set_source_format(UhdaStream* stream, const UhdaStreamParams* params);
+
 /*
  * Queues data to the stream and returns the actual amount of data written in `size`.
+ * Fails with UHDA_STATUS_UNSUPPORTED if the stream isn't set up.
  *
  * Note: this function is asynchronous, it doesn't block if the ring buffer space is exhausted.
+ * For streams with a ring buffer it doesn't take any locks, the ring buffer only supports a single producer
+ * so it must not be called concurrently or on a stream that has a `buffer_fill_fn`.
  */
 UhdaStatus uhda_stream_queue_data(UhdaStream* stream, const void* data, uint32_t* size);
 
+/*
+ * Acquires a span of a zero-copy stream's DMA buffer that the client can write to directly.
+ *
+ * `ptr` is set to the start of the span and `size` to its size in bytes,
+ * it is zero if the buffer is currently full.
+ * At most `size` bytes written to the span are queued once committed using `uhda_stream_commit_write`.
+ *
+ * Note: this is only supported on streams that were set up with a `ring_buffer_size` of zero.
+ */
+UhdaStatus uhda_stream_acquire_write(UhdaStream* stream, void** ptr, uint32_t* size);
+
+/*
+ * Commits `size` bytes written to the span acquired using `uhda_stream_acquire_write`.
+ */
+UhdaStatus uhda_stream_commit_write(UhdaStream* stream, uint32_t size);
+
+/*
+ * Acquires a span of an input stream's DMA buffer that contains captured data.
+ *
+ * `ptr` is set to the start of the span and `size` to its size in bytes, it is zero if nothing
+ * has been captured since the last read. The data stays valid until it's released
+ * using `uhda_stream_commit_read`, unless the hardware catches up with it
+ * because the stream isn't read fast enough, in which case the oldest data is dropped
+ * at the next period interrupt.
+ */
+UhdaStatus uhda_stream_acquire_read(UhdaStream* stream, const void** ptr, uint32_t* size);
+
+/*
+ * Releases `size` bytes of the span acquired using `uhda_stream_acquire_read`.
+ */
+UhdaStatus uhda_stream_commit_read(UhdaStream* stream, uint32_t size);
+
+/*
+ * Gets the time at which the first byte that `uhda_stream_acquire_read` returns was captured.
+ *
+ * The time is in ticks of the controller's 24 MHz wall clock, which is shared by all streams
+ * so it can be used to align the recording with playback (e.g. for echo cancellation).
+ * It's derived from the position and the wall clock sampled in the last period interrupt.
+ */
+UhdaStatus uhda_stream_get_read_timestamp(const UhdaStream* stream, uint32_t* wall_clock);
+
+/*
+ * Gets the position of the hardware within a stream.
+ *
+ * The position is read from the stream's link position, so it doesn't include the data
+ * that the controller has fetched into its fifo but hasn't sent to the codec yet.
+ * The frame count is 64-bit and keeps counting when the DMA buffer wraps around,
+ * for output streams `queued_frames` can be added to it to get the number of frames submitted by the client.
+ */
+UhdaStatus uhda_stream_get_position(const UhdaStream* stream, UhdaStreamPosition* position);
+
+/*
+ * Gets the statistics of a stream collected since it was set up or since they were last reset.
+ *
+ * The statistics are reset after they are read if `reset` is true.
+ */
+UhdaStatus uhda_stream_get_stats(UhdaStream* stream, UhdaStreamStats* stats, bool reset);
+
 /*
  * Gets the status of a stream.
  */
@@ -231,6 +575,10 @@ UhdaStreamStatus uhda_stream_get_status(const UhdaStream* stream);
 
 /*
  * Gets the amount of remaining queued data within a stream.
+ *
+ * For zero-copy streams this is the amount of data written to the DMA buffer that
+ * hasn't been played yet, otherwise it's read without taking any locks.
+ * For input streams this is the amount of captured data that hasn't been read yet.
  */
 UhdaStatus uhda_stream_get_remaining(const UhdaStream* stream, uint32_t* remaining);
 
@@ -239,6 +587,44 @@ UhdaStatus uhda_stream_get_remaining(const UhdaStream* stream, uint32_t* remaini
  */
 uint32_t uhda_stream_get_buffer_size(const UhdaStream* stream);
 
+/*
+ * Creates a virtual stream that is mixed into the output stream `stream`.
+ *
+ * `ring_buffer_size` is the size of the virtual stream's ring buffer, it's rounded down to whole frames.
+ * The virtual streams have the format of `stream`, which has to be a zero-copy stream (set up with
+ * a `ring_buffer_size` of zero) without a `buffer_fill_fn` and a 16, 20, 24 or 32-bit format.
+ * The mixer becomes the `buffer_fill_fn` of the stream, it sums the virtual streams with saturation
+ * straight into the DMA buffer, so nothing else should write to the stream afterwards.
+ * The stream is played and paused as usual, the streams that run out of data are mixed as silence.
+ *
+ * Note: `stream` can't be shut down while it has virtual streams, they are only freed without being
+ * destroyed when the controller is destroyed, after which they must not be used anymore.
+ */
+UhdaStatus uhda_stream_create_virtual(UhdaStream* stream, uint32_t ring_buffer_size, UhdaVirtualStream** res);
+
+/*
+ * Destroys a virtual stream, the data that is still queued is dropped.
+ */
+UhdaStatus uhda_virtual_stream_destroy(UhdaVirtualStream* stream);
+
+/*
+ * Queues data to the virtual stream and returns the actual amount of data written in `size`.
+ *
+ * Note: like `uhda_stream_queue_data` this doesn't take any locks, the ring buffer only supports
+ * a single producer so it must not be called concurrently.
+ */
+UhdaStatus uhda_virtual_stream_queue_data(UhdaVirtualStream* stream, const void* data, uint32_t* size);
+
+/*
+ * Sets the volume of the virtual stream to `volume` (0-100), which is a linear gain applied while mixing.
+ */
+UhdaStatus uhda_virtual_stream_set_volume(UhdaVirtualStream* stream, int volume);
+
+/*
+ * Gets the amount of data queued in the virtual stream's ring buffer.
+ */
+UhdaStatus uhda_virtual_stream_get_remaining(const UhdaVirtualStream* stream, uint32_t* remaining);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,115 @@
+#pragma once
+#include "uhda/kernel_api.h"
+#include "utils.hpp"
+
+namespace uhda {
+	// bump allocator for objects that live as long as their owner, all the memory is freed at once.
+	// destructors of the objects are not run, owners have to do that themselves if needed.
+	class Arena {
+	public:
+		Arena() = default;
+
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		~Arena() {
+			reset();
+		}
+
+		[[nodiscard]] void* alloc(size_t size, size_t align) {
+			size_t start = (offset + align - 1) & ~(align - 1);
+			if (head && start + size <= head->size) {
+				offset = start + size;
+				return reinterpret_cast<char*>(head) + start;
+			}
+
+			size_t data_start = (sizeof(Chunk) + align - 1) & ~(align - 1);
+			// big allocations get their own chunk so that the free space of the current one isn't lost
+			bool dedicated = data_start + size > CHUNK_SIZE;
+			size_t chunk_size = dedicated ? data_start + size : CHUNK_SIZE;
+
+			auto* chunk = static_cast<Chunk*>(uhda_kernel_malloc(chunk_size));
+			if (!chunk) {
+				return nullptr;
+			}
+			chunk->size = chunk_size;
+
+			if (dedicated && head) {
+				chunk->next = head->next;
+				head->next = chunk;
+			}
+			else {
+				chunk->next = head;
+				head = chunk;
+				offset = data_start + size;
+			}
+			return reinterpret_cast<char*>(chunk) + data_start;
+		}
+
+		template<typename T>
+		[[nodiscard]] T* alloc_array(size_t count) {
+			return static_cast<T*>(alloc(count * sizeof(T), alignof(T)));
+		}
+
+		template<typename T, typename... Args>
+		[[nodiscard]] T* create(Args&&... args) {
+			auto* ptr = alloc(sizeof(T), alignof(T));
+			if (!ptr) {
+				return nullptr;
+			}
+			return construct<T>(ptr, forward<Args>(args)...);
+		}
+
+		void reset() {
+			for (auto* chunk = head; chunk;) {
+				auto* next = chunk->next;
+				uhda_kernel_free(chunk, chunk->size);
+				chunk = next;
+			}
+			head = nullptr;
+			offset = 0;
+		}
+
+	private:
+		static constexpr size_t CHUNK_SIZE = 0x1000;
+
+		struct Chunk {
+			Chunk* next;
+			size_t size;
+		};
+
+		Chunk* head {};
+		size_t offset {};
+	};
+
+	// fixed size array of trivially destructible values, usually allocated from an arena
+	template<typename T>
+	struct span {
+		constexpr T* begin() const {
+			return ptr;
+		}
+
+		constexpr T* end() const {
+			return ptr + _size;
+		}
+
+		constexpr T* data() const {
+			return ptr;
+		}
+
+		constexpr T& operator[](size_t index) const {
+			return ptr[index];
+		}
+
+		[[nodiscard]] constexpr size_t size() const {
+			return _size;
+		}
+
+		[[nodiscard]] constexpr bool is_empty() const {
+			return !_size;
+		}
+
+		T* ptr {};
+		size_t _size {};
+	};
+}
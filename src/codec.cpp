@@ -1,165 +1,423 @@
 #include "codec.hpp"
 #include "controller.hpp"
-#include "lock_guard.hpp"
 #include "spec.hpp"
+#include "topology.hpp"
+#include "lock_guard.hpp"
 
 using namespace uhda;
 
-UhdaStatus UhdaCodec::init() {
-	uint32_t num_func_groups_resp;
-	auto status = get_parameter(0, param::NODE_COUNT, num_func_groups_resp);
-	if (status != UHDA_STATUS_SUCCESS) {
-		return status;
-	}
+// verbs sent for each widget during enumeration
+static constexpr uint32_t WIDGET_VERB_COUNT = 7;
+
+// limits for the path search, paths have at most one widget more than the search depth
+static constexpr size_t MAX_PATH_DEPTH = 20;
+static constexpr size_t MAX_PATHS_PER_ROOT = 8;
+static constexpr uint32_t MAX_SEARCH_STEPS = 0x4000;
+// the connection select index is 8 bits
+static constexpr size_t MAX_CONNECTIONS = 0xFF;
+
+namespace {
+	// the best paths found while searching from one pin or adc, sorted from best to worst
+	struct PathCandidates {
+		struct Candidate {
+			uint8_t nids[MAX_PATH_DEPTH + 1];
+			uint8_t length;
+			// paths ending in a converter with an amp are preferred as they have volume control,
+			// after that shorter paths are preferred.
+			uint16_t rank;
+		};
+
+		// paths found later with the given minimum length can't replace any of the candidates
+		[[nodiscard]] bool can_prune(size_t min_length) const {
+			return count == MAX_PATHS_PER_ROOT && candidates[count - 1].rank <= min_length;
+		}
+
+		void add(const Candidate& candidate) {
+			for (size_t i = 0; i < count; ++i) {
+				auto& other = candidates[i];
+				if (other.length == candidate.length &&
+					__builtin_memcmp(other.nids, candidate.nids, candidate.length) == 0) {
+					return;
+				}
+			}
 
-	uint8_t num_func_groups = num_func_groups_resp & 0xFF;
-	uint8_t func_groups_start_nid = num_func_groups_resp >> 16 & 0xFF;
+			size_t pos = count;
+			if (count == MAX_PATHS_PER_ROOT) {
+				if (candidates[count - 1].rank <= candidate.rank) {
+					return;
+				}
+				--pos;
+			}
+			else {
+				++count;
+			}
 
-	for (uint8_t func_group_i = func_groups_start_nid;
-		func_group_i < func_groups_start_nid + num_func_groups;
-		 ++func_group_i) {
-		uint32_t func_group_type_resp;
-		status = get_parameter(func_group_i, param::FUNC_GROUP_TYPE, func_group_type_resp);
-		if (status != UHDA_STATUS_SUCCESS) {
-			return status;
+			for (; pos > 0 && candidates[pos - 1].rank > candidate.rank; --pos) {
+				candidates[pos] = candidates[pos - 1];
+			}
+			candidates[pos] = candidate;
 		}
 
-		if ((func_group_type_resp & 0xFF) != func_group_type::AUDIO) {
-			continue;
+		Candidate candidates[MAX_PATHS_PER_ROOT] {};
+		size_t count {};
+	};
+}
+
+static uint16_t path_rank(uint8_t length, uint32_t converter_amp_caps) {
+	bool has_volume = amp_caps::get_num_steps(converter_amp_caps);
+	return (has_volume ? 0 : 0x100) | length;
+}
+
+static UhdaStatus store_paths(
+	UhdaCodec* codec,
+	vector<UhdaPath>& paths,
+	const PathCandidates& candidates) {
+	for (size_t i = 0; i < candidates.count; ++i) {
+		auto& candidate = candidates.candidates[i];
+
+		auto nids = codec->arena.alloc_array<uint8_t>(candidate.length);
+		if (!nids) {
+			return UHDA_STATUS_NO_MEMORY;
 		}
+		__builtin_memcpy(nids, candidate.nids, candidate.length);
 
-		status = set_power_state(func_group_i, 0);
-		if (status != UHDA_STATUS_SUCCESS) {
-			return status;
+		if (!paths.push({
+			.codec = codec,
+			.nids = nids,
+			.length = candidate.length,
+			.gain = 0
+		})) {
+			return UHDA_STATUS_NO_MEMORY;
+		}
+	}
+
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus UhdaCodec::enumerate(VerbBatch*& batch) {
+	batch = nullptr;
+
+	if (enum_step != EnumStep::Start) {
+		if (enum_batch.status != UHDA_STATUS_SUCCESS) {
+			return enum_batch.status;
 		}
 
-		uint32_t num_widgets_resp;
-		status = get_parameter(func_group_i, param::NODE_COUNT, num_widgets_resp);
+		auto status = record_verbs(enum_verbs.data(), enum_verbs.size());
 		if (status != UHDA_STATUS_SUCCESS) {
 			return status;
 		}
+	}
 
-		uint8_t num_widgets = num_widgets_resp & 0xFF;
-		uint8_t widgets_start_nid = num_widgets_resp >> 16 & 0xFF;
+	// each step parses the responses to the previous batch and prepares the next one,
+	// steps that have nothing to send fall through to the next step.
+	do {
+		switch (enum_step) {
+			case EnumStep::Start:
+			{
+				if (!enum_verbs.resize(3)) {
+					return UHDA_STATUS_NO_MEMORY;
+				}
+				enum_verbs[0] = Verb::make(0, cmd::GET_PARAM, param::VENDOR_ID);
+				enum_verbs[1] = Verb::make(0, cmd::GET_PARAM, param::REVISION_ID);
+				enum_verbs[2] = Verb::make(0, cmd::GET_PARAM, param::NODE_COUNT);
+				enum_step = EnumStep::Root;
+				break;
+			}
+			case EnumStep::Root:
+			{
+				vendor_id = enum_verbs[0].res;
+				revision_id = enum_verbs[1].res;
+				root_node_count = enum_verbs[2].res;
+
+				if (cached_topology) {
+					auto status = load_topology(cached_topology, cached_topology_size);
+					if (status == UHDA_STATUS_SUCCESS) {
+						// the codec was reset so the power state and the amps still have to be set up
+						uint32_t count = 0;
+						for (auto& group : func_groups) {
+							count += 1 + group.widget_count;
+						}
+						if (!enum_verbs.resize(count)) {
+							return UHDA_STATUS_NO_MEMORY;
+						}
 
-		for (uint8_t widget_i = widgets_start_nid; widget_i < widgets_start_nid + num_widgets; ++widget_i) {
-			uint32_t audio_caps;
-			uint32_t in_amp_caps;
-			uint32_t out_amp_caps;
-			uint32_t pin_caps;
-			uint32_t conn_list_len_resp;
-			uint32_t default_config;
+						uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | 1 << 7;
+
+						uint32_t index = 0;
+						for (auto& group : func_groups) {
+							enum_verbs[index++] = Verb::make(group.nid, cmd::SET_POWER_STATE, 0);
+							for (uint32_t i = 0; i < group.widget_count; ++i) {
+								enum_verbs[index++] = Verb::make_long(
+									group.start_nid + i,
+									cmd::SET_AMP_GAIN_MUTE,
+									amp_data);
+							}
+						}
 
-			status = get_parameter(widget_i, param::AUDIO_CAPS, audio_caps);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
+						enum_step = EnumStep::Restore;
+						break;
+					}
+					else if (status == UHDA_STATUS_NO_MEMORY) {
+						return status;
+					}
 
-			status = get_parameter(widget_i, param::IN_AMP_CAPS, in_amp_caps);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
+					uhda_kernel_log("warning: cached codec topology doesn't match, enumerating the codec");
+					clear_topology();
+				}
 
-			status = get_parameter(widget_i, param::OUT_AMP_CAPS, out_amp_caps);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
+				uint8_t num_func_groups = root_node_count & 0xFF;
+				uint8_t func_groups_start_nid = root_node_count >> 16 & 0xFF;
 
-			status = get_parameter(widget_i, param::PIN_CAPS, pin_caps);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
+				if (!enum_verbs.resize(num_func_groups * 2)) {
+					return UHDA_STATUS_NO_MEMORY;
+				}
+				for (uint32_t i = 0; i < num_func_groups; ++i) {
+					uint8_t nid = func_groups_start_nid + i;
+					enum_verbs[i * 2] = Verb::make(nid, cmd::GET_PARAM, param::FUNC_GROUP_TYPE);
+					enum_verbs[i * 2 + 1] = Verb::make(nid, cmd::GET_PARAM, param::NODE_COUNT);
+				}
 
-			status = get_parameter(widget_i, param::CONN_LIST_LEN, conn_list_len_resp);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
+				enum_step = EnumStep::FuncGroups;
+				break;
 			}
+			case EnumStep::FuncGroups:
+			{
+				uint8_t func_groups_start_nid = root_node_count >> 16 & 0xFF;
+
+				uint32_t count = 0;
+				for (uint32_t i = 0; i < enum_verbs.size() / 2; ++i) {
+					if ((enum_verbs[i * 2].res & 0xFF) != func_group_type::AUDIO) {
+						continue;
+					}
 
-			status = get_config_default(widget_i, default_config);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
+					uint32_t num_widgets_resp = enum_verbs[i * 2 + 1].res;
+					uint32_t num_widgets = num_widgets_resp & 0xFF;
+					uint32_t widgets_start_nid = num_widgets_resp >> 16 & 0xFF;
+					if (widgets_start_nid + num_widgets > 0x100) {
+						num_widgets = 0x100 - widgets_start_nid;
+					}
+
+					if (!func_groups.push({
+						.nid = static_cast<uint8_t>(func_groups_start_nid + i),
+						.start_nid = static_cast<uint8_t>(widgets_start_nid),
+						.widget_count = static_cast<uint8_t>(num_widgets)
+					})) {
+						return UHDA_STATUS_NO_MEMORY;
+					}
+
+					count += 1 + num_widgets * WIDGET_VERB_COUNT;
+				}
 
-			uint8_t type = audio_caps >> 20 & 0b1111;
+				if (!enum_verbs.resize(count)) {
+					return UHDA_STATUS_NO_MEMORY;
+				}
+
+				// set output amp, set left amp, set right amp and mute
+				uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | 1 << 7;
+
+				uint32_t index = 0;
+				for (auto& group : func_groups) {
+					enum_verbs[index++] = Verb::make(group.nid, cmd::SET_POWER_STATE, 0);
+
+					for (uint32_t i = 0; i < group.widget_count; ++i) {
+						uint8_t nid = group.start_nid + i;
+						enum_verbs[index++] = Verb::make(nid, cmd::GET_PARAM, param::AUDIO_CAPS);
+						enum_verbs[index++] = Verb::make(nid, cmd::GET_PARAM, param::IN_AMP_CAPS);
+						enum_verbs[index++] = Verb::make(nid, cmd::GET_PARAM, param::OUT_AMP_CAPS);
+						enum_verbs[index++] = Verb::make(nid, cmd::GET_PARAM, param::PIN_CAPS);
+						enum_verbs[index++] = Verb::make(nid, cmd::GET_PARAM, param::CONN_LIST_LEN);
+						enum_verbs[index++] = Verb::make(nid, cmd::GET_CONFIG_DEFAULT, 0);
+						enum_verbs[index++] = Verb::make_long(nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
+					}
+				}
 
-			if (conn_list_len_resp & 1 << 7) {
-				uhda_kernel_log("error: long-form connection lists are not supported");
-				return UHDA_STATUS_UNSUPPORTED;
+				enum_step = EnumStep::Widgets;
+				break;
 			}
+			case EnumStep::Widgets:
+			{
+				if (!reserve_widgets()) {
+					return UHDA_STATUS_NO_MEMORY;
+				}
 
-			vector<uint8_t> connections;
-			uint8_t conn_list_len = conn_list_len_resp & 0x7F;
-			for (uint8_t i = 0; i < conn_list_len; i += 4) {
-				uint32_t resp;
-				status = get_connection_list(widget_i, i, resp);
-				if (status != UHDA_STATUS_SUCCESS) {
-					return status;
+				uint32_t conn_verb_count = 0;
+
+				uint32_t index = 0;
+				for (auto& group : func_groups) {
+					// skip the power state response
+					++index;
+
+					for (uint32_t i = 0; i < group.widget_count; ++i) {
+						auto* res = &enum_verbs[index];
+						index += WIDGET_VERB_COUNT;
+
+						uint8_t widget_i = group.start_nid + i;
+
+						uint32_t audio_caps = res[0].res;
+						uint32_t in_amp_caps = res[1].res;
+						uint32_t out_amp_caps = res[2].res;
+						uint32_t pin_caps = res[3].res;
+						uint32_t conn_list_len_resp = res[4].res;
+						uint32_t default_config = res[5].res;
+
+						uint8_t type = audio_caps >> 20 & 0b1111;
+
+						if (conn_list_len_resp & 1 << 7) {
+							uhda_kernel_log("error: long-form connection lists are not supported");
+							return UHDA_STATUS_UNSUPPORTED;
+						}
+
+						// the entries are filled in once the connection list responses arrive
+						uint8_t conn_list_len = conn_list_len_resp & 0x7F;
+						// each response contains up to 4 entries
+						conn_verb_count += (conn_list_len + 3) / 4;
+
+						auto status = add_widget(
+							widget_i,
+							type,
+							conn_list_len,
+							in_amp_caps,
+							out_amp_caps,
+							pin_caps,
+							default_config,
+							audio_caps & 1 << 7,
+							audio_caps & 1 << 9);
+						if (status != UHDA_STATUS_SUCCESS) {
+							return status;
+						}
+					}
 				}
 
-				uint8_t count = conn_list_len - i;
-				if (count > 4) {
-					count = 4;
+				if (!enum_verbs.resize(conn_verb_count)) {
+					return UHDA_STATUS_NO_MEMORY;
 				}
 
-				for (uint8_t j = 0; j < count; ++j) {
-					uint8_t nid = resp >> (j * 8) & 0xFF;
-					if (!connections.push(nid)) {
-						return UHDA_STATUS_NO_MEMORY;
+				index = 0;
+				for (auto& widget : widgets) {
+					if (!widget.codec) {
+						continue;
+					}
+					for (uint32_t i = 0; i < widget.connections.size(); i += 4) {
+						enum_verbs[index++] = Verb::make(widget.nid, cmd::GET_CONN_LIST, i);
 					}
 				}
+
+				enum_step = EnumStep::Connections;
+				break;
 			}
+			case EnumStep::Connections:
+			{
+				size_t raw_count = 0;
+				for (auto& widget : widgets) {
+					raw_count += widget.connections.size();
+				}
 
-			// set output amp, set left amp, set right amp and mute
-			uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | 1 << 7;
-			status = set_amp_gain_mute(widget_i, amp_data);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
-
-			bool trigger = pin_caps & 1 << 1;
-			bool presence_detect = pin_caps & 1 << 2;
-			bool no_presence_detect = default_config >> 8 & 1;
-
-			UhdaWidget widget {
-				.codec = this,
-				.connections {move(connections)},
-				.in_amp_caps = in_amp_caps,
-				.out_amp_caps = out_amp_caps,
-				.pin_caps = pin_caps,
-				.default_config = default_config,
-				.nid = widget_i,
-				.type = type,
-				.default_dev = static_cast<uint8_t>(default_config >> 20 & 0xF),
-				.trigger = trigger,
-				.presence_detect = !no_presence_detect && presence_detect
-			};
-			if (widgets.size() <= widget_i) {
-				if (!widgets.resize(widget_i + 1)) {
+				vector<uint8_t> raw;
+				if (!raw.resize(raw_count)) {
 					return UHDA_STATUS_NO_MEMORY;
 				}
+
+				uint32_t index = 0;
+				size_t raw_index = 0;
+				for (auto& widget : widgets) {
+					if (!widget.codec) {
+						continue;
+					}
+					widget.connections.ptr = raw.data() + raw_index;
+					for (uint32_t i = 0; i < widget.connections.size(); ++i) {
+						raw[raw_index++] = enum_verbs[index + i / 4].res >> (i % 4 * 8) & 0xFF;
+					}
+					index += (widget.connections.size() + 3) / 4;
+				}
+
+				auto status = expand_connections();
+				if (status != UHDA_STATUS_SUCCESS) {
+					return status;
+				}
+
+				enum_step = EnumStep::Outputs;
+				break;
 			}
-			widgets[widget_i] = move(widget);
+			case EnumStep::Restore:
+				enum_step = EnumStep::Outputs;
+				break;
+			case EnumStep::Outputs:
+			{
+				auto status = finish_init();
+				if (status != UHDA_STATUS_SUCCESS) {
+					return status;
+				}
 
-			if (type == widget_type::AUDIO_OUT) {
-				if (!dac_nids.push(widget_i)) {
+				// enable the presence change reports and get the initial presence
+				if (!enum_verbs.resize(jacks.size() * 3)) {
 					return UHDA_STATUS_NO_MEMORY;
 				}
+
+				uint32_t count = 0;
+				for (auto jack : jacks) {
+					enum_verbs[count++] = Verb::make(
+						jack->widget->nid,
+						cmd::SET_UNSOL_ENABLE,
+						1 << 7 | jack->unsol_tag);
+				}
+				count += build_jack_sense(~0ULL, enum_verbs.data() + count);
+
+				if (!enum_verbs.resize(count)) {
+					return UHDA_STATUS_NO_MEMORY;
+				}
+
+				enum_step = EnumStep::Jacks;
+				break;
 			}
-			else if (type == widget_type::PIN_COMPLEX) {
-				if (!output_nids.push(widget_i)) {
+			case EnumStep::Jacks:
+			{
+				if (!enum_verbs.is_empty()) {
+					presence_bits = parse_jack_sense(~0ULL, enum_verbs.data() + jacks.size());
+				}
+
+				// there are no paths set up yet, so everything that can be is powered down
+				if (!enum_verbs.resize(widgets.size() + func_groups.size())) {
+					return UHDA_STATUS_NO_MEMORY;
+				}
+				auto count = build_idle_power(enum_verbs.data());
+				if (!enum_verbs.resize(count)) {
 					return UHDA_STATUS_NO_MEMORY;
 				}
+
+				enum_step = EnumStep::Power;
+				break;
 			}
+			case EnumStep::Power:
+				enum_step = EnumStep::Done;
+				break;
+			case EnumStep::Done:
+				break;
 		}
-	}
 
-	status = find_output_paths();
+		if (enum_step == EnumStep::Done) {
+			enum_verbs = vector<Verb> {};
+			cached_topology = nullptr;
+			cached_topology_size = 0;
+			return UHDA_STATUS_SUCCESS;
+		}
+	} while (enum_verbs.is_empty());
+
+	enum_batch = {};
+	enum_batch.verbs = enum_verbs.data();
+	enum_batch.count = enum_verbs.size();
+	enum_batch.cid = cid;
+	batch = &enum_batch;
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus UhdaCodec::finish_init() {
+	auto status = find_output_paths();
 	if (status != UHDA_STATUS_SUCCESS) {
 		return status;
 	}
 
 	for (auto pin_i : output_nids) {
-		auto& pin = widgets[pin_i];
+		auto& pin = *get_widget(pin_i);
 		// check if output capable
 		if (!(pin.pin_caps & 1 << 4)) {
 			continue;
@@ -182,37 +440,24 @@ UhdaStatus UhdaCodec::init() {
 			continue;
 		}
 
-		auto new_output_ptr = uhda_kernel_malloc(sizeof(UhdaOutput));
-		if (!new_output_ptr) {
-			return UHDA_STATUS_NO_MEMORY;
-		}
-		auto* new_output = construct<UhdaOutput>(new_output_ptr, UhdaOutput {
+		auto* new_output = arena.create<UhdaOutput>(UhdaOutput {
 			.widget = &pin,
 			.sequence = sequence
 		});
+		if (!new_output) {
+			return UHDA_STATUS_NO_MEMORY;
+		}
 
 		if (assoc == 0b1111) {
 			// low-priority independent output
 
-			auto group_ptr = uhda_kernel_malloc(sizeof(UhdaOutputGroup));
-			if (!group_ptr) {
-				new_output->~UhdaOutput();
-				uhda_kernel_free(new_output, sizeof(UhdaOutput));
-				return UHDA_STATUS_NO_MEMORY;
-			}
-
-			auto* group = construct<UhdaOutputGroup>(group_ptr, assoc);
-			if (!group->outputs.push(new_output)) {
-				new_output->~UhdaOutput();
-				uhda_kernel_free(new_output, sizeof(UhdaOutput));
-				group->~UhdaOutputGroup();
-				uhda_kernel_free(group_ptr, sizeof(UhdaOutputGroup));
+			auto* group = arena.create<UhdaOutputGroup>(assoc);
+			if (!group) {
 				return UHDA_STATUS_NO_MEMORY;
 			}
 
-			if (!output_groups.push(group)) {
+			if (!group->outputs.push(new_output) || !output_groups.push(group)) {
 				group->~UhdaOutputGroup();
-				uhda_kernel_free(group_ptr, sizeof(UhdaOutputGroup));
 				return UHDA_STATUS_NO_MEMORY;
 			}
 			continue;
@@ -245,26 +490,19 @@ UhdaStatus UhdaCodec::init() {
 			}
 		}
 		else {
-			auto group_ptr = uhda_kernel_malloc(sizeof(UhdaOutputGroup));
-			if (!group_ptr) {
-				new_output->~UhdaOutput();
-				uhda_kernel_free(new_output, sizeof(UhdaOutput));
+			auto* new_group = arena.create<UhdaOutputGroup>(assoc);
+			if (!new_group) {
 				return UHDA_STATUS_NO_MEMORY;
 			}
 
-			auto* new_group = construct<UhdaOutputGroup>(group_ptr, assoc);
 			if (!new_group->outputs.push(new_output)) {
-				new_output->~UhdaOutput();
-				uhda_kernel_free(new_output, sizeof(UhdaOutput));
 				new_group->~UhdaOutputGroup();
-				uhda_kernel_free(group_ptr, sizeof(UhdaOutputGroup));
 				return UHDA_STATUS_NO_MEMORY;
 			}
 
 			if (output_groups.is_empty() || output_groups.back()->assoc <= assoc) {
 				if (!output_groups.push(new_group)) {
 					new_group->~UhdaOutputGroup();
-					uhda_kernel_free(group_ptr, sizeof(UhdaOutputGroup));
 					return UHDA_STATUS_NO_MEMORY;
 				}
 			}
@@ -273,7 +511,6 @@ UhdaStatus UhdaCodec::init() {
 					if (output_group->assoc > assoc) {
 						if (!output_groups.insert(&output_group, new_group)) {
 							new_group->~UhdaOutputGroup();
-							uhda_kernel_free(group_ptr, sizeof(UhdaOutputGroup));
 							return UHDA_STATUS_NO_MEMORY;
 						}
 						break;
@@ -283,23 +520,48 @@ UhdaStatus UhdaCodec::init() {
 		}
 	}
 
-	return UHDA_STATUS_SUCCESS;
+	status = find_jacks();
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	return find_inputs();
 }
 
-UhdaStatus UhdaCodec::find_output_paths() {
-	struct StackEntry {
-		UhdaWidget& widget;
-		uint8_t con_index;
-		uint8_t con_range_index;
-		uint8_t con_range_end;
-	};
+UhdaStatus UhdaCodec::find_jacks() {
+	for (auto group : output_groups) {
+		for (auto output : group->outputs) {
+			auto widget = output->widget;
+			// the tag is 6 bits and 0 is reserved to mean no tag
+			if (!widget->presence_detect || !widget->unsol_capable || jacks.size() == 63) {
+				continue;
+			}
 
-	vector<StackEntry> stack;
+			if (!jacks.push(output)) {
+				return UHDA_STATUS_NO_MEMORY;
+			}
+			output->unsol_tag = jacks.size();
+		}
+	}
+
+	// allocated up front so that presence changes can be handled in the irq
+	if (!jack_verbs.resize(jacks.size() * 2)) {
+		return UHDA_STATUS_NO_MEMORY;
+	}
+
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus UhdaCodec::find_inputs() {
+	auto status = find_input_paths();
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
 
 	for (auto pin_i : output_nids) {
-		auto& pin = widgets[pin_i];
-		// check if output capable
-		if (!(pin.pin_caps & 1 << 4)) {
+		auto& pin = *get_widget(pin_i);
+		// check if input capable
+		if (!(pin.pin_caps & 1 << 5)) {
 			continue;
 		}
 		uint8_t connectivity = pin.default_config >> 30;
@@ -308,205 +570,1030 @@ UhdaStatus UhdaCodec::find_output_paths() {
 			continue;
 		}
 
-		if (!stack.push({
-			.widget = pin,
-			.con_index = 0,
-			.con_range_index = 0xFF,
-			.con_range_end = 0
-		})) {
-			return UHDA_STATUS_NO_MEMORY;
+		switch (pin.default_dev) {
+			case default_dev::CD:
+			case default_dev::LINE_IN:
+			case default_dev::AUX:
+			case default_dev::MIN_IN:
+			case default_dev::SPDIF_IN:
+			case default_dev::DIGITAL_OTHER_IN:
+				break;
+			default:
+				continue;
 		}
 
-		while (true) {
-			if (stack.is_empty()) {
+		// only inputs that can be recorded from are reported
+		bool has_path = false;
+		for (auto& path : input_paths) {
+			if (path.first() == &pin) {
+				has_path = true;
 				break;
 			}
+		}
+		if (!has_path) {
+			continue;
+		}
 
-			auto* cur_entry = &stack.back();
-			auto& cur_widget = cur_entry->widget;
-			if (cur_entry->con_index == cur_widget.connections.size()) {
-				stack.pop();
-				continue;
-			}
+		auto* new_input = arena.create<UhdaInput>(UhdaInput {
+			.widget = &pin
+		});
+		if (!new_input || !inputs.push(new_input)) {
+			return UHDA_STATUS_NO_MEMORY;
+		}
+	}
 
-			if (cur_entry->con_range_index > cur_entry->con_range_end) {
-				cur_entry->con_range_index = cur_widget.connections[cur_entry->con_index++];
-				if (cur_entry->con_range_index & 1 << 7) {
-					uhda_kernel_log(
-						"warning: first connection list entry can't be a range, treating as an individual entry");
-					cur_entry->con_range_index &= 0x7F;
-				}
+	return UHDA_STATUS_SUCCESS;
+}
 
-				if (cur_entry->con_index < cur_widget.connections.size() &&
-					cur_widget.connections[cur_entry->con_index] & 1 << 7) {
-					cur_entry->con_range_end = cur_widget.connections[cur_entry->con_index++] & 0x7F;
-				}
-				else {
-					cur_entry->con_range_end = cur_entry->con_range_index;
-				}
-			}
+UhdaStatus UhdaCodec::find_input_paths() {
+	struct StackEntry {
+		UhdaWidget& widget;
+		uint8_t con_index;
+	};
 
-			uint8_t nid = cur_entry->con_range_index++;
-			if (nid >= widgets.size()) {
-				uhda_kernel_log("warning: invalid nid in connection list");
-				continue;
+	vector<StackEntry> stack;
+
+	// the connection lists point towards the inputs, so the search starts from the adcs
+	for (auto adc_i : adc_nids) {
+		auto& adc = *get_widget(adc_i);
+
+		PathCandidates candidates {};
+		uint32_t steps = 0;
+		// iterative deepening so that the shortest paths are found first if the search is cut short,
+		// paths found again with a larger depth limit are deduplicated.
+		for (size_t max_depth = 1; max_depth <= MAX_PATH_DEPTH; ++max_depth) {
+			bool truncated = false;
+			if (!stack.push({
+				.widget = adc,
+				.con_index = 0
+			})) {
+				return UHDA_STATUS_NO_MEMORY;
 			}
 
-			auto& assoc_widget = widgets[nid];
-			if (assoc_widget.type == widget_type::AUDIO_OUT) {
-				UhdaPath path {
-					.codec = this,
-					.widgets {},
-					.gain = 0
-				};
-				for (auto& entry : stack) {
-					if (!path.widgets.push(&entry.widget)) {
-						return UHDA_STATUS_NO_MEMORY;
+			while (true) {
+				if (stack.is_empty()) {
+					break;
+				}
+				if (++steps > MAX_SEARCH_STEPS) {
+					while (!stack.is_empty()) {
+						stack.pop();
 					}
+					break;
 				}
-				if (!path.widgets.push(&assoc_widget)) {
-					return UHDA_STATUS_NO_MEMORY;
+
+				auto* cur_entry = &stack.back();
+				auto& cur_widget = cur_entry->widget;
+				if (cur_entry->con_index == cur_widget.connections.size()) {
+					stack.pop();
+					continue;
 				}
 
-				if (!output_paths.push(move(path))) {
-					return UHDA_STATUS_NO_MEMORY;
+				uint8_t nid = cur_widget.connections[cur_entry->con_index++];
+				auto* assoc_widget_ptr = get_widget(nid);
+				if (!assoc_widget_ptr) {
+					uhda_kernel_log("warning: invalid nid in connection list");
+					continue;
 				}
-			}
-			else {
-				bool circular_path = false;
-				for (auto& entry : stack) {
-					if (&entry.widget == &assoc_widget) {
-						circular_path = true;
-						break;
+
+				auto& assoc_widget = *assoc_widget_ptr;
+				if (assoc_widget.type == widget_type::PIN_COMPLEX) {
+					uint8_t connectivity = assoc_widget.default_config >> 30;
+					// not input capable or no physical connection
+					if (!(assoc_widget.pin_caps & 1 << 5) || connectivity == 1) {
+						continue;
 					}
-				}
 
-				if (circular_path || stack.size() >= 20) {
-					continue;
+					PathCandidates::Candidate candidate {};
+					candidate.nids[candidate.length++] = nid;
+					for (size_t i = stack.size(); i > 0; --i) {
+						candidate.nids[candidate.length++] = stack[i - 1].widget.nid;
+					}
+					candidate.rank = path_rank(candidate.length, adc.in_amp_caps);
+					candidates.add(candidate);
 				}
-				if (!stack.push({
-					.widget = assoc_widget,
-					.con_index = 0,
-					.con_range_index = 0xFF,
-					.con_range_end = 0
-				})) {
-					return UHDA_STATUS_NO_MEMORY;
+				else if (assoc_widget.type == widget_type::AUDIO_MIXER ||
+					assoc_widget.type == widget_type::AUDIO_SELECTOR) {
+					bool circular_path = false;
+					for (auto& entry : stack) {
+						if (&entry.widget == &assoc_widget) {
+							circular_path = true;
+							break;
+						}
+					}
+
+					// any path through the widget has at least two more widgets than the stack
+					if (circular_path || candidates.can_prune(stack.size() + 2)) {
+						continue;
+					}
+					if (stack.size() >= max_depth) {
+						truncated = true;
+						continue;
+					}
+					if (!stack.push({
+						.widget = assoc_widget,
+						.con_index = 0
+					})) {
+						return UHDA_STATUS_NO_MEMORY;
+					}
 				}
 			}
+
+			if (steps > MAX_SEARCH_STEPS) {
+				uhda_kernel_log("warning: path search limit reached, using the paths found so far");
+				break;
+			}
+			else if (!truncated) {
+				break;
+			}
+		}
+
+		auto status = store_paths(this, input_paths, candidates);
+		if (status != UHDA_STATUS_SUCCESS) {
+			return status;
 		}
 	}
 
-	return UHDA_STATUS_SUCCESS;
+	return input_path_index.build(input_paths);
 }
 
-UhdaStatus UhdaCodec::get_parameter(uint8_t nid, uint8_t param, uint32_t& res) const {
-	LockGuard guard {controller->lock};
+UhdaStatus UhdaCodec::find_output_paths() {
+	struct StackEntry {
+		UhdaWidget& widget;
+		uint8_t con_index;
+	};
 
-	auto index = controller->submit_verb(cid, nid, cmd::GET_PARAM, param);
-	ResponseDescriptor resp {};
-	auto status = controller->wait_for_verb(index, resp);
-	res = resp.resp;
-	return status;
-}
+	vector<StackEntry> stack;
 
-UhdaStatus UhdaCodec::get_connection_list(uint8_t nid, uint8_t offset_index, uint32_t& res) const {
-	LockGuard guard {controller->lock};
+	for (auto pin_i : output_nids) {
+		auto& pin = *get_widget(pin_i);
+		// check if output capable
+		if (!(pin.pin_caps & 1 << 4)) {
+			continue;
+		}
+		uint8_t connectivity = pin.default_config >> 30;
+		// no physical connection
+		if (connectivity == 1) {
+			continue;
+		}
 
-	auto index = controller->submit_verb(cid, nid, cmd::GET_CONN_LIST, offset_index);
-	ResponseDescriptor resp {};
-	auto status = controller->wait_for_verb(index, resp);
-	res = resp.resp;
-	return status;
-}
+		PathCandidates candidates {};
+		uint32_t steps = 0;
+		// iterative deepening so that the shortest paths are found first if the search is cut short,
+		// paths found again with a larger depth limit are deduplicated.
+		for (size_t max_depth = 1; max_depth <= MAX_PATH_DEPTH; ++max_depth) {
+			bool truncated = false;
+			if (!stack.push({
+				.widget = pin,
+				.con_index = 0
+			})) {
+				return UHDA_STATUS_NO_MEMORY;
+			}
 
-UhdaStatus UhdaCodec::get_config_default(uint8_t nid, uint32_t& res) const {
-	LockGuard guard {controller->lock};
+			while (true) {
+				if (stack.is_empty()) {
+					break;
+				}
+				if (++steps > MAX_SEARCH_STEPS) {
+					while (!stack.is_empty()) {
+						stack.pop();
+					}
+					break;
+				}
 
-	auto index = controller->submit_verb(cid, nid, cmd::GET_CONFIG_DEFAULT, 0);
-	ResponseDescriptor resp {};
-	auto status = controller->wait_for_verb(index, resp);
-	res = resp.resp;
-	return status;
-}
+				auto* cur_entry = &stack.back();
+				auto& cur_widget = cur_entry->widget;
+				if (cur_entry->con_index == cur_widget.connections.size()) {
+					stack.pop();
+					continue;
+				}
+
+				uint8_t nid = cur_widget.connections[cur_entry->con_index++];
+				auto* assoc_widget_ptr = get_widget(nid);
+				if (!assoc_widget_ptr) {
+					uhda_kernel_log("warning: invalid nid in connection list");
+					continue;
+				}
+
+				auto& assoc_widget = *assoc_widget_ptr;
+				if (assoc_widget.type == widget_type::AUDIO_OUT) {
+					PathCandidates::Candidate candidate {};
+					for (auto& entry : stack) {
+						candidate.nids[candidate.length++] = entry.widget.nid;
+					}
+					candidate.nids[candidate.length++] = nid;
+					candidate.rank = path_rank(candidate.length, assoc_widget.out_amp_caps);
+					candidates.add(candidate);
+				}
+				else {
+					bool circular_path = false;
+					for (auto& entry : stack) {
+						if (&entry.widget == &assoc_widget) {
+							circular_path = true;
+							break;
+						}
+					}
+
+					// any path through the widget has at least two more widgets than the stack
+					if (circular_path || candidates.can_prune(stack.size() + 2)) {
+						continue;
+					}
+					if (stack.size() >= max_depth) {
+						truncated = true;
+						continue;
+					}
+					if (!stack.push({
+						.widget = assoc_widget,
+						.con_index = 0
+					})) {
+						return UHDA_STATUS_NO_MEMORY;
+					}
+				}
+			}
+
+			if (steps > MAX_SEARCH_STEPS) {
+				uhda_kernel_log("warning: path search limit reached, using the paths found so far");
+				break;
+			}
+			else if (!truncated) {
+				break;
+			}
+		}
+
+		auto status = store_paths(this, output_paths, candidates);
+		if (status != UHDA_STATUS_SUCCESS) {
+			return status;
+		}
+	}
+
+	return output_path_index.build(output_paths);
+}
+
+bool PathIndex::compatible(const UhdaPath& a, const UhdaPath& b, bool same_stream) {
+	if (!same_stream) {
+		// no widget can be shared between the paths of different streams
+		return !a.pin_side.intersects(b.pin_side) && !a.converter_side.intersects(b.converter_side);
+	}
+
+	if (!a.converter_side.intersects(b.converter_side)) {
+		return true;
+	}
+
+	// paths of the same stream can share widgets as long as they continue to the same widget towards the pin
+	auto a_nids = a.nids;
+	auto b_nids = b.nids;
+	for (size_t i = 1; i < a.length; ++i) {
+		auto nid = a_nids[i];
+		if (!b.converter_side.contains(nid)) {
+			continue;
+		}
+
+		for (size_t j = 1; j < b.length; ++j) {
+			if (b_nids[j] == nid) {
+				if (a_nids[i - 1] != b_nids[j - 1]) {
+					return false;
+				}
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+UhdaStatus PathIndex::build(vector<UhdaPath>& paths) {
+	for (auto& path : paths) {
+		path.pin_side = {};
+		path.converter_side = {};
+		for (size_t i = 0; i < path.length; ++i) {
+			auto nid = path.nids[i];
+			if (i + 1 != path.length) {
+				path.pin_side.add(nid);
+			}
+			if (i != 0) {
+				path.converter_side.add(nid);
+			}
+		}
+	}
+
+	words = (paths.size() + 63) / 64;
+	if (!separate_rows.resize(paths.size() * words) ||
+		!shared_rows.resize(paths.size() * words)) {
+		return UHDA_STATUS_NO_MEMORY;
+	}
+
+	for (auto& word : separate_rows) {
+		word = 0;
+	}
+	for (auto& word : shared_rows) {
+		word = 0;
+	}
+
+	for (size_t i = 0; i < paths.size(); ++i) {
+		for (size_t j = i; j < paths.size(); ++j) {
+			uint64_t bit_i = 1ULL << (i % 64);
+			uint64_t bit_j = 1ULL << (j % 64);
+
+			if (compatible(paths[i], paths[j], false)) {
+				separate_rows[i * words + j / 64] |= bit_j;
+				separate_rows[j * words + i / 64] |= bit_i;
+			}
+			if (compatible(paths[i], paths[j], true)) {
+				shared_rows[i * words + j / 64] |= bit_j;
+				shared_rows[j * words + i / 64] |= bit_i;
+			}
+		}
+	}
+
+	return UHDA_STATUS_SUCCESS;
+}
+
+bool UhdaCodec::reserve_widgets() {
+	size_t start = 0xFF;
+	size_t end = 0;
+	for (auto& group : func_groups) {
+		if (!group.widget_count) {
+			continue;
+		}
+		if (group.start_nid < start) {
+			start = group.start_nid;
+		}
+		if (group.start_nid + group.widget_count > end) {
+			end = group.start_nid + group.widget_count;
+		}
+	}
+
+	if (!end) {
+		return true;
+	}
+	first_nid = start;
+	return widgets.resize(end - start);
+}
+
+// writes the connections of a raw connection list with the ranges expanded to `res` if not null,
+// returns the number of connections. the index of a connection is its connection select index.
+static size_t expand_connection_list(const uint8_t* raw, size_t raw_count, uint8_t* res) {
+	size_t count = 0;
+	uint8_t prev = 0;
+	for (size_t i = 0; i < raw_count && count < MAX_CONNECTIONS; ++i) {
+		uint8_t entry = raw[i];
+		if (!(entry & 1 << 7) || i == 0) {
+			if (entry & 1 << 7) {
+				uhda_kernel_log(
+					"warning: first connection list entry can't be a range, treating as an individual entry");
+				entry &= 0x7F;
+			}
+			if (res) {
+				res[count] = entry;
+			}
+			++count;
+			prev = entry;
+			continue;
+		}
+
+		uint8_t end = entry & 0x7F;
+		for (uint32_t nid = prev + 1; nid <= end && count < MAX_CONNECTIONS; ++nid) {
+			if (res) {
+				res[count] = nid;
+			}
+			++count;
+		}
+		prev = end;
+	}
+
+	return count;
+}
+
+UhdaStatus UhdaCodec::expand_connections() {
+	size_t total = 0;
+	for (auto& widget : widgets) {
+		total += expand_connection_list(widget.connections.data(), widget.connections.size(), nullptr);
+	}
+
+	auto* buffer = total ? arena.alloc_array<uint8_t>(total) : nullptr;
+	if (total && !buffer) {
+		return UHDA_STATUS_NO_MEMORY;
+	}
+
+	for (auto& widget : widgets) {
+		auto count = expand_connection_list(widget.connections.data(), widget.connections.size(), buffer);
+		widget.connections = {count ? buffer : nullptr, count};
+		buffer += count;
+	}
+
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus UhdaCodec::add_widget(
+	uint8_t nid,
+	uint8_t type,
+	uint8_t raw_connection_count,
+	uint32_t in_amp_caps,
+	uint32_t out_amp_caps,
+	uint32_t pin_caps,
+	uint32_t default_config,
+	bool unsol_capable,
+	bool digital) {
+	auto index = static_cast<size_t>(nid - first_nid);
+	if (nid < first_nid || index >= widgets.size()) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	bool trigger = pin_caps & 1 << 1;
+	bool presence_detect = pin_caps & 1 << 2;
+	bool no_presence_detect = default_config >> 8 & 1;
+
+	UhdaWidget widget {
+		.codec = this,
+		// points to the raw connection list until `expand_connections` is called
+		.connections {nullptr, raw_connection_count},
+		.in_amp_caps = in_amp_caps,
+		.out_amp_caps = out_amp_caps,
+		.pin_caps = pin_caps,
+		.default_config = default_config,
+		.nid = nid,
+		.type = type,
+		.default_dev = static_cast<uint8_t>(default_config >> 20 & 0xF),
+		.trigger = trigger,
+		.presence_detect = !no_presence_detect && presence_detect,
+		.unsol_capable = unsol_capable,
+		.digital = digital
+	};
+	widgets[index] = widget;
+
+	if (type == widget_type::AUDIO_OUT) {
+		if (!dac_nids.push(nid)) {
+			return UHDA_STATUS_NO_MEMORY;
+		}
+	}
+	else if (type == widget_type::AUDIO_IN) {
+		if (!adc_nids.push(nid)) {
+			return UHDA_STATUS_NO_MEMORY;
+		}
+	}
+	else if (type == widget_type::PIN_COMPLEX) {
+		if (!output_nids.push(nid)) {
+			return UHDA_STATUS_NO_MEMORY;
+		}
+	}
+
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaFuncGroup* UhdaCodec::get_func_group(uint8_t nid) {
+	for (auto& group : func_groups) {
+		if (nid >= group.start_nid && nid < group.start_nid + group.widget_count) {
+			return &group;
+		}
+	}
+	return nullptr;
+}
+
+bool UhdaCodec::can_power_down(const UhdaWidget& widget) const {
+	if (widget.type > widget_type::PIN_COMPLEX) {
+		return false;
+	}
+	return widget.type != widget_type::PIN_COMPLEX || !widget.presence_detect;
+}
+
+bool UhdaCodec::can_power_down(const UhdaFuncGroup&) const {
+	return jacks.is_empty();
+}
+
+UhdaStatus UhdaCodec::power_up_path(UhdaPath& path) {
+	bool power_up_group = false;
+	UhdaFuncGroup* group = get_func_group(path.nids[0]);
+	{
+		LockGuard guard {controller->lock};
+		if (path.active) {
+			return UHDA_STATUS_SUCCESS;
+		}
+		path.active = true;
+		++controller->active_paths;
+
+		// the widgets are powered up by the path setup verbs
+		for (size_t i = 0; i < path.length; ++i) {
+			++path.widget(i)->power_refs;
+		}
+		if (group && group->power_refs++ == 0) {
+			power_up_group = can_power_down(*group);
+		}
+	}
+
+	if (power_up_group) {
+		return set_power_state(group->nid, 0);
+	}
+	return UHDA_STATUS_SUCCESS;
+}
+
+uint32_t UhdaCodec::power_down_path(UhdaPath& path, Verb* verbs) {
+	uint32_t count = 0;
+	UhdaFuncGroup* group = get_func_group(path.nids[0]);
 
-UhdaStatus UhdaCodec::get_pin_sense(uint8_t nid, uint32_t& res) const {
 	LockGuard guard {controller->lock};
+	if (!path.active) {
+		return 0;
+	}
+	path.active = false;
+	--controller->active_paths;
+
+	for (size_t i = 0; i < path.length; ++i) {
+		auto widget = path.widget(i);
+		if (--widget->power_refs || !can_power_down(*widget)) {
+			continue;
+		}
+
+		if (widget->type == widget_type::PIN_COMPLEX && (widget->pin_caps & 1 << 16)) {
+			verbs[count++] = Verb::make(widget->nid, cmd::SET_EAPD_ENABLE, 0);
+		}
+		verbs[count++] = Verb::make(widget->nid, cmd::SET_POWER_STATE, 3);
+	}
+
+	if (group && --group->power_refs == 0 && can_power_down(*group)) {
+		verbs[count++] = Verb::make(group->nid, cmd::SET_POWER_STATE, 3);
+	}
+
+	return count;
+}
+
+uint32_t UhdaCodec::build_idle_power(Verb* verbs) {
+	uint32_t count = 0;
+	for (auto& widget : widgets) {
+		if (widget.codec && !widget.power_refs && can_power_down(widget)) {
+			verbs[count++] = Verb::make(widget.nid, cmd::SET_POWER_STATE, 3);
+		}
+	}
+	for (auto& group : func_groups) {
+		if (!group.power_refs && can_power_down(group)) {
+			verbs[count++] = Verb::make(group.nid, cmd::SET_POWER_STATE, 3);
+		}
+	}
+	return count;
+}
+
+size_t UhdaCodec::get_topology_size() const {
+	size_t size = topology::CODEC_RECORD_SIZE + func_groups.size() * topology::FUNC_GROUP_RECORD_SIZE;
+	for (auto& widget : widgets) {
+		if (widget.codec) {
+			size += topology::WIDGET_RECORD_SIZE + widget.connections.size();
+		}
+	}
+	return size;
+}
+
+void UhdaCodec::write_topology(uint8_t* ptr) const {
+	uint16_t widget_count = 0;
+	for (auto& widget : widgets) {
+		if (widget.codec) {
+			++widget_count;
+		}
+	}
+
+	topology::store32(ptr, get_topology_size());
+	topology::store32(ptr + 4, vendor_id);
+	topology::store32(ptr + 8, revision_id);
+	topology::store32(ptr + 12, root_node_count);
+	ptr[16] = cid;
+	ptr[17] = func_groups.size();
+	topology::store16(ptr + 18, widget_count);
+	ptr += topology::CODEC_RECORD_SIZE;
+
+	for (auto& group : func_groups) {
+		ptr[0] = group.nid;
+		ptr[1] = group.start_nid;
+		ptr[2] = group.widget_count;
+		ptr[3] = 0;
+		ptr += topology::FUNC_GROUP_RECORD_SIZE;
+	}
+
+	for (auto& widget : widgets) {
+		if (!widget.codec) {
+			continue;
+		}
+
+		ptr[0] = widget.nid;
+		ptr[1] = widget.type;
+		ptr[2] = widget.connections.size();
+		ptr[3] = widget.unsol_capable | widget.digital << 1;
+		topology::store32(ptr + 4, widget.in_amp_caps);
+		topology::store32(ptr + 8, widget.out_amp_caps);
+		topology::store32(ptr + 12, widget.pin_caps);
+		topology::store32(ptr + 16, widget.default_config);
+		ptr += topology::WIDGET_RECORD_SIZE;
+
+		if (!widget.connections.is_empty()) {
+			__builtin_memcpy(ptr, widget.connections.data(), widget.connections.size());
+			ptr += widget.connections.size();
+		}
+	}
+}
+
+UhdaStatus UhdaCodec::load_topology(const uint8_t* ptr, size_t size) {
+	// the record is only used if it was created from the same codec
+	if (size < topology::CODEC_RECORD_SIZE ||
+		topology::load32(ptr + 4) != vendor_id ||
+		topology::load32(ptr + 8) != revision_id ||
+		topology::load32(ptr + 12) != root_node_count) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	uint8_t func_group_count = ptr[17];
+	uint16_t widget_count = topology::load16(ptr + 18);
+	size_t offset = topology::CODEC_RECORD_SIZE;
+
+	if (size - offset < func_group_count * topology::FUNC_GROUP_RECORD_SIZE) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+	for (uint32_t i = 0; i < func_group_count; ++i) {
+		auto* record = ptr + offset;
+		offset += topology::FUNC_GROUP_RECORD_SIZE;
+
+		if (record[1] + record[2] > 0x100) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+		if (!func_groups.push({
+			.nid = record[0],
+			.start_nid = record[1],
+			.widget_count = record[2]
+		})) {
+			return UHDA_STATUS_NO_MEMORY;
+		}
+	}
+
+	if (!reserve_widgets()) {
+		return UHDA_STATUS_NO_MEMORY;
+	}
+
+	for (uint32_t i = 0; i < widget_count; ++i) {
+		if (size - offset < topology::WIDGET_RECORD_SIZE) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+		auto* record = ptr + offset;
+		offset += topology::WIDGET_RECORD_SIZE;
+
+		uint8_t nid = record[0];
+		uint8_t conn_count = record[2];
+		if (size - offset < conn_count || get_widget(nid)) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+		auto* connections = ptr + offset;
+		offset += conn_count;
+
+		auto status = add_widget(
+			nid,
+			record[1],
+			conn_count,
+			topology::load32(record + 4),
+			topology::load32(record + 8),
+			topology::load32(record + 12),
+			topology::load32(record + 16),
+			record[3] & 1,
+			record[3] & 1 << 1);
+		if (status != UHDA_STATUS_SUCCESS) {
+			return status;
+		}
+		// the raw list is only read by `expand_connections`
+		get_widget(nid)->connections.ptr = const_cast<uint8_t*>(connections);
+	}
+
+	return expand_connections();
+}
+
+void UhdaCodec::clear_topology() {
+	// only the connection lists have been allocated from the arena at this point
+	arena.reset();
+	widgets = vector<UhdaWidget> {};
+	first_nid = 0;
+	dac_nids = vector<uint8_t> {};
+	adc_nids = vector<uint8_t> {};
+	output_nids = vector<uint8_t> {};
+	func_groups = vector<UhdaFuncGroup> {};
+}
+
+uint32_t UhdaCodec::build_jack_sense(uint64_t mask, Verb* verbs) const {
+	uint32_t count = 0;
+	for (size_t i = 0; i < jacks.size(); ++i) {
+		if (!(mask & 1ULL << i)) {
+			continue;
+		}
+
+		auto widget = jacks[i]->widget;
+		if (widget->trigger) {
+			verbs[count++] = Verb::make(widget->nid, cmd::SET_PIN_SENSE, 0);
+		}
+		verbs[count++] = Verb::make(widget->nid, cmd::GET_PIN_SENSE, 0);
+	}
+	return count;
+}
+
+uint64_t UhdaCodec::parse_jack_sense(uint64_t mask, const Verb* verbs) const {
+	uint64_t present = 0;
+	uint32_t index = 0;
+	for (size_t i = 0; i < jacks.size(); ++i) {
+		if (!(mask & 1ULL << i)) {
+			continue;
+		}
+
+		if (jacks[i]->widget->trigger) {
+			++index;
+		}
+		if (verbs[index++].res & 1U << 31) {
+			present |= 1ULL << i;
+		}
+	}
+	return present;
+}
+
+bool UhdaCodec::get_presence(const UhdaOutput* output) const {
+	return __atomic_load_n(&presence_bits, __ATOMIC_RELAXED) >> (output->unsol_tag - 1) & 1;
+}
+
+void UhdaCodec::handle_unsol(uint32_t resp) {
+	uint8_t tag = resp >> 26;
+	if (!tag || tag > jacks.size()) {
+		uhda_kernel_log("warning: received an unsolicited response with an unknown tag");
+		return;
+	}
+
+	// the response doesn't reliably contain the presence so it has to be read from the pin
+	queue_jack_sense(1ULL << (tag - 1));
+}
+
+void UhdaCodec::queue_jack_sense(uint64_t mask) {
+	jack_sense_pending |= mask;
+	if (!jack_sense_active) {
+		start_jack_sense();
+	}
+}
+
+void UhdaCodec::start_jack_sense() {
+	jack_sense_active = jack_sense_pending;
+	jack_sense_pending = 0;
+
+	jack_batch = {};
+	jack_batch.verbs = jack_verbs.data();
+	jack_batch.count = build_jack_sense(jack_sense_active, jack_verbs.data());
+	jack_batch.fn = jack_sense_done;
+	jack_batch.arg = this;
+	jack_batch.cid = cid;
+	controller->queue_batch(jack_batch);
+}
+
+void UhdaCodec::jack_sense_done(void* arg, UhdaStatus status) {
+	auto* codec = static_cast<UhdaCodec*>(arg);
+
+	uint64_t changed = 0;
+	{
+		LockGuard guard {codec->controller->lock};
+
+		auto mask = codec->jack_sense_active;
+		codec->jack_sense_active = 0;
+
+		// on failure the jacks are sensed again on the next presence change
+		if (status == UHDA_STATUS_SUCCESS) {
+			auto present = codec->parse_jack_sense(mask, codec->jack_verbs.data());
+			auto old_bits = codec->presence_bits;
+			auto new_bits = (old_bits & ~mask) | present;
+			__atomic_store_n(&codec->presence_bits, new_bits, __ATOMIC_RELAXED);
+			changed = old_bits ^ new_bits;
+
+			if (codec->jack_sense_pending) {
+				codec->start_jack_sense();
+				codec->controller->write_verbs();
+			}
+		}
+	}
+
+	codec->notify_presence(changed);
+}
+
+void UhdaCodec::notify_presence(uint64_t changed) const {
+	for (size_t i = 0; i < jacks.size(); ++i) {
+		if (!(changed & 1ULL << i)) {
+			continue;
+		}
+
+		auto output = jacks[i];
+
+		UhdaPresenceFn fn;
+		void* arg;
+		{
+			LockGuard guard {controller->lock};
+			fn = output->presence_fn;
+			arg = output->presence_arg;
+		}
+
+		if (fn) {
+			fn(arg, output, get_presence(output));
+		}
+	}
+}
+
+// returns the bits of a verb that identify the state it writes or 0 if it doesn't write restorable state
+static uint32_t get_shadow_key(uint32_t value) {
+	uint32_t payload = value & 0xFFFFF;
+
+	switch (payload >> 16) {
+		case cmd::SET_CONVERTER_FORMAT:
+			return value & 0xFFF0000;
+		case cmd::SET_AMP_GAIN_MUTE:
+			// the amp, the channels and the input index select the state
+			return value & 0xFFFFF00;
+		default:
+			break;
+	}
+
+	switch (payload >> 8) {
+		case cmd::SET_CONN_SELECT:
+		case cmd::SET_POWER_STATE:
+		case cmd::SET_CONVERTER_CONTROL:
+		case cmd::SET_PIN_CONTROL:
+		case cmd::SET_UNSOL_ENABLE:
+		case cmd::SET_EAPD_ENABLE:
+		case cmd::SET_DIGI_CONVERTER_1:
+		case cmd::SET_CONVERTER_CHANNEL_COUNT:
+			return value & 0xFFFFF00;
+		default:
+			return 0;
+	}
+}
+
+// checks whether a write recorded later with a different key changes some of the state of the older one,
+// which is only possible for amp writes that select a different set of amps or channels.
+static bool shadow_overlaps(uint32_t older, uint32_t newer) {
+	if (older >> 16 != newer >> 16 || (older & 0xFFFFF) >> 16 != cmd::SET_AMP_GAIN_MUTE) {
+		return false;
+	}
+
+	uint32_t older_amps = older >> 12 & 0xF;
+	uint32_t newer_amps = newer >> 12 & 0xF;
+	// the direction and channel bits both have to intersect for the same amp index
+	return (older_amps & newer_amps & 0b1100) && (older_amps & newer_amps & 0b11) &&
+		(older >> 8 & 0xF) == (newer >> 8 & 0xF);
+}
 
-	auto index = controller->submit_verb(cid, nid, cmd::GET_PIN_SENSE, 0);
-	ResponseDescriptor resp {};
-	auto status = controller->wait_for_verb(index, resp);
-	res = resp.resp;
+bool UhdaCodec::is_redundant(uint32_t value) const {
+	auto key = get_shadow_key(value);
+	if (!key) {
+		return false;
+	}
+
+	for (size_t i = verb_shadow.size(); i > 0; --i) {
+		auto recorded = verb_shadow[i - 1].value;
+		if (get_shadow_key(recorded) == key) {
+			return recorded == value;
+		}
+		if (shadow_overlaps(value, recorded)) {
+			return false;
+		}
+	}
+
+	return false;
+}
+
+UhdaStatus UhdaCodec::record_verbs(const Verb* verbs, uint32_t count) const {
+	for (uint32_t i = 0; i < count; ++i) {
+		auto key = get_shadow_key(verbs[i].value);
+		if (!key) {
+			continue;
+		}
+
+		// the newest write goes to the end so that replaying the shadow in order gives the same state
+		for (size_t j = 0; j < verb_shadow.size(); ++j) {
+			if (get_shadow_key(verb_shadow[j].value) == key) {
+				for (; j + 1 < verb_shadow.size(); ++j) {
+					verb_shadow[j] = verb_shadow[j + 1];
+				}
+				verb_shadow.pop();
+				break;
+			}
+		}
+
+		if (!verb_shadow.push({verbs[i].value, 0})) {
+			return UHDA_STATUS_NO_MEMORY;
+		}
+	}
+
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus UhdaCodec::run_verbs(Verb* verbs, uint32_t count) const {
+	// writes of state that the codec already has are dropped
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (!is_redundant(verbs[i].value)) {
+			verbs[kept++] = verbs[i];
+		}
+	}
+	count = kept;
+	if (!count) {
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	VerbBatch batch {};
+	batch.verbs = verbs;
+	batch.count = count;
+	batch.cid = cid;
+	auto status = controller->run_batch(batch);
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	return record_verbs(verbs, count);
+}
+
+UhdaStatus UhdaCodec::run_verb(Verb verb, uint32_t& res) const {
+	auto status = run_verbs(&verb, 1);
+	res = verb.res;
 	return status;
 }
 
-UhdaStatus UhdaCodec::set_selected_connection(uint8_t nid, uint8_t index) const {
-	LockGuard guard {controller->lock};
+UhdaStatus UhdaCodec::run_verb(Verb verb) const {
+	return run_verbs(&verb, 1);
+}
 
-	auto submit_index = controller->submit_verb(cid, nid, cmd::SET_CONN_SELECT, index);
-	ResponseDescriptor resp {};
-	return controller->wait_for_verb(submit_index, resp);
+UhdaStatus UhdaCodec::get_parameter(uint8_t nid, uint8_t param, uint32_t& res) const {
+	return run_verb(Verb::make(nid, cmd::GET_PARAM, param), res);
 }
 
-UhdaStatus UhdaCodec::set_amp_gain_mute(uint8_t nid, uint16_t data) const {
-	LockGuard guard {controller->lock};
+UhdaStatus UhdaCodec::get_connection_list(uint8_t nid, uint8_t offset_index, uint32_t& res) const {
+	return run_verb(Verb::make(nid, cmd::GET_CONN_LIST, offset_index), res);
+}
 
-	auto index = controller->submit_verb_long(cid, nid, cmd::SET_AMP_GAIN_MUTE, data);
-	ResponseDescriptor resp {};
-	return controller->wait_for_verb(index, resp);
+UhdaStatus UhdaCodec::get_config_default(uint8_t nid, uint32_t& res) const {
+	return run_verb(Verb::make(nid, cmd::GET_CONFIG_DEFAULT, 0), res);
 }
 
-UhdaStatus UhdaCodec::set_converter_format(uint8_t nid, uint16_t format) const {
-	LockGuard guard {controller->lock};
+UhdaStatus UhdaCodec::get_converter_formats(uint8_t nid, uint32_t& size_rate, uint32_t& formats) {
+	Verb verbs[2] {
+		Verb::make(nid, cmd::GET_PARAM, param::PCM_SIZE_RATE),
+		Verb::make(nid, cmd::GET_PARAM, param::STREAM_FORMATS)
+	};
+	auto status = run_verbs(verbs, 2);
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	// converters without the format override bit leave these at zero and use the defaults of their function group
+	auto group = get_func_group(nid);
+	if ((!verbs[0].res || !verbs[1].res) && group) {
+		Verb group_verbs[2] {
+			Verb::make(group->nid, cmd::GET_PARAM, param::PCM_SIZE_RATE),
+			Verb::make(group->nid, cmd::GET_PARAM, param::STREAM_FORMATS)
+		};
+		status = run_verbs(group_verbs, 2);
+		if (status != UHDA_STATUS_SUCCESS) {
+			return status;
+		}
+
+		if (!verbs[0].res) {
+			verbs[0].res = group_verbs[0].res;
+		}
+		if (!verbs[1].res) {
+			verbs[1].res = group_verbs[1].res;
+		}
+	}
 
-	auto index = controller->submit_verb_long(cid, nid, cmd::SET_CONVERTER_FORMAT, format);
-	ResponseDescriptor resp {};
-	return controller->wait_for_verb(index, resp);
+	size_rate = verbs[0].res;
+	formats = verbs[1].res;
+	return UHDA_STATUS_SUCCESS;
 }
 
-UhdaStatus UhdaCodec::set_converter_control(uint8_t nid, uint8_t stream, uint8_t channel) const {
-	LockGuard guard {controller->lock};
+UhdaStatus UhdaCodec::get_pin_sense(uint8_t nid, uint32_t& res) const {
+	return run_verb(Verb::make(nid, cmd::GET_PIN_SENSE, 0), res);
+}
 
-	auto index = controller->submit_verb(cid, nid, cmd::SET_CONVERTER_CONTROL, channel | stream << 4);
-	ResponseDescriptor resp {};
-	return controller->wait_for_verb(index, resp);
+UhdaStatus UhdaCodec::set_selected_connection(uint8_t nid, uint8_t index) const {
+	return run_verb(Verb::make(nid, cmd::SET_CONN_SELECT, index));
 }
 
-UhdaStatus UhdaCodec::set_pin_control(uint8_t nid, uint8_t data) const {
-	LockGuard guard {controller->lock};
+UhdaStatus UhdaCodec::set_amp_gain_mute(uint8_t nid, uint16_t data) const {
+	return run_verb(Verb::make_long(nid, cmd::SET_AMP_GAIN_MUTE, data));
+}
 
-	auto index = controller->submit_verb(cid, nid, cmd::SET_PIN_CONTROL, data);
-	ResponseDescriptor resp {};
-	return controller->wait_for_verb(index, resp);
+UhdaStatus UhdaCodec::set_converter_format(uint8_t nid, uint16_t format) const {
+	return run_verb(Verb::make_long(nid, cmd::SET_CONVERTER_FORMAT, format));
 }
 
-UhdaStatus UhdaCodec::set_pin_sense(uint8_t nid, uint8_t data) const {
-	LockGuard guard {controller->lock};
+UhdaStatus UhdaCodec::set_converter_control(uint8_t nid, uint8_t stream, uint8_t channel) const {
+	return run_verb(Verb::make(nid, cmd::SET_CONVERTER_CONTROL, channel | stream << 4));
+}
 
-	auto index = controller->submit_verb(cid, nid, cmd::SET_PIN_SENSE, data);
-	ResponseDescriptor resp {};
-	return controller->wait_for_verb(index, resp);
+UhdaStatus UhdaCodec::set_pin_control(uint8_t nid, uint8_t data) const {
+	return run_verb(Verb::make(nid, cmd::SET_PIN_CONTROL, data));
 }
 
-UhdaStatus UhdaCodec::set_eapd_enable(uint8_t nid, uint8_t data) const {
-	LockGuard guard {controller->lock};
+UhdaStatus UhdaCodec::set_pin_sense(uint8_t nid, uint8_t data) const {
+	return run_verb(Verb::make(nid, cmd::SET_PIN_SENSE, data));
+}
 
-	auto index = controller->submit_verb(cid, nid, cmd::SET_EAPD_ENABLE, data);
-	ResponseDescriptor resp {};
-	return controller->wait_for_verb(index, resp);
+UhdaStatus UhdaCodec::set_eapd_enable(uint8_t nid, uint8_t data) const {
+	return run_verb(Verb::make(nid, cmd::SET_EAPD_ENABLE, data));
 }
 
 UhdaStatus UhdaCodec::set_converter_channel_count(uint8_t nid, uint8_t count) const {
-	LockGuard guard {controller->lock};
-
-	auto index = controller->submit_verb(cid, nid, cmd::SET_CONVERTER_CHANNEL_COUNT, count);
-	ResponseDescriptor resp {};
-	return controller->wait_for_verb(index, resp);
+	return run_verb(Verb::make(nid, cmd::SET_CONVERTER_CHANNEL_COUNT, count));
 }
 
 UhdaStatus UhdaCodec::set_power_state(uint8_t nid, uint8_t data) const {
-	LockGuard guard {controller->lock};
-
-	auto index = controller->submit_verb(cid, nid, cmd::SET_POWER_STATE, data);
-	ResponseDescriptor resp {};
-	return controller->wait_for_verb(index, resp);
+	return run_verb(Verb::make(nid, cmd::SET_POWER_STATE, data));
 }
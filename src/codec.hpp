@@ -3,53 +3,174 @@
 #include "uhda/types.h"
 #include "widget.hpp"
 #include "vector.hpp"
+#include "verb.hpp"
 
 struct UhdaController;
 
 struct UhdaCodec;
 
 struct UhdaPath {
+	[[nodiscard]] UhdaWidget* widget(size_t index) const;
+	[[nodiscard]] UhdaWidget* first() const {
+		return widget(0);
+	}
+	[[nodiscard]] UhdaWidget* last() const {
+		return widget(length - 1);
+	}
+
 	UhdaCodec* codec;
-	uhda::vector<UhdaWidget*> widgets;
+	// allocated from the arena of the codec
+	const uint8_t* nids;
+	uint8_t length;
 	uint8_t gain;
+	// set between `uhda_path_setup` and `uhda_path_shutdown`, the path holds a power reference meanwhile
+	bool active {};
+	// filled in by `PathIndex::build`, every widget except the last one and every widget except the pin
+	uhda::WidgetSet pin_side {};
+	uhda::WidgetSet converter_side {};
 };
 
+namespace uhda {
+	// pairwise compatibility of all the output or input paths of a codec,
+	// bit `j` of row `i` is set if paths `i` and `j` are usable at the same time.
+	struct PathIndex {
+		UhdaStatus build(vector<UhdaPath>& paths);
+
+		// returns the index of the path or SIZE_MAX if it isn't one of the indexed paths
+		[[nodiscard]] size_t index_of(const vector<UhdaPath>& paths, const UhdaPath* path) const {
+			if (path < paths.data() || path >= paths.data() + paths.size()) {
+				return SIZE_MAX;
+			}
+			return path - paths.data();
+		}
+
+		[[nodiscard]] const uint64_t* row(size_t path, bool same_stream) const {
+			return (same_stream ? shared_rows : separate_rows).data() + path * words;
+		}
+
+		// the uncached check, only valid for paths of the same codec
+		static bool compatible(const UhdaPath& a, const UhdaPath& b, bool same_stream);
+
+		vector<uint64_t> separate_rows;
+		vector<uint64_t> shared_rows;
+		size_t words {};
+	};
+}
+
 struct UhdaOutput {
 	UhdaWidget* widget;
 	uint8_t sequence;
+	// 1-based index into the jacks of the codec, 0 if presence changes aren't reported by the codec
+	uint8_t unsol_tag {};
+	// protected by the controller lock
+	UhdaPresenceFn presence_fn {};
+	void* presence_arg {};
 };
 
 struct UhdaOutputGroup {
 	explicit UhdaOutputGroup(uint8_t assoc) : assoc {assoc} {}
 
-	~UhdaOutputGroup() {
-		for (auto output : outputs) {
-			output->~UhdaOutput();
-			uhda_kernel_free(output, sizeof(UhdaOutput));
-		}
-	}
-
 	uhda::vector<UhdaOutput*> outputs;
 	uint8_t assoc;
 };
 
+struct UhdaInput {
+	UhdaWidget* widget;
+};
+
+struct UhdaFuncGroup {
+	uint8_t nid;
+	uint8_t start_nid;
+	uint8_t widget_count;
+	// number of set up paths in the group
+	uint8_t power_refs {};
+};
+
 struct UhdaCodec {
 	UhdaCodec(UhdaController* controller, uint8_t cid) : controller {controller}, cid {cid} {}
 
+	// the outputs and inputs are freed with the arena
 	~UhdaCodec() {
 		for (auto group : output_groups) {
 			group->~UhdaOutputGroup();
-			uhda_kernel_free(group, sizeof(UhdaOutputGroup));
 		}
 	}
 
-	UhdaStatus init();
+	// enumeration is split into steps so that the verbs of multiple codecs can be in flight
+	// at the same time, `batch` is set to the next batch to run or null once finished.
+	UhdaStatus enumerate(uhda::VerbBatch*& batch);
+	UhdaStatus finish_init();
+	// sizes the widget table for all function groups at once instead of growing it for each widget
+	[[nodiscard]] bool reserve_widgets();
+	UhdaStatus add_widget(
+		uint8_t nid,
+		uint8_t type,
+		uint8_t raw_connection_count,
+		uint32_t in_amp_caps,
+		uint32_t out_amp_caps,
+		uint32_t pin_caps,
+		uint32_t default_config,
+		bool unsol_capable,
+		bool digital);
+	// replaces the raw connection lists of the widgets with ones that have the ranges expanded,
+	// all of them are stored in one buffer.
+	UhdaStatus expand_connections();
+
+	[[nodiscard]] UhdaFuncGroup* get_func_group(uint8_t nid);
+	// pins with presence detection are never powered down so that jack sensing keeps working,
+	// function groups are only powered down if the codec doesn't report presence changes.
+	[[nodiscard]] bool can_power_down(const UhdaWidget& widget) const;
+	[[nodiscard]] bool can_power_down(const UhdaFuncGroup& group) const;
+	// takes a power reference for the widgets of the path and powers its function group up if needed
+	UhdaStatus power_up_path(UhdaPath& path);
+	// drops the power references of the path, `verbs` gets the verbs that power down
+	// the widgets that became unused (at most 2 per widget and 1 for the group), returns their count.
+	uint32_t power_down_path(UhdaPath& path, uhda::Verb* verbs);
+	// powers down every widget and function group that isn't used by a set up path
+	uint32_t build_idle_power(uhda::Verb* verbs);
+
+	[[nodiscard]] UhdaWidget* get_widget(uint8_t nid) {
+		size_t index = nid - first_nid;
+		if (nid < first_nid || index >= widgets.size() || !widgets[index].codec) {
+			return nullptr;
+		}
+		return &widgets[index];
+	}
 	UhdaStatus find_output_paths();
+	UhdaStatus find_jacks();
+	UhdaStatus find_inputs();
+	UhdaStatus find_input_paths();
+
+	[[nodiscard]] size_t get_topology_size() const;
+	void write_topology(uint8_t* ptr) const;
+	UhdaStatus load_topology(const uint8_t* ptr, size_t size);
+	void clear_topology();
+
+	// records the state written by the verbs so that it can be restored after a reset
+	[[nodiscard]] UhdaStatus record_verbs(const uhda::Verb* verbs, uint32_t count) const;
+	uint32_t build_jack_sense(uint64_t mask, uhda::Verb* verbs) const;
+	uint64_t parse_jack_sense(uint64_t mask, const uhda::Verb* verbs) const;
+	[[nodiscard]] bool get_presence(const UhdaOutput* output) const;
+	// these must be called with the controller lock held
+	void handle_unsol(uint32_t resp);
+	void queue_jack_sense(uint64_t mask);
+	void start_jack_sense();
+	static void jack_sense_done(void* arg, UhdaStatus status);
+	void notify_presence(uint64_t changed) const;
+
+	// writes of state recorded in the verb shadow with the same value are dropped
+	// and the remaining verbs are moved to the front of `verbs`.
+	UhdaStatus run_verbs(uhda::Verb* verbs, uint32_t count) const;
+	[[nodiscard]] bool is_redundant(uint32_t value) const;
+	UhdaStatus run_verb(uhda::Verb verb, uint32_t& res) const;
+	UhdaStatus run_verb(uhda::Verb verb) const;
 
 	UhdaStatus get_parameter(uint8_t nid, uint8_t param, uint32_t& res) const;
 	UhdaStatus get_connection_list(uint8_t nid, uint8_t offset_index, uint32_t& res) const;
 	UhdaStatus get_pin_sense(uint8_t nid, uint32_t& res) const;
 	UhdaStatus get_config_default(uint8_t nid, uint32_t& res) const;
+	// reads the pcm size/rate and stream formats parameters of a converter
+	UhdaStatus get_converter_formats(uint8_t nid, uint32_t& size_rate, uint32_t& formats);
 
 	[[nodiscard]] UhdaStatus set_selected_connection(uint8_t nid, uint8_t index) const;
 	[[nodiscard]] UhdaStatus set_amp_gain_mute(uint8_t nid, uint16_t data) const;
@@ -62,10 +183,58 @@ struct UhdaCodec {
 	[[nodiscard]] UhdaStatus set_power_state(uint8_t nid, uint8_t data) const;
 
 	UhdaController* controller;
+	// holds the connection lists, paths, output groups, outputs and inputs
+	uhda::Arena arena;
+	// indexed by nid - first_nid, widgets that don't exist have a null codec
 	uhda::vector<UhdaWidget> widgets;
+	uint8_t first_nid {};
 	uhda::vector<uint8_t> dac_nids;
 	uhda::vector<uint8_t> output_nids;
 	uhda::vector<UhdaPath> output_paths;
+	uhda::PathIndex output_path_index;
 	uhda::vector<UhdaOutputGroup*> output_groups;
+	uhda::vector<uint8_t> adc_nids;
+	// input paths start at the pin like output paths and end at the adc
+	uhda::vector<UhdaPath> input_paths;
+	uhda::PathIndex input_path_index;
+	uhda::vector<UhdaInput*> inputs;
+	uhda::vector<UhdaFuncGroup> func_groups;
+	// the last verb written for each piece of codec state, in the order they were written
+	mutable uhda::vector<uhda::Verb> verb_shadow;
+
+	// outputs whose presence changes are reported using unsolicited responses, the tag is the index + 1
+	uhda::vector<UhdaOutput*> jacks;
+	uhda::vector<uhda::Verb> jack_verbs;
+	uhda::VerbBatch jack_batch {};
+	uint64_t presence_bits {};
+	uint64_t jack_sense_pending {};
+	uint64_t jack_sense_active {};
+
+	enum class EnumStep : uint8_t {
+		Start,
+		Root,
+		FuncGroups,
+		Widgets,
+		Connections,
+		Restore,
+		Outputs,
+		Jacks,
+		Power,
+		Done
+	};
+
+	uhda::vector<uhda::Verb> enum_verbs;
+	uhda::VerbBatch enum_batch {};
+	// topology record of this codec passed by the user, only used during enumeration
+	const uint8_t* cached_topology {};
+	size_t cached_topology_size {};
+	uint32_t vendor_id {};
+	uint32_t revision_id {};
+	uint32_t root_node_count {};
+	EnumStep enum_step {};
 	uint8_t cid;
 };
+
+inline UhdaWidget* UhdaPath::widget(size_t index) const {
+	return &codec->widgets[nids[index] - codec->first_nid];
+}
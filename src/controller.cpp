@@ -1,5 +1,8 @@
 #include "controller.hpp"
 #include "uhda/kernel_api.h"
+#include "lock_guard.hpp"
+#include "topology.hpp"
+#include "trace.hpp"
 
 namespace {
 	UhdaStatus pci_read_cmd(void* pci_device, uint16_t& cmd) {
@@ -30,36 +33,29 @@ using namespace uhda;
 
 #define memset __builtin_memset
 
+// layout of the ring page, each part has to be 128-byte aligned.
+// the corb has up to 256 4-byte entries, the rirb up to 256 8-byte entries
+// and the dma position buffer has 8 bytes for each of the up to 30 streams.
+static constexpr size_t CORB_OFFSET = 0;
+static constexpr size_t RIRB_OFFSET = 0x400;
+static constexpr size_t DPL_OFFSET = 0xC00;
+// how long the fifos of synced output streams are waited on before releasing them anyway
+static constexpr int SYNC_FIFO_TIMEOUT_US = 1000;
+
 UhdaController::~UhdaController() {
 	uhda_kernel_pci_enable_irq(pci_device, irq, false);
 
-	for (auto codec : codecs) {
-		codec->~UhdaCodec();
-		uhda_kernel_free(codec, sizeof(UhdaCodec));
-	}
+	destroy_codecs();
 
 	if (space.base) {
 		uhda_kernel_pci_unmap_bar(pci_device, bar, reinterpret_cast<void*>(space.base));
 	}
 
-	if (corb) {
-		uhda_kernel_unmap(corb, 0x1000);
-	}
-	if (rirb) {
-		uhda_kernel_unmap(rirb, 0x1000);
-	}
-	if (dma_pos) {
-		uhda_kernel_unmap(dma_pos, 0x1000);
-	}
-
-	if (corb_phys) {
-		uhda_kernel_deallocate_physical(corb_phys, 0x1000);
-	}
-	if (rirb_phys) {
-		uhda_kernel_deallocate_physical(rirb_phys, 0x1000);
+	if (ring_page) {
+		uhda_kernel_unmap(ring_page, 0x1000);
 	}
-	if (dpl_phys) {
-		uhda_kernel_deallocate_physical(dpl_phys, 0x1000);
+	if (ring_page_phys) {
+		uhda_kernel_deallocate_physical(ring_page_phys, 0x1000);
 	}
 
 	for (auto& stream : in_streams) {
@@ -87,22 +83,41 @@ static bool hda_irq(void* arg) {
 		return false;
 	}
 
-	auto streams = intsts & intsts::SIS;
+	if (intsts & intsts::CIS) {
+		VerbBatchList completed {};
+		{
+			LockGuard guard {controller->lock};
 
-	uint32_t stream_count = controller->in_stream_count + controller->out_stream_count;
+			auto rirbsts = controller->space.load(regs::RIRBSTS);
+			controller->space.store(regs::RIRBSTS, rirbsts);
 
-	for (uint32_t i = 0; i < stream_count; ++i) {
-		if (streams & 1U << i) {
-			if (i >= controller->in_stream_count) {
-				controller->out_streams[i - controller->in_stream_count].output_irq();
-			}
+			controller->process_responses(completed);
 		}
+
+		UhdaController::run_completions(completed);
+	}
+
+	uint32_t in_streams = (intsts & intsts::SIS) & ((1U << controller->in_stream_count) - 1);
+	while (in_streams) {
+		auto i = __builtin_ctz(in_streams);
+		in_streams &= in_streams - 1;
+		controller->in_streams[i].input_irq();
+	}
+
+	// the output streams come after the input streams
+	uint32_t out_streams = (intsts & intsts::SIS) >> controller->in_stream_count;
+	out_streams &= (1U << controller->out_stream_count) - 1;
+
+	while (out_streams) {
+		auto i = __builtin_ctz(out_streams);
+		out_streams &= out_streams - 1;
+		controller->out_streams[i].output_irq();
 	}
 
 	return true;
 }
 
-UhdaStatus UhdaController::init() {
+UhdaStatus UhdaController::init(const void* topology, size_t topology_size) {
 	auto status = pci_setup();
 	if (status != UHDA_STATUS_SUCCESS) {
 		return status;
@@ -133,68 +148,28 @@ UhdaStatus UhdaController::init() {
 		return status;
 	}
 
-	status = uhda_kernel_allocate_physical(0x1000, &corb_phys);
-	if (status != UHDA_STATUS_SUCCESS) {
-		goto fail;
-	}
-
-	status = uhda_kernel_allocate_physical(0x1000, &rirb_phys);
-	if (status != UHDA_STATUS_SUCCESS) {
-		goto fail;
-	}
-
-	status = uhda_kernel_allocate_physical(0x1000, &dpl_phys);
+	status = uhda_kernel_allocate_physical(0x1000, &ring_page_phys);
 	if (status != UHDA_STATUS_SUCCESS) {
 		goto fail;
 	}
 
-	void* corb_ptr;
-	void* rirb_ptr;
-	void* dma_pos_ptr;
-
-	status = uhda_kernel_map(corb_phys, 0x1000, &corb_ptr);
+	status = uhda_kernel_map(ring_page_phys, 0x1000, &ring_page);
 	if (status != UHDA_STATUS_SUCCESS) {
 		goto fail;
 	}
 
-	corb = static_cast<VerbDescriptor*>(corb_ptr);
+	memset(ring_page, 0, 0x1000);
 
-	status = uhda_kernel_map(rirb_phys, 0x1000, &rirb_ptr);
-	if (status != UHDA_STATUS_SUCCESS) {
-		goto fail;
-	}
-
-	rirb = static_cast<ResponseDescriptor*>(rirb_ptr);
-
-	status = uhda_kernel_map(dpl_phys, 0x1000, &dma_pos_ptr);
-	if (status != UHDA_STATUS_SUCCESS) {
-		goto fail;
-	}
-
-	memset(dma_pos_ptr, 0, 0x1000);
-
-	dma_pos = static_cast<uint32_t*>(dma_pos_ptr);
+	corb = reinterpret_cast<VerbDescriptor*>(static_cast<uint8_t*>(ring_page) + CORB_OFFSET);
+	rirb = reinterpret_cast<ResponseDescriptor*>(static_cast<uint8_t*>(ring_page) + RIRB_OFFSET);
+	dma_pos = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(ring_page) + DPL_OFFSET);
 
 	status = uhda_kernel_create_spinlock(&lock);
 	if (status != UHDA_STATUS_SUCCESS) {
 		goto fail;
 	}
 
-	for (auto& stream : in_streams) {
-		status = uhda_kernel_create_spinlock(&stream.lock);
-		if (status != UHDA_STATUS_SUCCESS) {
-			goto fail;
-		}
-	}
-
-	for (auto& stream : out_streams) {
-		status = uhda_kernel_create_spinlock(&stream.lock);
-		if (status != UHDA_STATUS_SUCCESS) {
-			goto fail;
-		}
-	}
-
-	status = resume();
+	status = resume(topology, topology_size);
 	if (status != UHDA_STATUS_SUCCESS) {
 		goto fail;
 	}
@@ -215,6 +190,19 @@ UhdaStatus UhdaController::destroy() {
 UhdaStatus UhdaController::suspend() {
 	uhda_kernel_pci_enable_irq(pci_device, irq, false);
 
+	if (lock) {
+		VerbBatchList completed {};
+		{
+			LockGuard guard {lock};
+			for (uint8_t i = 0; i < 16; ++i) {
+				abort_verbs(i, UHDA_STATUS_TIMEOUT, completed);
+			}
+			verbs_in_flight = 0;
+		}
+
+		run_completions(completed);
+	}
+
 	auto gctl = space.load(regs::GCTL);
 	if (gctl & gctl::CRST) {
 		auto corbctl = space.load(regs::CORBCTL);
@@ -265,7 +253,204 @@ UhdaStatus UhdaController::suspend() {
 	return UHDA_STATUS_SUCCESS;
 }
 
-UhdaStatus UhdaController::resume() {
+UhdaStatus UhdaController::resume(const void* topology, size_t topology_size) {
+	uint16_t statests;
+	auto status = reset_link(statests);
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	for (uint32_t i = 0; i < in_stream_count; ++i) {
+		in_streams[i].resume(false);
+	}
+	for (uint32_t i = 0; i < out_stream_count; ++i) {
+		out_streams[i].resume(false);
+	}
+
+	status = enumerate_codecs(statests, topology, topology_size);
+	if (status == UHDA_STATUS_SUCCESS) {
+		link_suspended = false;
+	}
+	return status;
+}
+
+UhdaStatus UhdaController::resume_fast() {
+	uint16_t statests;
+	auto status = reset_link(statests);
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	Verb id_verbs[15][2];
+	VerbBatch batches[15];
+	VerbBatch* batch_ptrs[15];
+	size_t count = codecs.size();
+
+	// make sure that the same codecs are still there before restoring their state
+	for (size_t i = 0; i < count; ++i) {
+		auto codec = codecs[i];
+		if (!(statests & 1 << codec->cid)) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+
+		id_verbs[i][0] = Verb::make(0, cmd::GET_PARAM, param::VENDOR_ID);
+		id_verbs[i][1] = Verb::make(0, cmd::GET_PARAM, param::REVISION_ID);
+		batches[i] = {};
+		batches[i].verbs = id_verbs[i];
+		batches[i].count = 2;
+		batches[i].cid = codec->cid;
+		batch_ptrs[i] = &batches[i];
+	}
+
+	run_batches(batch_ptrs, count);
+
+	for (size_t i = 0; i < count; ++i) {
+		auto codec = codecs[i];
+		if (batches[i].status != UHDA_STATUS_SUCCESS) {
+			return batches[i].status;
+		}
+		if (id_verbs[i][0].res != codec->vendor_id || id_verbs[i][1].res != codec->revision_id) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+
+		// the shadow is only read by the controller, the responses written to it are ignored
+		batches[i] = {};
+		batches[i].verbs = codec->verb_shadow.data();
+		batches[i].count = codec->verb_shadow.size();
+		batches[i].cid = codec->cid;
+	}
+
+	run_batches(batch_ptrs, count);
+
+	for (size_t i = 0; i < count; ++i) {
+		if (batches[i].status != UHDA_STATUS_SUCCESS) {
+			return batches[i].status;
+		}
+	}
+
+	// the jacks may have changed while suspended, this reports the changes asynchronously
+	{
+		LockGuard guard {lock};
+		for (auto codec : codecs) {
+			if (!codec->jacks.is_empty()) {
+				codec->queue_jack_sense(~0ULL);
+			}
+		}
+		write_verbs();
+	}
+
+	for (uint32_t i = 0; i < in_stream_count; ++i) {
+		in_streams[i].resume(true);
+	}
+	for (uint32_t i = 0; i < out_stream_count; ++i) {
+		out_streams[i].resume(true);
+	}
+
+	link_suspended = false;
+	return UHDA_STATUS_SUCCESS;
+}
+
+bool UhdaController::is_idle() {
+	for (uint32_t i = 0; i < in_stream_count + out_stream_count; ++i) {
+		auto& stream = i < in_stream_count ? in_streams[i] : out_streams[i - in_stream_count];
+		LockGuard guard {stream.lock};
+		if (stream.running) {
+			return false;
+		}
+	}
+
+	LockGuard guard {lock};
+	return !active_paths && !write_pending && !verbs_in_flight;
+}
+
+bool UhdaController::autosuspend_poll(uint64_t now_ms) {
+	if (link_suspended) {
+		return true;
+	}
+	if (!autosuspend_delay_ms || !is_idle()) {
+		idle = false;
+		return false;
+	}
+
+	if (!idle) {
+		idle = true;
+		idle_since_ms = now_ms;
+		return false;
+	}
+	if (now_ms - idle_since_ms < autosuspend_delay_ms) {
+		return false;
+	}
+
+	// the codec state is in the verb shadows, so a failed suspend is recovered the same way on wake
+	suspend();
+	link_suspended = true;
+	idle = false;
+	return true;
+}
+
+UhdaStatus UhdaController::wake() {
+	if (!link_suspended) {
+		return UHDA_STATUS_SUCCESS;
+	}
+	return resume_fast();
+}
+
+UhdaStatus UhdaController::play_synced(UhdaStream* const* streams, size_t count, bool play) {
+	uint32_t mask = 0;
+	for (size_t i = 0; i < count; ++i) {
+		auto* stream = streams[i];
+		if (stream->controller != this) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+		// the ssync bits follow the order of the stream descriptors, inputs first
+		mask |= 1U << (stream->output ? in_stream_count + stream->index : stream->index);
+	}
+
+	if (play) {
+		auto status = wake();
+		if (status != UHDA_STATUS_SUCCESS) {
+			return status;
+		}
+	}
+
+	{
+		LockGuard guard {lock};
+		space.store(regs::SSYNC, space.load(regs::SSYNC) | mask);
+	}
+
+	// the streams are prefilled and their run bits are changed while the dma engines are held,
+	// so the time it takes doesn't show up as an offset between them.
+	for (size_t i = 0; i < count; ++i) {
+		streams[i]->play(play);
+	}
+
+	if (play) {
+		// output streams should have their fifos filled before being released
+		for (int i = 0; i < SYNC_FIFO_TIMEOUT_US / 10; ++i) {
+			bool ready = true;
+			for (size_t j = 0; j < count; ++j) {
+				auto* stream = streams[j];
+				if (stream->output &&
+					(stream->space.load(regs::stream::CTL0) & sdctl0::RUN) &&
+					!(stream->space.load(regs::stream::STS) & sdsts::FIFORDY)) {
+					ready = false;
+					break;
+				}
+			}
+
+			if (ready) {
+				break;
+			}
+			uhda_kernel_delay(10);
+		}
+	}
+
+	LockGuard guard {lock};
+	space.store(regs::SSYNC, space.load(regs::SSYNC) & ~mask);
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus UhdaController::reset_link(uint16_t& statests) {
 	auto status = pci_setup();
 	if (status != UHDA_STATUS_SUCCESS) {
 		return status;
@@ -294,6 +479,11 @@ UhdaStatus UhdaController::resume() {
 		uhda_kernel_delay(200);
 	}
 
+	// unsolicited responses are used for jack presence detection
+	gctl = space.load(regs::GCTL);
+	gctl |= gctl::UNSOL(true);
+	space.store(regs::GCTL, gctl);
+
 	auto gcap = space.load(regs::GCAP);
 	if (!(gcap & gcap::OK64)) {
 		uhda_kernel_pci_enable_irq(pci_device, irq, false);
@@ -345,16 +535,26 @@ UhdaStatus UhdaController::resume() {
 		space.store(regs::RIRBSIZE, rirb_size_reg);
 	}
 
+	uintptr_t corb_phys = ring_page_phys + CORB_OFFSET;
+	uintptr_t rirb_phys = ring_page_phys + RIRB_OFFSET;
+	uintptr_t dpl_phys = ring_page_phys + DPL_OFFSET;
+
 	space.store(regs::CORBLBASE, corb_phys);
 	space.store(regs::CORBUBASE, corb_phys >> 32);
 	space.store(regs::RIRBLBASE, rirb_phys);
 	space.store(regs::RIRBUBASE, rirb_phys >> 32);
 
+	// the write pointers are cleared by the controller reset
+	corb_wp = 0;
+	space.store(regs::RIRBWP, rirbwp::RST(true));
+	rirb_rp = 0;
+
 	auto corbctl = space.load(regs::CORBCTL);
 	corbctl |= corbctl::RUN(true);
 	space.store(regs::CORBCTL, corbctl);
 	auto rirbctl = space.load(regs::RIRBCTL);
 	rirbctl |= rirbctl::DMAEN(true);
+	rirbctl |= rirbctl::INTCTL(true);
 	space.store(regs::RIRBCTL, rirbctl);
 
 	auto rintcnt = space.load(regs::RINTCNT);
@@ -367,8 +567,23 @@ UhdaStatus UhdaController::resume() {
 	in_stream_count = gcap & gcap::ISS;
 	out_stream_count = gcap & gcap::OSS;
 
+	// only the streams that the controller has get a lock, they are kept until the controller is destroyed
+	for (uint32_t i = 0; i < in_stream_count + out_stream_count; ++i) {
+		auto& stream = i < in_stream_count ? in_streams[i] : out_streams[i - in_stream_count];
+		if (stream.lock) {
+			continue;
+		}
+		status = uhda_kernel_create_spinlock(&stream.lock);
+		if (status != UHDA_STATUS_SUCCESS) {
+			uhda_kernel_pci_enable_irq(pci_device, irq, false);
+			return status;
+		}
+	}
+
 	for (uint32_t i = 0; i < in_stream_count; ++i) {
 		in_streams[i].space = space.subspace(0x80 + i * 0x20);
+		in_streams[i].controller_space = space;
+		in_streams[i].controller = this;
 		in_streams[i].dma_pos = &dma_pos[i * 2];
 		in_streams[i].index = i;
 		in_stream_ptrs[i] = &in_streams[i];
@@ -376,107 +591,463 @@ UhdaStatus UhdaController::resume() {
 
 	for (uint32_t i = 0; i < out_stream_count; ++i) {
 		out_streams[i].space = space.subspace(0x80 + in_stream_count * 0x20 + i * 0x20);
+		out_streams[i].controller_space = space;
+		out_streams[i].controller = this;
 		out_streams[i].dma_pos = &dma_pos[in_stream_count * 2 + i * 2];
 		out_streams[i].index = i;
 		out_streams[i].output = true;
 		out_stream_ptrs[i] = &out_streams[i];
 	}
 
-	// wait for codec initialization
-	uhda_kernel_delay(1000);
+	// the codecs have 521us (25 frames) after the reset to request a state change
+	uhda_kernel_delay(521);
 
 	auto intctl = space.load(regs::INTCTL);
 	intctl |= intctl::GIE(true);
+	intctl |= intctl::CIE(true);
 	intctl |= intctl::SIE((1 << (in_stream_count + out_stream_count)) - 1);
 	space.store(regs::INTCTL, intctl);
 
-	auto statests = space.load(regs::STATESTS);
+	statests = space.load(regs::STATESTS);
+	return UHDA_STATUS_SUCCESS;
+}
+
+// finds the topology record of a codec, returns null if there isn't one or the record is truncated
+static const uint8_t* find_codec_topology(const void* topology, size_t size, uint8_t cid, size_t& record_size) {
+	auto* ptr = static_cast<const uint8_t*>(topology);
+	if (!ptr) {
+		return nullptr;
+	}
+
+	uint16_t codec_count = topology::load16(ptr + 6);
+	size_t offset = topology::HEADER_SIZE;
+	for (uint32_t i = 0; i < codec_count; ++i) {
+		if (size - offset < topology::CODEC_RECORD_SIZE) {
+			return nullptr;
+		}
+
+		uint32_t codec_size = topology::load32(ptr + offset);
+		if (codec_size < topology::CODEC_RECORD_SIZE || size - offset < codec_size) {
+			return nullptr;
+		}
+
+		if (ptr[offset + 16] == cid) {
+			record_size = codec_size;
+			return ptr + offset;
+		}
+
+		offset += codec_size;
+	}
+
+	return nullptr;
+}
+
+UhdaStatus UhdaController::enumerate_codecs(uint16_t statests, const void* topology, size_t topology_size) {
+	// the codecs are recreated from scratch
+	destroy_codecs();
+
+	if (topology && (topology_size < topology::HEADER_SIZE ||
+		topology::load32(static_cast<const uint8_t*>(topology)) != topology::MAGIC ||
+		topology::load16(static_cast<const uint8_t*>(topology) + 4) != topology::VERSION)) {
+		uhda_kernel_log("warning: invalid codec topology, enumerating the codecs");
+		topology = nullptr;
+	}
+
+	UhdaCodec* pending[15];
+	VerbBatch* batches[15];
+	size_t pending_count = 0;
+
+	UhdaStatus status = UHDA_STATUS_SUCCESS;
+
 	for (uint32_t i = 0; i < 15; ++i) {
-		if (statests & 1 << i) {
-			auto* ptr = uhda_kernel_malloc(sizeof(UhdaCodec));
-			if (!ptr) {
-				return UHDA_STATUS_NO_MEMORY;
-			}
+		if (!(statests & 1 << i)) {
+			continue;
+		}
 
-			auto* codec = construct<UhdaCodec>(ptr, this, static_cast<uint8_t>(i));
-			status = codec->init();
-			if (status == UHDA_STATUS_TIMEOUT) {
-				codec->~UhdaCodec();
-				uhda_kernel_free(ptr, sizeof(UhdaCodec));
+		auto* ptr = uhda_kernel_malloc(sizeof(UhdaCodec));
+		if (!ptr) {
+			status = UHDA_STATUS_NO_MEMORY;
+			break;
+		}
+
+		auto* codec = construct<UhdaCodec>(ptr, this, static_cast<uint8_t>(i));
+		codec->cached_topology = find_codec_topology(
+			topology,
+			topology_size,
+			codec->cid,
+			codec->cached_topology_size);
+		pending[pending_count++] = codec;
+	}
+
+	// the enumeration steps of all codecs are run together so that their verbs are in flight at the same time
+	while (status == UHDA_STATUS_SUCCESS && pending_count) {
+		size_t batch_count = 0;
+
+		for (size_t i = 0; i < pending_count;) {
+			auto* codec = pending[i];
+
+			VerbBatch* batch;
+			auto codec_status = codec->enumerate(batch);
+			if (codec_status == UHDA_STATUS_SUCCESS && batch) {
+				batches[batch_count++] = batch;
+				++i;
 				continue;
 			}
-			else if (status != UHDA_STATUS_SUCCESS) {
-				codec->~UhdaCodec();
-				uhda_kernel_free(ptr, sizeof(UhdaCodec));
-				return status;
-			}
 
-			if (!codecs.push(codec)) {
-				return UHDA_STATUS_NO_MEMORY;
+			pending[i] = pending[--pending_count];
+
+			if (codec_status == UHDA_STATUS_SUCCESS) {
+				bool pushed;
+				{
+					// the irq looks up codecs for unsolicited responses
+					LockGuard guard {lock};
+					pushed = codecs.push(codec);
+				}
+
+				if (!pushed) {
+					status = UHDA_STATUS_NO_MEMORY;
+				}
+				else {
+					continue;
+				}
 			}
+			else if (codec_status != UHDA_STATUS_TIMEOUT) {
+				status = codec_status;
+			}
+
+			codec->~UhdaCodec();
+			uhda_kernel_free(codec, sizeof(UhdaCodec));
 		}
+
+		if (status == UHDA_STATUS_SUCCESS) {
+			run_batches(batches, batch_count);
+		}
+	}
+
+	for (size_t i = 0; i < pending_count; ++i) {
+		pending[i]->~UhdaCodec();
+		uhda_kernel_free(pending[i], sizeof(UhdaCodec));
 	}
 
+	return status;
+}
+
+void UhdaController::destroy_codecs() {
+	vector<UhdaCodec*> old_codecs;
+	if (lock) {
+		LockGuard guard {lock};
+		old_codecs = move(codecs);
+		active_paths = 0;
+	}
+	else {
+		old_codecs = move(codecs);
+	}
+
+	// the streams outlive the codecs across a full resume, their converters are bound again by the next path setup
+	for (uint32_t i = 0; i < in_stream_count + out_stream_count; ++i) {
+		auto& stream = i < in_stream_count ? in_streams[i] : out_streams[i - in_stream_count];
+		if (stream.lock) {
+			LockGuard guard {stream.lock};
+			stream.bound_converter_count = 0;
+		}
+	}
+
+	for (auto codec : old_codecs) {
+		codec->~UhdaCodec();
+		uhda_kernel_free(codec, sizeof(UhdaCodec));
+	}
+}
+
+UhdaStatus UhdaController::get_topology(void* buffer, size_t* size) const {
+	size_t total_size = topology::HEADER_SIZE;
+	for (auto codec : codecs) {
+		total_size += codec->get_topology_size();
+	}
+
+	if (!buffer || *size < total_size) {
+		*size = total_size;
+		return UHDA_STATUS_NO_MEMORY;
+	}
+
+	auto* ptr = static_cast<uint8_t*>(buffer);
+	topology::store32(ptr, topology::MAGIC);
+	topology::store16(ptr + 4, topology::VERSION);
+	topology::store16(ptr + 6, codecs.size());
+	ptr += topology::HEADER_SIZE;
+
+	for (auto codec : codecs) {
+		codec->write_topology(ptr);
+		ptr += codec->get_topology_size();
+	}
+
+	*size = total_size;
 	return UHDA_STATUS_SUCCESS;
 }
 
-uint8_t UhdaController::submit_verb(uint8_t cid, uint8_t nid, uint16_t cmd, uint8_t data) {
-	uint8_t index = (space.load(regs::CORBWP) & corbwp::WP) + 1;
+static void complete_batch(VerbBatch* batch, VerbBatchList& completed) {
+	batch->done = true;
+
+	// the callbacks are run once the lock is released
+	if (batch->fn) {
+		batch->next = nullptr;
+		if (completed.tail) {
+			completed.tail->next = batch;
+		}
+		else {
+			completed.head = batch;
+		}
+		completed.tail = batch;
+	}
+}
+
+void UhdaController::submit_batch(VerbBatch& batch) {
+	if (!batch.count) {
+		batch.status = UHDA_STATUS_SUCCESS;
+		batch.done = true;
+		if (batch.fn) {
+			batch.fn(batch.arg, batch.status);
+		}
+		return;
+	}
 
-	VerbDescriptor verb {};
-	verb.set_cid(cid);
-	verb.set_nid(nid);
-	verb.set_payload(cmd << 8 | data);
-	corb[index] = verb;
+	LockGuard guard {lock};
+	queue_batch(batch);
+	write_verbs();
+}
 
-	auto corbwp_reg = space.load(regs::CORBWP);
-	corbwp_reg &= ~corbwp::WP;
-	corbwp_reg |= corbwp::WP(index);
-	space.store(regs::CORBWP, corbwp_reg);
+static constexpr uint32_t VERB_TIMEOUT_US = 50 * 1000;
+static constexpr uint32_t VERB_MAX_POLL_DELAY_US = 512;
 
-	return index;
+UhdaStatus UhdaController::run_batch(VerbBatch& batch) {
+	auto* ptr = &batch;
+	run_batches(&ptr, 1);
+	return batch.status;
 }
 
-uint8_t UhdaController::submit_verb_long(uint8_t cid, uint8_t nid, uint8_t cmd, uint16_t data) {
-	uint8_t index = (space.load(regs::CORBWP) & corbwp::WP) + 1;
+void UhdaController::run_batches(VerbBatch** batches, size_t count) {
+	{
+		LockGuard guard {lock};
+		for (size_t i = 0; i < count; ++i) {
+			auto* batch = batches[i];
+			batch->fn = nullptr;
+			if (!batch->count) {
+				batch->status = UHDA_STATUS_SUCCESS;
+				batch->done = true;
+				continue;
+			}
+			queue_batch(*batch);
+		}
+		write_verbs();
+	}
 
-	VerbDescriptor verb {};
-	verb.set_cid(cid);
-	verb.set_nid(nid);
-	verb.set_payload(cmd << 16 | data);
-	corb[index] = verb;
+	uint32_t delay = 8;
+	uint32_t idle_time = 0;
+	uint32_t last_progress = 0;
+	for (bool first = true;; first = false) {
+		VerbBatchList completed {};
+		bool done = true;
+		{
+			LockGuard guard {lock};
+			process_responses(completed);
+
+			if (first || verb_progress != last_progress) {
+				last_progress = verb_progress;
+				idle_time = 0;
+				delay = 8;
+			}
+			else if (idle_time >= VERB_TIMEOUT_US) {
+				// only the codecs that stopped responding are aborted
+				for (size_t i = 0; i < count; ++i) {
+					if (!batches[i]->done) {
+						++stats.timeouts;
+						UHDA_TRACEPOINT(UHDA_TRACE_VERB_TIMEOUT, batches[i]->cid, 0);
+						abort_verbs(batches[i]->cid, UHDA_STATUS_TIMEOUT, completed);
+					}
+				}
+			}
 
-	auto corbwp_reg = space.load(regs::CORBWP);
-	corbwp_reg &= ~corbwp::WP;
-	corbwp_reg |= corbwp::WP(index);
-	space.store(regs::CORBWP, corbwp_reg);
+			for (size_t i = 0; i < count; ++i) {
+				if (!batches[i]->done) {
+					done = false;
+					break;
+				}
+			}
+		}
+
+		run_completions(completed);
+
+		if (done) {
+			return;
+		}
 
-	return index;
+		// the lock is not held while waiting so that other verbs and irqs can make progress
+		uhda_kernel_delay(delay);
+		idle_time += delay;
+		if (delay < VERB_MAX_POLL_DELAY_US) {
+			delay *= 2;
+		}
+	}
 }
 
-UhdaStatus UhdaController::wait_for_verb(uint8_t index, uhda::ResponseDescriptor& res) {
-	for (int i = 0;; ++i) {
-		if (i == 5 * 2000) {
-			return UHDA_STATUS_TIMEOUT;
+void UhdaController::queue_batch(VerbBatch& batch) {
+	batch.next = nullptr;
+	batch.written = 0;
+	batch.received = 0;
+	batch.done = false;
+	batch.status = UHDA_STATUS_SUCCESS;
+
+	auto& queue = verb_queues[batch.cid];
+	if (queue.tail) {
+		queue.tail->next = &batch;
+	}
+	else {
+		queue.head = &batch;
+	}
+	queue.tail = &batch;
+
+	if (!write_heads[batch.cid]) {
+		write_heads[batch.cid] = &batch;
+		write_pending |= 1 << batch.cid;
+	}
+}
+
+void UhdaController::write_verbs() {
+	// every verb in flight needs a free rirb entry for its response
+	uint16_t max_in_flight = (corb_size < rirb_size ? corb_size : rirb_size) - 1;
+
+	bool written = false;
+	while (write_pending && verbs_in_flight < max_in_flight) {
+		// the next codec after the one that was written last
+		uint32_t rotated = (write_pending >> write_cid) | (write_pending << (16 - write_cid));
+		uint8_t cid = (write_cid + __builtin_ctz(rotated & 0xFFFF)) % 16;
+		write_cid = (cid + 1) % 16;
+
+		auto batch = write_heads[cid];
+		if (!batch->written) {
+			batch->start_clock = space.load(regs::WALCLK);
 		}
 
-		if ((space.load(regs::CORBWP) & corbwp::WP) == index) {
-			break;
+		corb_wp = (corb_wp + 1) % corb_size;
+
+		VerbDescriptor verb {batch->verbs[batch->written++].value};
+		verb.set_cid(cid);
+		corb[corb_wp] = verb;
+
+		++verbs_in_flight;
+		written = true;
+
+		// the batches of a codec are written in the order they were queued
+		if (batch->written == batch->count) {
+			write_heads[cid] = batch->next;
+			if (!batch->next) {
+				write_pending &= ~(1 << cid);
+			}
 		}
 	}
 
-	for (int i = 0;; ++i) {
-		if (i == 5 * 2000) {
-			return UHDA_STATUS_TIMEOUT;
+	if (written) {
+		// the corb entries have to be visible before the doorbell
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		auto corbwp_reg = space.load(regs::CORBWP);
+		corbwp_reg &= ~corbwp::WP;
+		corbwp_reg |= corbwp::WP(corb_wp);
+		space.store(regs::CORBWP, corbwp_reg);
+	}
+}
+
+void UhdaController::process_responses(VerbBatchList& completed) {
+	uint16_t wp = space.load(regs::RIRBWP) & rirbwp::WP;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	while (rirb_rp != wp) {
+		rirb_rp = (rirb_rp + 1) % rirb_size;
+		auto resp = rirb[rirb_rp];
+
+		auto cid = resp.get_codec();
+
+		if (resp.is_unsol()) {
+			for (auto codec : codecs) {
+				if (codec->cid == cid) {
+					codec->handle_unsol(resp.resp);
+					break;
+				}
+			}
+			continue;
 		}
 
-		if ((space.load(regs::RIRBWP) & rirbwp::WP) == index) {
-			break;
+		auto& queue = verb_queues[cid];
+		auto batch = queue.head;
+		if (!batch || batch->received == batch->written) {
+			uhda_kernel_log("warning: received a response without a matching verb");
+			continue;
+		}
+
+		--verbs_in_flight;
+		++verb_progress;
+		++stats.verbs;
+
+		batch->verbs[batch->received++].res = resp.resp;
+
+		if (batch->received == batch->count) {
+			queue.head = batch->next;
+			if (!queue.head) {
+				queue.tail = nullptr;
+			}
+
+			record_batch_latency(*batch);
+			complete_batch(batch, completed);
 		}
 	}
 
-	res = rirb[index];
-	return UHDA_STATUS_SUCCESS;
+	write_verbs();
+}
+
+void UhdaController::record_batch_latency(const VerbBatch& batch) {
+	// the wall clock runs at 24 MHz
+	uint32_t latency = (space.load(regs::WALCLK) - batch.start_clock) / 24;
+
+	uint32_t bucket = 0;
+	while (bucket < UHDA_VERB_LATENCY_BUCKETS - 1 && latency >= 16U << bucket) {
+		++bucket;
+	}
+	++stats.latency_histogram[bucket];
+
+	if (latency > stats.max_latency_us) {
+		stats.max_latency_us = latency;
+	}
+
+	UHDA_TRACEPOINT(UHDA_TRACE_VERB_BATCH, batch.cid, latency);
+}
+
+void UhdaController::abort_verbs(uint8_t cid, UhdaStatus status, VerbBatchList& completed) {
+	auto& queue = verb_queues[cid];
+
+	for (auto batch = queue.head; batch;) {
+		auto next = batch->next;
+
+		// the codec didn't respond in time, consider the responses lost
+		verbs_in_flight -= batch->written - batch->received;
+
+		batch->status = status;
+		complete_batch(batch, completed);
+
+		batch = next;
+	}
+
+	queue.head = nullptr;
+	queue.tail = nullptr;
+	write_heads[cid] = nullptr;
+	write_pending &= ~(1 << cid);
+}
+
+void UhdaController::run_completions(VerbBatchList& completed) {
+	for (auto batch = completed.head; batch;) {
+		// the batch may be reused by the callback
+		auto next = batch->next;
+		batch->fn(batch->arg, batch->status);
+		batch = next;
+	}
 }
 
 UhdaStatus UhdaController::pci_setup() {
@@ -5,21 +5,47 @@
 #include "stream.hpp"
 #include "vector.hpp"
 #include "codec.hpp"
+#include "verb.hpp"
 
 struct UhdaController {
 	constexpr explicit UhdaController(void* pci_device) : pci_device {pci_device} {}
 
 	~UhdaController();
 
-	UhdaStatus init();
+	UhdaStatus init(const void* topology, size_t topology_size);
 	UhdaStatus destroy();
 
 	UhdaStatus suspend();
-	UhdaStatus resume();
+	UhdaStatus resume(const void* topology, size_t topology_size);
+	// keeps the codecs and restores their state from the verb shadows
+	UhdaStatus resume_fast();
+	UhdaStatus reset_link(uint16_t& statests);
 
-	uint8_t submit_verb(uint8_t cid, uint8_t nid, uint16_t cmd, uint8_t data);
-	uint8_t submit_verb_long(uint8_t cid, uint8_t nid, uint8_t cmd, uint16_t data);
-	UhdaStatus wait_for_verb(uint8_t index, uhda::ResponseDescriptor& res);
+	// suspends the link once it has been idle for the autosuspend delay, returns whether it's suspended
+	bool autosuspend_poll(uint64_t now_ms);
+	// brings the link back up using the fast resume if it was suspended by autosuspend
+	UhdaStatus wake();
+	[[nodiscard]] bool is_idle();
+	// starts or stops the streams on the same frame using the stream synchronization register
+	UhdaStatus play_synced(UhdaStream* const* streams, size_t count, bool play);
+
+	UhdaStatus enumerate_codecs(uint16_t statests, const void* topology, size_t topology_size);
+	void destroy_codecs();
+	UhdaStatus get_topology(void* buffer, size_t* size) const;
+
+	void submit_batch(uhda::VerbBatch& batch);
+	UhdaStatus run_batch(uhda::VerbBatch& batch);
+	// runs the batches concurrently and waits until all of them are complete
+	void run_batches(uhda::VerbBatch** batches, size_t count);
+
+	// these must be called with the lock held
+	void queue_batch(uhda::VerbBatch& batch);
+	void write_verbs();
+	void process_responses(uhda::VerbBatchList& completed);
+	void abort_verbs(uint8_t cid, UhdaStatus status, uhda::VerbBatchList& completed);
+	void record_batch_latency(const uhda::VerbBatch& batch);
+
+	static void run_completions(uhda::VerbBatchList& completed);
 
 	UhdaStatus pci_setup();
 	UhdaStatus map_bar();
@@ -30,12 +56,30 @@ struct UhdaController {
 	uint32_t bar {};
 	uint16_t corb_size {};
 	uint16_t rirb_size {};
-	uintptr_t corb_phys {};
-	uintptr_t rirb_phys {};
-	uintptr_t dpl_phys {};
+	// the corb, the rirb and the dma position buffer share one page
+	uintptr_t ring_page_phys {};
+	void* ring_page {};
 	uhda::VerbDescriptor* corb {};
 	uhda::ResponseDescriptor* rirb {};
+	uhda::VerbBatchList verb_queues[16] {};
+	// the first batch of each codec that has verbs left to write,
+	// the codecs take turns so that one long batch doesn't hold up the others.
+	uhda::VerbBatch* write_heads[16] {};
+	uint16_t write_pending {};
+	uint8_t write_cid {};
+	uint32_t verb_progress {};
+	uint16_t corb_wp {};
+	uint16_t rirb_rp {};
+	uint16_t verbs_in_flight {};
 	uint32_t* dma_pos {};
+	// protected by the lock
+	UhdaControllerStats stats {};
+	// number of set up paths of all the codecs, protected by the lock
+	uint32_t active_paths {};
+	uint32_t autosuspend_delay_ms {};
+	uint64_t idle_since_ms {};
+	bool idle {};
+	bool link_suspended {};
 	UhdaStream in_streams[16] {};
 	UhdaStream out_streams[16] {};
 	UhdaStream* in_stream_ptrs[16] {};
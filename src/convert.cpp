@@ -0,0 +1,496 @@
+#include "convert.hpp"
+#include "sample.hpp"
+
+using namespace uhda;
+
+#define memcpy __builtin_memcpy
+
+static constexpr int32_t UNITY_GAIN = 1 << 14;
+// 1 / sqrt(2)
+static constexpr int32_t FOLD_GAIN = 11585;
+
+static constexpr uint32_t ZERO_CROSSINGS = 8;
+static constexpr uint32_t TABLE_STEPS = 32;
+
+// one side of a kaiser windowed sinc with a cutoff of 0.92 and beta of 6 in 1.15 fixed point,
+// sampled at 32 points per zero crossing.
+static constexpr int16_t FILTER_TABLE[ZERO_CROSSINGS * TABLE_STEPS + 1] {
+	30147, 30104, 29978, 29768, 29475, 29102, 28649, 28120, 27517, 26843, 26102, 25298,
+	24434, 23515, 22546, 21531, 20476, 19386, 18266, 17121, 15958, 14782, 13598, 12411,
+	11228, 10054, 8893, 7751, 6633, 5543, 4486, 3465, 2485, 1549, 661, -178,
+	-964, -1694, -2369, -2985, -3542, -4039, -4477, -4854, -5172, -5431, -5632, -5777,
+	-5868, -5905, -5893, -5832, -5726, -5578, -5391, -5168, -4912, -4627, -4317, -3984,
+	-3633, -3266, -2888, -2503, -2112, -1720, -1331, -946, -568, -202, 152, 490,
+	811, 1113, 1393, 1651, 1885, 2094, 2278, 2436, 2568, 2673, 2752, 2805,
+	2833, 2836, 2816, 2773, 2708, 2623, 2520, 2399, 2263, 2113, 1951, 1779,
+	1599, 1412, 1220, 1025, 828, 632, 439, 248, 63, -116, -287, -450,
+	-602, -744, -874, -992, -1097, -1190, -1268, -1333, -1385, -1422, -1447, -1458,
+	-1457, -1443, -1418, -1381, -1335, -1279, -1215, -1142, -1063, -978, -888, -795,
+	-698, -599, -499, -399, -299, -201, -105, -12, 77, 162, 242, 317,
+	386, 449, 505, 555, 598, 634, 663, 685, 700, 709, 711, 707,
+	698, 682, 662, 636, 607, 573, 536, 496, 454, 410, 364, 317,
+	269, 222, 175, 128, 83, 39, -4, -44, -81, -117, -149, -179,
+	-205, -229, -249, -266, -280, -290, -298, -302, -304, -302, -299, -292,
+	-284, -273, -261, -247, -231, -215, -197, -178, -159, -140, -121, -101,
+	-82, -63, -45, -28, -11, 5, 19, 33, 45, 56, 66, 75,
+	82, 88, 93, 97, 99, 101, 101, 100, 98, 96, 93, 89,
+	84, 79, 74, 68, 62, 56, 50, 44, 38, 32, 26, 21,
+	16, 11, 6, 2, -2, -5, -8, -11, -13, -15, -16, -17,
+	-18, -18, -18, -18, 0,
+};
+
+static int32_t saturate(int64_t value) {
+	if (value > INT32_MAX) {
+		return INT32_MAX;
+	}
+	else if (value < INT32_MIN) {
+		return INT32_MIN;
+	}
+	return static_cast<int32_t>(value);
+}
+
+// converts the bits of a float in the range [-1, 1] to a 32-bit sample without using the fpu
+static int32_t float_to_sample(uint32_t bits) {
+	uint32_t exponent = bits >> 23 & 0xFF;
+	uint32_t mantissa = (bits & 0x7FFFFF) | 0x800000;
+	bool negative = bits >> 31;
+
+	// nan
+	if (exponent == 0xFF && (bits & 0x7FFFFF)) {
+		return 0;
+	}
+
+	// the value is mantissa * 2^(exponent - 150), scaled by 2^31
+	int32_t shift = static_cast<int32_t>(exponent) - 119;
+	if (shift >= 8) {
+		return negative ? INT32_MIN : INT32_MAX;
+	}
+
+	int64_t value;
+	if (shift >= 0) {
+		value = static_cast<int64_t>(mantissa) << shift;
+	}
+	else if (shift > -32) {
+		value = mantissa >> -shift;
+	}
+	else {
+		value = 0;
+	}
+
+	return saturate(negative ? -value : value);
+}
+
+// the 20 and 24-bit samples are in 32-bit containers and aligned to the most significant bit
+static int32_t decode_sample(const uint8_t* ptr, UhdaFormat fmt) {
+	switch (fmt) {
+		case UHDA_FORMAT_PCM8:
+			return static_cast<int32_t>(static_cast<uint32_t>(*ptr ^ 0x80) << 24);
+		case UHDA_FORMAT_PCM16:
+		{
+			int16_t value;
+			memcpy(&value, ptr, 2);
+			return static_cast<int32_t>(static_cast<uint32_t>(value) << 16);
+		}
+		case UHDA_FORMAT_FLOAT32:
+		{
+			uint32_t bits;
+			memcpy(&bits, ptr, 4);
+			return float_to_sample(bits);
+		}
+		default:
+		{
+			int32_t value;
+			memcpy(&value, ptr, 4);
+			return value;
+		}
+	}
+}
+
+static void encode_sample(uint8_t* ptr, UhdaFormat fmt, int32_t value) {
+	switch (fmt) {
+		case UHDA_FORMAT_PCM8:
+			*ptr = static_cast<uint8_t>((value >> 24) ^ 0x80);
+			break;
+		case UHDA_FORMAT_PCM16:
+		{
+			auto sample = static_cast<int16_t>(value >> 16);
+			memcpy(ptr, &sample, 2);
+			break;
+		}
+		default:
+			memcpy(ptr, &value, 4);
+			break;
+	}
+}
+
+template<UhdaFormat Src, UhdaFormat Dst, bool MonoToStereo>
+static void convert_samples(const uint8_t* src, uint8_t* dest, uint32_t count) {
+	constexpr auto src_size = get_sample_size(Src);
+	constexpr auto dst_size = get_sample_size(Dst);
+	constexpr uint32_t copies = MonoToStereo ? 2 : 1;
+	uint32_t i = 0;
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+	// float to 16 or 32-bit is the common case, it's done eight samples at a time
+	if constexpr (Src == UHDA_FORMAT_FLOAT32 && Dst != UHDA_FORMAT_PCM8 && !MonoToStereo) {
+		auto* src_samples = reinterpret_cast<const float*>(src);
+		constexpr bool to_16 = Dst == UHDA_FORMAT_PCM16;
+
+#if defined(__SSE2__)
+		// the conversion doesn't saturate, the largest float below 2^31 is used as the upper limit
+		auto scale = _mm_set1_ps(to_16 ? 32768.0f : 2147483648.0f);
+		auto max = _mm_set1_ps(to_16 ? 32767.0f : 2147483520.0f);
+		auto min = _mm_set1_ps(to_16 ? -32768.0f : -2147483648.0f);
+		for (; i + 8 <= count; i += 8) {
+			auto low = _mm_mul_ps(_mm_loadu_ps(src_samples + i), scale);
+			auto high = _mm_mul_ps(_mm_loadu_ps(src_samples + i + 4), scale);
+			auto low_int = _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(low, max), min));
+			auto high_int = _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(high, max), min));
+
+			if constexpr (to_16) {
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 2), _mm_packs_epi32(low_int, high_int));
+			}
+			else {
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4), low_int);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4 + 16), high_int);
+			}
+		}
+#else
+		// the neon conversions saturate
+		auto scale = to_16 ? 32768.0f : 2147483648.0f;
+		for (; i + 8 <= count; i += 8) {
+			auto low = vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(src_samples + i), scale));
+			auto high = vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(src_samples + i + 4), scale));
+
+			if constexpr (to_16) {
+				vst1q_s16(reinterpret_cast<int16_t*>(dest + i * 2), vcombine_s16(vqmovn_s32(low), vqmovn_s32(high)));
+			}
+			else {
+				vst1q_s32(reinterpret_cast<int32_t*>(dest + i * 4), low);
+				vst1q_s32(reinterpret_cast<int32_t*>(dest + i * 4 + 16), high);
+			}
+		}
+#endif
+	}
+#endif
+
+	// the formats are constants here, so the switches of the sample functions fold away
+	for (; i < count; ++i) {
+		auto value = decode_sample(src + i * src_size, Src);
+		for (uint32_t j = 0; j < copies; ++j) {
+			encode_sample(dest + (i * copies + j) * dst_size, Dst, value);
+		}
+	}
+}
+
+// the 20 and 24-bit formats are stored like the 32-bit one, they share its kernels
+template<UhdaFormat Src>
+static Converter::SampleFn select_sample_fn(UhdaFormat dst, bool mono_to_stereo) {
+	switch (dst) {
+		case UHDA_FORMAT_PCM8:
+			return mono_to_stereo ?
+				convert_samples<Src, UHDA_FORMAT_PCM8, true> :
+				convert_samples<Src, UHDA_FORMAT_PCM8, false>;
+		case UHDA_FORMAT_PCM16:
+			return mono_to_stereo ?
+				convert_samples<Src, UHDA_FORMAT_PCM16, true> :
+				convert_samples<Src, UHDA_FORMAT_PCM16, false>;
+		default:
+			return mono_to_stereo ?
+				convert_samples<Src, UHDA_FORMAT_PCM32, true> :
+				convert_samples<Src, UHDA_FORMAT_PCM32, false>;
+	}
+}
+
+static Converter::SampleFn select_sample_fn(UhdaFormat src, UhdaFormat dst, bool mono_to_stereo) {
+	switch (src) {
+		case UHDA_FORMAT_PCM8:
+			return select_sample_fn<UHDA_FORMAT_PCM8>(dst, mono_to_stereo);
+		case UHDA_FORMAT_PCM16:
+			return select_sample_fn<UHDA_FORMAT_PCM16>(dst, mono_to_stereo);
+		case UHDA_FORMAT_FLOAT32:
+			return select_sample_fn<UHDA_FORMAT_FLOAT32>(dst, mono_to_stereo);
+		default:
+			return select_sample_fn<UHDA_FORMAT_PCM32>(dst, mono_to_stereo);
+	}
+}
+
+UhdaStatus Converter::init(const UhdaStreamParams& src, const UhdaStreamParams& dst) {
+	if (!src.channels || src.channels > MAX_CHANNELS ||
+		!dst.channels || dst.channels > MAX_CHANNELS ||
+		!src.sample_rate || !dst.sample_rate ||
+		dst.fmt == UHDA_FORMAT_FLOAT32 ||
+		src.fmt == UHDA_FORMAT_IEC61937 || dst.fmt == UHDA_FORMAT_IEC61937) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+	if (src.sample_rate > static_cast<uint64_t>(dst.sample_rate) * MAX_DOWNSAMPLE_RATIO) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	src_fmt = src.fmt;
+	dst_fmt = dst.fmt;
+	src_channels = src.channels;
+	dst_channels = dst.channels;
+	src_frame_size = src_channels * get_sample_size(src_fmt);
+	dst_frame_size = dst_channels * get_sample_size(dst_fmt);
+
+	init_matrix();
+
+	// the mono to stereo matrix has unity gains, so it's the same as writing each sample twice
+	bool mono_to_stereo = src_channels == 1 && dst_channels == 2;
+	sample_fn = !mix || mono_to_stereo ? select_sample_fn(src_fmt, dst_fmt, mono_to_stereo) : nullptr;
+
+	resample = src.sample_rate != dst.sample_rate;
+	if (resample) {
+		step = (static_cast<uint64_t>(src.sample_rate) << 32) / dst.sample_rate;
+		if (src.sample_rate > dst.sample_rate) {
+			scale = static_cast<uint32_t>((static_cast<uint64_t>(dst.sample_rate) << 16) / src.sample_rate);
+		}
+		else {
+			scale = 1 << 16;
+		}
+
+		// the filter is stretched by the inverse of the scale when downsampling
+		half_taps = ((ZERO_CROSSINGS << 16) + scale - 1) / scale;
+		if (half_taps * 2 > HISTORY_FRAMES) {
+			half_taps = HISTORY_FRAMES / 2;
+		}
+
+		// the first output frame is centered on the first input frame,
+		// the frames before it are the silence the history starts with.
+		phase = 0;
+		lead = 1;
+	}
+
+	return UHDA_STATUS_SUCCESS;
+}
+
+void Converter::init_matrix() {
+	mix = src_channels != dst_channels;
+	if (!mix) {
+		return;
+	}
+
+	if (dst_channels == 1) {
+		for (uint32_t i = 0; i < src_channels; ++i) {
+			matrix[0][i] = UNITY_GAIN / static_cast<int32_t>(src_channels);
+		}
+	}
+	else if (src_channels == 1) {
+		matrix[0][0] = UNITY_GAIN;
+		matrix[1][0] = UNITY_GAIN;
+	}
+	else if (dst_channels == 2) {
+		// the channels are in the order of front left/right, center, lfe, rear left/right and side left/right,
+		// 4 channels are front and rear. the center and the surround channels are folded into the front ones
+		// and the lfe is dropped.
+		bool has_center = src_channels == 3 || src_channels >= 5;
+		bool has_lfe = src_channels == 6 || src_channels == 8;
+		uint32_t first_surround = !has_center ? 2 : has_lfe ? 4 : 3;
+
+		matrix[0][0] = UNITY_GAIN;
+		matrix[1][1] = UNITY_GAIN;
+		if (has_center) {
+			matrix[0][2] = FOLD_GAIN;
+			matrix[1][2] = FOLD_GAIN;
+		}
+		for (uint32_t i = first_surround; i < src_channels; ++i) {
+			matrix[(i - first_surround) % 2][i] = FOLD_GAIN;
+		}
+
+		// scale the gains down so that the sum can't clip
+		for (uint32_t i = 0; i < 2; ++i) {
+			int32_t sum = 0;
+			for (uint32_t j = 0; j < src_channels; ++j) {
+				sum += matrix[i][j];
+			}
+			for (uint32_t j = 0; j < src_channels; ++j) {
+				matrix[i][j] = matrix[i][j] * UNITY_GAIN / sum;
+			}
+		}
+	}
+	else {
+		// the channels that exist in both are kept and the rest are dropped or silent
+		for (uint32_t i = 0; i < dst_channels && i < src_channels; ++i) {
+			matrix[i][i] = UNITY_GAIN;
+		}
+	}
+}
+
+void Converter::read_frame(const uint8_t* src, int32_t* frame) const {
+	auto sample_size = get_sample_size(src_fmt);
+	if (!mix) {
+		for (uint32_t i = 0; i < src_channels; ++i) {
+			frame[i] = decode_sample(src + i * sample_size, src_fmt);
+		}
+		return;
+	}
+
+	int32_t samples[MAX_CHANNELS];
+	for (uint32_t i = 0; i < src_channels; ++i) {
+		samples[i] = decode_sample(src + i * sample_size, src_fmt);
+	}
+
+	for (uint32_t i = 0; i < dst_channels; ++i) {
+		int64_t value = 0;
+		for (uint32_t j = 0; j < src_channels; ++j) {
+			value += static_cast<int64_t>(samples[j]) * matrix[i][j];
+		}
+		frame[i] = saturate(value >> 14);
+	}
+}
+
+uint32_t Converter::write_frame(const int32_t* frame, uint8_t* dest, uint32_t size) {
+	auto sample_size = get_sample_size(dst_fmt);
+	if (size >= dst_frame_size) {
+		for (uint32_t i = 0; i < dst_channels; ++i) {
+			encode_sample(dest + i * sample_size, dst_fmt, frame[i]);
+		}
+		return dst_frame_size;
+	}
+
+	for (uint32_t i = 0; i < dst_channels; ++i) {
+		encode_sample(pending + i * sample_size, dst_fmt, frame[i]);
+	}
+	memcpy(dest, pending, size);
+	pending_offset = size;
+	pending_size = dst_frame_size;
+	return size;
+}
+
+uint32_t Converter::flush_pending(uint8_t* dest, uint32_t size) {
+	auto remaining = pending_size - pending_offset;
+	if (size > remaining) {
+		size = remaining;
+	}
+
+	memcpy(dest, pending + pending_offset, size);
+	pending_offset += size;
+	if (pending_offset == pending_size) {
+		pending_offset = 0;
+		pending_size = 0;
+	}
+	return size;
+}
+
+void Converter::convert_frames(const uint8_t* src, uint8_t* dest, uint32_t frames) const {
+	if (sample_fn) {
+		sample_fn(src, dest, frames * src_channels);
+		return;
+	}
+
+	int32_t frame[MAX_CHANNELS];
+	auto sample_size = get_sample_size(dst_fmt);
+	for (uint32_t i = 0; i < frames; ++i) {
+		read_frame(src + i * src_frame_size, frame);
+
+		auto* ptr = dest + i * dst_frame_size;
+		for (uint32_t j = 0; j < dst_channels; ++j) {
+			encode_sample(ptr + j * sample_size, dst_fmt, frame[j]);
+		}
+	}
+}
+
+void Converter::push_frame(const int32_t* frame) {
+	for (uint32_t i = 0; i < dst_channels; ++i) {
+		history[history_pos][i] = frame[i];
+		history[history_pos + HISTORY_FRAMES][i] = frame[i];
+	}
+
+	if (++history_pos == HISTORY_FRAMES) {
+		history_pos = 0;
+	}
+	--lead;
+}
+
+void Converter::resample_frame(int32_t* frame) {
+	auto taps = half_taps * 2;
+
+	// the filter is centered on the position of the output frame,
+	// which is between the input frame at `lead` and the one after it.
+	int32_t coefficients[HISTORY_FRAMES];
+	for (uint32_t i = 0; i < taps; ++i) {
+		int64_t distance = (static_cast<int64_t>(i) - static_cast<int64_t>(half_taps - 1)) * 65536 - (phase >> 16);
+		if (distance < 0) {
+			distance = -distance;
+		}
+
+		auto x = static_cast<uint64_t>(distance) * scale >> 16;
+		if (x >= ZERO_CROSSINGS << 16) {
+			coefficients[i] = 0;
+			continue;
+		}
+
+		// linear interpolation between the table entries
+		auto index = static_cast<uint32_t>(x >> 11);
+		auto fraction = static_cast<int32_t>(x & 0x7FF);
+		int32_t value = FILTER_TABLE[index] + ((FILTER_TABLE[index + 1] - FILTER_TABLE[index]) * fraction >> 11);
+		coefficients[i] = static_cast<int32_t>(static_cast<int64_t>(value) * scale >> 16);
+	}
+
+	auto start = static_cast<int32_t>(history_pos) + lead - static_cast<int32_t>(half_taps);
+	while (start < 0) {
+		start += HISTORY_FRAMES;
+	}
+
+	for (uint32_t i = 0; i < dst_channels; ++i) {
+		int64_t value = 0;
+		for (uint32_t j = 0; j < taps; ++j) {
+			value += static_cast<int64_t>(history[start + j][i]) * coefficients[j];
+		}
+		frame[i] = saturate((value + (1 << 14)) >> 15);
+	}
+
+	auto next = static_cast<uint64_t>(phase) + step;
+	phase = static_cast<uint32_t>(next);
+	lead += static_cast<int32_t>(next >> 32);
+}
+
+uint32_t Converter::convert(const void* src, uint32_t src_size, uint32_t* consumed, void* dest, uint32_t dest_size) {
+	auto* src_ptr = static_cast<const uint8_t*>(src);
+	auto* dest_ptr = static_cast<uint8_t*>(dest);
+
+	uint32_t written = 0;
+	if (pending_size) {
+		written = flush_pending(dest_ptr, dest_size);
+	}
+
+	uint32_t src_frames = src_size / src_frame_size;
+	uint32_t read = 0;
+
+	// without resampling each input frame is one output frame, the ones that fit are converted in bulk
+	if (!resample) {
+		auto frames = (dest_size - written) / dst_frame_size;
+		if (frames > src_frames) {
+			frames = src_frames;
+		}
+
+		convert_frames(src_ptr, dest_ptr + written, frames);
+		read = frames;
+		written += frames * dst_frame_size;
+	}
+
+	int32_t frame[MAX_CHANNELS];
+	while (written < dest_size) {
+		if (resample && lead + static_cast<int32_t>(half_taps) <= 0) {
+			resample_frame(frame);
+		}
+		else if (read < src_frames) {
+			read_frame(src_ptr + read * src_frame_size, frame);
+			++read;
+
+			if (resample) {
+				push_frame(frame);
+				continue;
+			}
+		}
+		else {
+			break;
+		}
+
+		written += write_frame(frame, dest_ptr + written, dest_size - written);
+	}
+
+	*consumed = read * src_frame_size;
+	return written;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "uhda/types.h"
+
+namespace uhda {
+	// converts the client's sample format, channel count and sample rate to the format of a stream.
+	// only integer arithmetic is used unless simd is enabled by the compiler flags,
+	// so it can also be built for kernels that don't save the fpu state.
+	struct Converter {
+		static constexpr uint32_t MAX_CHANNELS = 8;
+		static constexpr uint32_t MAX_FRAME_SIZE = MAX_CHANNELS * 4;
+		// the filter gets wider when downsampling, this limits it to the number of frames kept
+		static constexpr uint32_t MAX_DOWNSAMPLE_RATIO = 4;
+		static constexpr uint32_t HISTORY_FRAMES = 64;
+
+		// converts `count` source samples, the kernels are specialized for each pair of formats
+		using SampleFn = void (*)(const uint8_t* src, uint8_t* dest, uint32_t count);
+
+		UhdaStatus init(const UhdaStreamParams& src, const UhdaStreamParams& dst);
+
+		// converts whole frames from `src` into `dest` and returns the number of bytes written,
+		// `consumed` is set to the number of bytes read from `src`.
+		// a frame that doesn't fit in `dest` is split and the rest of it is written by the next call.
+		uint32_t convert(const void* src, uint32_t src_size, uint32_t* consumed, void* dest, uint32_t dest_size);
+
+		void init_matrix();
+		void read_frame(const uint8_t* src, int32_t* frame) const;
+		uint32_t write_frame(const int32_t* frame, uint8_t* dest, uint32_t size);
+		uint32_t flush_pending(uint8_t* dest, uint32_t size);
+		void convert_frames(const uint8_t* src, uint8_t* dest, uint32_t frames) const;
+		void push_frame(const int32_t* frame);
+		void resample_frame(int32_t* frame);
+
+		UhdaFormat src_fmt {};
+		UhdaFormat dst_fmt {};
+		uint32_t src_channels {};
+		uint32_t dst_channels {};
+		uint32_t src_frame_size {};
+		uint32_t dst_frame_size {};
+
+		// gains from the source channels to the destination channels in 2.14 fixed point
+		int32_t matrix[MAX_CHANNELS][MAX_CHANNELS] {};
+		bool mix {};
+		// selected by init when the channels are copied as is or mono is duplicated to stereo,
+		// the other layouts go through the matrix.
+		SampleFn sample_fn {};
+
+		bool resample {};
+		// input frames per output frame in 32.32 fixed point
+		uint64_t step {};
+		// the position of the next output frame, `lead` is its integer part relative to the newest input frame
+		uint32_t phase {};
+		int32_t lead {};
+		uint32_t half_taps {};
+		// the cutoff of the filter relative to the source rate in 16.16 fixed point
+		uint32_t scale {};
+		// the frames are written twice so that the filter can always read them contiguously
+		uint32_t history_pos {};
+		int32_t history[HISTORY_FRAMES * 2][MAX_CHANNELS] {};
+
+		uint8_t pending[MAX_FRAME_SIZE] {};
+		uint32_t pending_offset {};
+		uint32_t pending_size {};
+	};
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace uhda {
+	// copies into a dma buffer with non-temporal stores where they are available,
+	// the data isn't read back by the cpu so it doesn't need to take up the cache.
+	// the stores are only ordered by `dma_write_barrier`, which has to follow before the data is used.
+	inline void copy_to_dma(void* dest, const void* src, size_t size) {
+		auto* dest_ptr = static_cast<char*>(dest);
+		auto* src_ptr = static_cast<const char*>(src);
+
+#if defined(__SSE2__)
+		if (size >= 64) {
+			// the stores have to be aligned, the bytes before the first 16-byte boundary are copied normally
+			auto head = -reinterpret_cast<uintptr_t>(dest_ptr) & 15;
+			__builtin_memcpy(dest_ptr, src_ptr, head);
+			dest_ptr += head;
+			src_ptr += head;
+			size -= head;
+
+			for (; size >= 64; size -= 64) {
+				auto first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_ptr));
+				auto second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_ptr + 16));
+				auto third = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_ptr + 32));
+				auto fourth = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_ptr + 48));
+				_mm_stream_si128(reinterpret_cast<__m128i*>(dest_ptr), first);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(dest_ptr + 16), second);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(dest_ptr + 32), third);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(dest_ptr + 48), fourth);
+				dest_ptr += 64;
+				src_ptr += 64;
+			}
+		}
+#endif
+
+		__builtin_memcpy(dest_ptr, src_ptr, size);
+	}
+}
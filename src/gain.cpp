@@ -0,0 +1,216 @@
+#include "gain.hpp"
+#include "dma_copy.hpp"
+#include "sample.hpp"
+
+using namespace uhda;
+
+#define memcpy __builtin_memcpy
+
+// the samples are scaled in chunks on the stack so that the dma buffer is written with the streaming copy
+static constexpr uint32_t CHUNK_SIZE = 256;
+
+#if defined(__SSE2__)
+// multiplies four 32-bit samples by 2.14 gains, sse2 doesn't have a signed 32-bit multiply
+// so the upper halves of the samples are multiplied as 16-bit values and the lower ones as unsigned.
+static __m128i mul32_q14(__m128i samples, __m128i gains) {
+	// the gains are positive and below 2^15, so their upper halves don't add anything to the sums
+	auto high = _mm_madd_epi16(_mm_srai_epi32(samples, 16), gains);
+	auto low = _mm_and_si128(samples, _mm_set1_epi32(0xFFFF));
+
+	auto even = _mm_srli_epi64(_mm_mul_epu32(low, gains), 14);
+	auto odd = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(low, 32), _mm_srli_epi64(gains, 32)), 14);
+	auto low_products = _mm_or_si128(
+		_mm_and_si128(even, _mm_set_epi32(0, -1, 0, -1)),
+		_mm_slli_epi64(odd, 32));
+	return _mm_add_epi32(_mm_slli_epi32(high, 2), low_products);
+}
+#elif defined(__ARM_NEON)
+static int32x4_t mul32_q14(int32x4_t samples, int32x4_t gains) {
+	auto low = vshrn_n_s64(vmull_s32(vget_low_s32(samples), vget_low_s32(gains)), 14);
+	auto high = vshrn_n_s64(vmull_s32(vget_high_s32(samples), vget_high_s32(gains)), 14);
+	return vcombine_s32(low, high);
+}
+#endif
+
+void Gain::set(int32_t new_target, uint32_t ramp_frames) {
+	target = new_target;
+	if (!ramp_frames || current == target) {
+		current = target;
+		step = 0;
+		frames_left = 0;
+		return;
+	}
+
+	step = static_cast<int32_t>((static_cast<int64_t>(target) - current) / ramp_frames);
+	frames_left = ramp_frames;
+}
+
+bool Gain::get_lane_gains(int32_t* gains, uint32_t channels) const {
+	if (8 % channels || channel || frames_left < 8 / channels) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < 8; ++i) {
+		gains[i] = (current + step * static_cast<int32_t>(i / channels)) >> 16;
+	}
+	return true;
+}
+
+void Gain::advance_lanes(uint32_t channels) {
+	auto frames = 8 / channels;
+	current += step * static_cast<int32_t>(frames);
+	frames_left -= frames;
+	if (!frames_left) {
+		current = target;
+	}
+}
+
+void Gain::scale8(uint8_t* samples, uint32_t count, uint32_t channels) {
+	// 8-bit streams are rare, they are only scaled a sample at a time
+	for (uint32_t i = 0; i < count; ++i) {
+		auto value = static_cast<int8_t>(samples[i] ^ 0x80) * next_sample_gain(channels) >> 14;
+		samples[i] = static_cast<uint8_t>(value ^ 0x80);
+	}
+}
+
+void Gain::scale16(int16_t* samples, uint32_t count, uint32_t channels) {
+	uint32_t i = 0;
+
+	while (frames_left && i < count) {
+#if defined(__SSE2__) || defined(__ARM_NEON)
+		// the ramp is done eight samples at a time, each lane gets the gain of its frame
+		alignas(16) int32_t lanes[8];
+		if (i + 8 <= count && get_lane_gains(lanes, channels)) {
+#if defined(__SSE2__)
+			auto gains = _mm_packs_epi32(
+				_mm_load_si128(reinterpret_cast<const __m128i*>(lanes)),
+				_mm_load_si128(reinterpret_cast<const __m128i*>(lanes + 4)));
+			__m128i first;
+			__m128i second;
+			mul_q14(_mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i)), gains, first, second);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(samples + i), _mm_packs_epi32(first, second));
+#else
+			auto gains = vcombine_s16(vmovn_s32(vld1q_s32(lanes)), vmovn_s32(vld1q_s32(lanes + 4)));
+			int32x4_t first;
+			int32x4_t second;
+			mul_q14(vld1q_s16(samples + i), gains, first, second);
+			vst1q_s16(samples + i, vcombine_s16(vqmovn_s32(first), vqmovn_s32(second)));
+#endif
+			advance_lanes(channels);
+			i += 8;
+			continue;
+		}
+#endif
+
+		samples[i] = static_cast<int16_t>(samples[i] * next_sample_gain(channels) >> 14);
+		++i;
+	}
+
+	if (i == count) {
+		return;
+	}
+	channel = (channel + count - i) % channels;
+
+	auto gain = current >> 16;
+#if defined(__SSE2__)
+	auto gain_vec = _mm_set1_epi16(static_cast<int16_t>(gain));
+	for (; i + 8 <= count; i += 8) {
+		__m128i first;
+		__m128i second;
+		mul_q14(_mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i)), gain_vec, first, second);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(samples + i), _mm_packs_epi32(first, second));
+	}
+#elif defined(__ARM_NEON)
+	auto gain_vec = vdupq_n_s16(static_cast<int16_t>(gain));
+	for (; i + 8 <= count; i += 8) {
+		int32x4_t first;
+		int32x4_t second;
+		mul_q14(vld1q_s16(samples + i), gain_vec, first, second);
+		vst1q_s16(samples + i, vcombine_s16(vqmovn_s32(first), vqmovn_s32(second)));
+	}
+#endif
+
+	for (; i < count; ++i) {
+		samples[i] = static_cast<int16_t>(samples[i] * gain >> 14);
+	}
+}
+
+void Gain::scale32(int32_t* samples, uint32_t count, uint32_t channels) {
+	uint32_t i = 0;
+
+	while (frames_left && i < count) {
+#if defined(__SSE2__) || defined(__ARM_NEON)
+		alignas(16) int32_t lanes[8];
+		if (i + 8 <= count && get_lane_gains(lanes, channels)) {
+#if defined(__SSE2__)
+			for (uint32_t j = 0; j < 8; j += 4) {
+				auto* ptr = reinterpret_cast<__m128i*>(samples + i + j);
+				auto gains = _mm_load_si128(reinterpret_cast<const __m128i*>(lanes + j));
+				_mm_storeu_si128(ptr, mul32_q14(_mm_loadu_si128(ptr), gains));
+			}
+#else
+			for (uint32_t j = 0; j < 8; j += 4) {
+				vst1q_s32(samples + i + j, mul32_q14(vld1q_s32(samples + i + j), vld1q_s32(lanes + j)));
+			}
+#endif
+			advance_lanes(channels);
+			i += 8;
+			continue;
+		}
+#endif
+
+		samples[i] = static_cast<int32_t>(static_cast<int64_t>(samples[i]) * next_sample_gain(channels) >> 14);
+		++i;
+	}
+
+	if (i == count) {
+		return;
+	}
+	channel = (channel + count - i) % channels;
+
+	auto gain = current >> 16;
+#if defined(__SSE2__)
+	auto gain_vec = _mm_set1_epi32(gain);
+	for (; i + 4 <= count; i += 4) {
+		auto* ptr = reinterpret_cast<__m128i*>(samples + i);
+		_mm_storeu_si128(ptr, mul32_q14(_mm_loadu_si128(ptr), gain_vec));
+	}
+#elif defined(__ARM_NEON)
+	auto gain_vec = vdupq_n_s32(gain);
+	for (; i + 4 <= count; i += 4) {
+		vst1q_s32(samples + i, mul32_q14(vld1q_s32(samples + i), gain_vec));
+	}
+#endif
+
+	for (; i < count; ++i) {
+		samples[i] = static_cast<int32_t>(static_cast<int64_t>(samples[i]) * gain >> 14);
+	}
+}
+
+void Gain::apply(void* dest, const void* src, uint32_t size, UhdaFormat fmt, uint32_t channels) {
+	auto* dest_ptr = static_cast<uint8_t*>(dest);
+	auto* src_ptr = static_cast<const uint8_t*>(src);
+	auto sample_size = get_sample_size(fmt);
+
+	alignas(16) uint8_t chunk[CHUNK_SIZE];
+	while (size) {
+		auto chunk_size = size < CHUNK_SIZE ? size : CHUNK_SIZE;
+		memcpy(chunk, src_ptr, chunk_size);
+
+		auto count = chunk_size / sample_size;
+		if (sample_size == 1) {
+			scale8(chunk, count, channels);
+		}
+		else if (sample_size == 2) {
+			scale16(reinterpret_cast<int16_t*>(chunk), count, channels);
+		}
+		else {
+			scale32(reinterpret_cast<int32_t*>(chunk), count, channels);
+		}
+
+		copy_to_dma(dest_ptr, chunk, chunk_size);
+		dest_ptr += chunk_size;
+		src_ptr += chunk_size;
+		size -= chunk_size;
+	}
+}
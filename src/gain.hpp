@@ -0,0 +1,53 @@
+#pragma once
+#include "uhda/types.h"
+
+namespace uhda {
+	// software gain of a stream, applied while the queued data is copied into the dma buffer.
+	// it ramps linearly from frame to frame so that changing it doesn't click.
+	struct Gain {
+		// 2.30 fixed point, the samples are multiplied by the upper bits of it in 2.14
+		static constexpr int32_t UNITY = 1 << 30;
+
+		void set(int32_t new_target, uint32_t ramp_frames);
+
+		[[nodiscard]] bool is_unity() const {
+			return current == UNITY && !frames_left;
+		}
+
+		// copies `size` bytes of whole samples from `src` to `dest` and scales them
+		void apply(void* dest, const void* src, uint32_t size, UhdaFormat fmt, uint32_t channels);
+
+		// these scale the samples in place
+		void scale8(uint8_t* samples, uint32_t count, uint32_t channels);
+		void scale16(int16_t* samples, uint32_t count, uint32_t channels);
+		void scale32(int32_t* samples, uint32_t count, uint32_t channels);
+
+		// returns the gain of the next sample in 2.14, the ramp steps after the last sample of a frame
+		int32_t next_sample_gain(uint32_t channels) {
+			auto value = current >> 16;
+			if (++channel == channels) {
+				channel = 0;
+				if (frames_left) {
+					current += step;
+					// the remainder of the division is made up for at the end
+					if (!--frames_left) {
+						current = target;
+					}
+				}
+			}
+			return value;
+		}
+
+		// the lanes of eight samples that start a frame get the gain of their own frame,
+		// returns false if the frames don't line up with the lanes or the ramp ends within them.
+		bool get_lane_gains(int32_t* gains, uint32_t channels) const;
+		void advance_lanes(uint32_t channels);
+
+		int32_t current {UNITY};
+		int32_t target {UNITY};
+		int32_t step {};
+		uint32_t frames_left {};
+		// the channel of the next sample
+		uint32_t channel {};
+	};
+}
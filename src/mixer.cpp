@@ -0,0 +1,301 @@
+#include "mixer.hpp"
+#include "lock_guard.hpp"
+#include "dma_copy.hpp"
+#include "sample.hpp"
+
+using namespace uhda;
+
+#define memcpy __builtin_memcpy
+#define memset __builtin_memset
+
+// the samples are mixed in chunks on the stack so that the write-combining dma buffer is only written once
+static constexpr uint32_t CHUNK_SAMPLES = 128;
+
+uint32_t UhdaVirtualStream::get_size() const {
+	// acquire pairs with the release in the commit of the other side
+	auto write_pos = __atomic_load_n(&ring_buffer_write_pos, __ATOMIC_ACQUIRE);
+	auto read_pos = __atomic_load_n(&ring_buffer_read_pos, __ATOMIC_ACQUIRE);
+	if (write_pos >= read_pos) {
+		return write_pos - read_pos;
+	}
+	else {
+		return 2 * ring_buffer_capacity - read_pos + write_pos;
+	}
+}
+
+void UhdaVirtualStream::queue_data(const void* data, uint32_t* size) {
+	uint32_t to_copy = ring_buffer_capacity - get_size();
+	if (*size < to_copy) {
+		to_copy = *size;
+	}
+
+	auto pos = ring_buffer_write_pos;
+	auto write_offset = pos >= ring_buffer_capacity ? pos - ring_buffer_capacity : pos;
+	auto remaining_at_end = ring_buffer_capacity - write_offset;
+
+	auto* ring = static_cast<char*>(ring_buffer);
+	if (remaining_at_end >= to_copy) {
+		memcpy(ring + write_offset, data, to_copy);
+	}
+	else {
+		memcpy(ring + write_offset, data, remaining_at_end);
+		memcpy(ring, launder(static_cast<const char*>(data) + remaining_at_end), to_copy - remaining_at_end);
+	}
+
+	pos += to_copy;
+	if (pos >= 2 * ring_buffer_capacity) {
+		pos -= 2 * ring_buffer_capacity;
+	}
+	// publishes the data written before it to the mixer
+	__atomic_store_n(&ring_buffer_write_pos, pos, __ATOMIC_RELEASE);
+
+	*size = to_copy;
+}
+
+static void accumulate16(int32_t* acc, const int16_t* src, uint32_t count, int32_t gain) {
+	uint32_t i = 0;
+
+#if defined(__SSE2__)
+	auto gain_vec = _mm_set1_epi16(static_cast<int16_t>(gain));
+	for (; i + 8 <= count; i += 8) {
+		__m128i first;
+		__m128i second;
+		mul_q14(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), gain_vec, first, second);
+
+		auto* acc_ptr = reinterpret_cast<__m128i*>(acc + i);
+		_mm_storeu_si128(acc_ptr, _mm_add_epi32(_mm_loadu_si128(acc_ptr), first));
+		_mm_storeu_si128(acc_ptr + 1, _mm_add_epi32(_mm_loadu_si128(acc_ptr + 1), second));
+	}
+#elif defined(__ARM_NEON)
+	auto gain_vec = vdupq_n_s16(static_cast<int16_t>(gain));
+	for (; i + 8 <= count; i += 8) {
+		int32x4_t first;
+		int32x4_t second;
+		mul_q14(vld1q_s16(src + i), gain_vec, first, second);
+		vst1q_s32(acc + i, vaddq_s32(vld1q_s32(acc + i), first));
+		vst1q_s32(acc + i + 4, vaddq_s32(vld1q_s32(acc + i + 4), second));
+	}
+#endif
+
+	for (; i < count; ++i) {
+		acc[i] += src[i] * gain >> 14;
+	}
+}
+
+static void store16(int16_t* dest, const int32_t* acc, uint32_t count) {
+	uint32_t i = 0;
+
+#if defined(__SSE2__)
+	// the dma buffer isn't read by the cpu, the stores bypass the cache when they are aligned.
+	// `dma_write_barrier` orders them before the data is handed to the hardware.
+	if (!(reinterpret_cast<uintptr_t>(dest) & 15)) {
+		for (; i + 8 <= count; i += 8) {
+			auto first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i));
+			auto second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i + 4));
+			_mm_stream_si128(reinterpret_cast<__m128i*>(dest + i), _mm_packs_epi32(first, second));
+		}
+	}
+	for (; i + 8 <= count; i += 8) {
+		auto first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i));
+		auto second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i + 4));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_packs_epi32(first, second));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 8 <= count; i += 8) {
+		auto first = vqmovn_s32(vld1q_s32(acc + i));
+		auto second = vqmovn_s32(vld1q_s32(acc + i + 4));
+		vst1q_s16(dest + i, vcombine_s16(first, second));
+	}
+#endif
+
+	for (; i < count; ++i) {
+		auto value = acc[i];
+		if (value > INT16_MAX) {
+			value = INT16_MAX;
+		}
+		else if (value < INT16_MIN) {
+			value = INT16_MIN;
+		}
+		dest[i] = static_cast<int16_t>(value);
+	}
+}
+
+void UhdaVirtualStream::mix16(int32_t* acc, uint32_t count) {
+	auto pos = ring_buffer_read_pos;
+	auto read_offset = pos >= ring_buffer_capacity ? pos - ring_buffer_capacity : pos;
+	auto* ring = static_cast<const char*>(ring_buffer);
+
+	// the capacity is a multiple of the frame size, so the samples are never split by the end
+	uint32_t size = count * 2;
+	auto remaining_at_end = ring_buffer_capacity - read_offset;
+	auto gain_value = __atomic_load_n(&gain, __ATOMIC_RELAXED);
+	if (size <= remaining_at_end) {
+		accumulate16(acc, reinterpret_cast<const int16_t*>(ring + read_offset), count, gain_value);
+	}
+	else {
+		auto first = remaining_at_end / 2;
+		accumulate16(acc, reinterpret_cast<const int16_t*>(ring + read_offset), first, gain_value);
+		accumulate16(acc + first, reinterpret_cast<const int16_t*>(ring), count - first, gain_value);
+	}
+
+	pos += size;
+	if (pos >= 2 * ring_buffer_capacity) {
+		pos -= 2 * ring_buffer_capacity;
+	}
+	// the client can write over the data after this
+	__atomic_store_n(&ring_buffer_read_pos, pos, __ATOMIC_RELEASE);
+}
+
+void UhdaVirtualStream::mix32(int64_t* acc, uint32_t count) {
+	auto pos = ring_buffer_read_pos;
+	auto read_offset = pos >= ring_buffer_capacity ? pos - ring_buffer_capacity : pos;
+	auto* ring = static_cast<const char*>(ring_buffer);
+	auto gain_value = __atomic_load_n(&gain, __ATOMIC_RELAXED);
+
+	for (uint32_t i = 0; i < count; ++i) {
+		int32_t sample;
+		memcpy(&sample, ring + read_offset, 4);
+		acc[i] += static_cast<int64_t>(sample) * gain_value >> 14;
+
+		read_offset += 4;
+		if (read_offset == ring_buffer_capacity) {
+			read_offset = 0;
+		}
+	}
+
+	pos += count * 4;
+	if (pos >= 2 * ring_buffer_capacity) {
+		pos -= 2 * ring_buffer_capacity;
+	}
+	__atomic_store_n(&ring_buffer_read_pos, pos, __ATOMIC_RELEASE);
+}
+
+Mixer::~Mixer() {
+	for (auto* stream : streams) {
+		uhda_kernel_free(stream->ring_buffer, stream->ring_buffer_capacity);
+		uhda_kernel_free(stream, sizeof(UhdaVirtualStream));
+	}
+	if (lock) {
+		uhda_kernel_free_spinlock(lock);
+	}
+}
+
+uint32_t Mixer::fill(void* arg, void* buffer, uint32_t space) {
+	return static_cast<Mixer*>(arg)->mix(buffer, space);
+}
+
+uint32_t Mixer::mix(void* buffer, uint32_t space) {
+	LockGuard guard {lock};
+
+	// the streams that don't have enough data queued play silence for the rest,
+	// nothing is written if none of them has anything queued.
+	// only whole frames are taken from the streams so that the channels stay in place.
+	uint32_t size = 0;
+	for (auto* stream : streams) {
+		auto stream_size = stream->get_size();
+		if (stream_size > size) {
+			size = stream_size;
+		}
+	}
+	if (size > space) {
+		size = space;
+	}
+	size -= size % frame_size;
+
+	auto* dest = static_cast<char*>(buffer);
+	for (uint32_t offset = 0; offset < size;) {
+		auto chunk = size - offset;
+		if (chunk > CHUNK_SAMPLES * sample_size) {
+			chunk = CHUNK_SAMPLES * sample_size;
+			chunk -= chunk % frame_size;
+		}
+		auto count = chunk / sample_size;
+
+		if (sample_size == 2) {
+			int32_t acc[CHUNK_SAMPLES];
+			memset(acc, 0, count * sizeof(int32_t));
+
+			for (auto* stream : streams) {
+				auto available = stream->get_size() / frame_size * frame_size / sample_size;
+				stream->mix16(acc, available < count ? available : count);
+			}
+
+			store16(reinterpret_cast<int16_t*>(dest + offset), acc, count);
+		}
+		else {
+			int64_t acc[CHUNK_SAMPLES];
+			memset(acc, 0, count * sizeof(int64_t));
+
+			for (auto* stream : streams) {
+				auto available = stream->get_size() / frame_size * frame_size / sample_size;
+				stream->mix32(acc, available < count ? available : count);
+			}
+
+			int32_t samples[CHUNK_SAMPLES];
+			for (uint32_t i = 0; i < count; ++i) {
+				auto value = acc[i];
+				if (value > INT32_MAX) {
+					value = INT32_MAX;
+				}
+				else if (value < INT32_MIN) {
+					value = INT32_MIN;
+				}
+				samples[i] = static_cast<int32_t>(value);
+			}
+			copy_to_dma(dest + offset, samples, count * 4);
+		}
+
+		offset += chunk;
+	}
+
+	return size;
+}
+
+UhdaStatus Mixer::create_stream(uint32_t ring_size, UhdaVirtualStream** res) {
+	// keep the frames from being split by the end of the ring buffer
+	ring_size -= ring_size % frame_size;
+	if (!ring_size || ring_size > UINT32_MAX / 2) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	auto* ptr = uhda_kernel_malloc(sizeof(UhdaVirtualStream));
+	if (!ptr) {
+		return UHDA_STATUS_NO_MEMORY;
+	}
+
+	auto* stream = construct<UhdaVirtualStream>(ptr);
+	stream->mixer = this;
+	stream->gain = 1 << 14;
+	stream->ring_buffer_capacity = ring_size;
+	stream->ring_buffer = uhda_kernel_malloc(ring_size);
+	if (!stream->ring_buffer) {
+		uhda_kernel_free(stream, sizeof(UhdaVirtualStream));
+		return UHDA_STATUS_NO_MEMORY;
+	}
+
+	LockGuard guard {lock};
+	if (!streams.push(stream)) {
+		uhda_kernel_free(stream->ring_buffer, ring_size);
+		uhda_kernel_free(stream, sizeof(UhdaVirtualStream));
+		return UHDA_STATUS_NO_MEMORY;
+	}
+
+	*res = stream;
+	return UHDA_STATUS_SUCCESS;
+}
+
+void Mixer::destroy_stream(UhdaVirtualStream* stream) {
+	{
+		LockGuard guard {lock};
+		for (size_t i = 0; i < streams.size(); ++i) {
+			if (streams[i] == stream) {
+				streams[i] = streams[streams.size() - 1];
+				streams.pop();
+				break;
+			}
+		}
+	}
+
+	uhda_kernel_free(stream->ring_buffer, stream->ring_buffer_capacity);
+	uhda_kernel_free(stream, sizeof(UhdaVirtualStream));
+}
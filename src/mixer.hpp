@@ -0,0 +1,44 @@
+#pragma once
+#include "uhda/types.h"
+#include "vector.hpp"
+
+namespace uhda {
+	struct Mixer;
+}
+
+struct UhdaVirtualStream {
+	// the ring buffer has a single producer, the client, and the mixer as the consumer.
+	// the positions run from zero to twice the capacity like the ones of `UhdaStream`.
+	[[nodiscard]] uint32_t get_size() const;
+	void queue_data(const void* data, uint32_t* size);
+	// adds `count` samples of the ring buffer to `acc` and removes them
+	void mix16(int32_t* acc, uint32_t count);
+	void mix32(int64_t* acc, uint32_t count);
+
+	uhda::Mixer* mixer {};
+	void* ring_buffer {};
+	uint32_t ring_buffer_capacity {};
+	uint32_t ring_buffer_write_pos {};
+	uint32_t ring_buffer_read_pos {};
+	// in 2.14 fixed point
+	int32_t gain {};
+};
+
+namespace uhda {
+	// mixes the virtual streams of a stream into its dma buffer, it's used as the stream's `buffer_fill_fn`.
+	struct Mixer {
+		~Mixer();
+
+		static uint32_t fill(void* arg, void* buffer, uint32_t space);
+		uint32_t mix(void* buffer, uint32_t space);
+
+		UhdaStatus create_stream(uint32_t ring_size, UhdaVirtualStream** res);
+		void destroy_stream(UhdaVirtualStream* stream);
+
+		// protects the streams, it's taken with the lock of the stream held when filling in the irq
+		void* lock {};
+		vector<UhdaVirtualStream*> streams;
+		uint32_t sample_size {};
+		uint32_t frame_size {};
+	};
+}
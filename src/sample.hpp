@@ -0,0 +1,39 @@
+#pragma once
+#include "uhda/types.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace uhda {
+	// the 20 and 24-bit samples are in 32-bit containers, iec 61937 bursts are made of 16-bit words
+	constexpr uint32_t get_sample_size(UhdaFormat fmt) {
+		switch (fmt) {
+			case UHDA_FORMAT_PCM8:
+				return 1;
+			case UHDA_FORMAT_PCM16:
+			case UHDA_FORMAT_IEC61937:
+				return 2;
+			default:
+				return 4;
+		}
+	}
+
+#if defined(__SSE2__)
+	// multiplies eight 16-bit samples by 2.14 fixed point gains that fit in 16 bits,
+	// the full products are put together from their low and high halves.
+	inline void mul_q14(__m128i samples, __m128i gains, __m128i& first, __m128i& second) {
+		auto low = _mm_mullo_epi16(samples, gains);
+		auto high = _mm_mulhi_epi16(samples, gains);
+		first = _mm_srai_epi32(_mm_unpacklo_epi16(low, high), 14);
+		second = _mm_srai_epi32(_mm_unpackhi_epi16(low, high), 14);
+	}
+#elif defined(__ARM_NEON)
+	inline void mul_q14(int16x8_t samples, int16x8_t gains, int32x4_t& first, int32x4_t& second) {
+		first = vshrq_n_s32(vmull_s16(vget_low_s16(samples), vget_low_s16(gains)), 14);
+		second = vshrq_n_s32(vmull_s16(vget_high_s16(samples), vget_high_s16(gains)), 14);
+	}
+#endif
+}
@@ -156,6 +156,8 @@ namespace uhda {
 		static constexpr BitField<uint16_t, uint8_t> DIV {8, 3};
 		static constexpr BitField<uint16_t, uint8_t> MULT {11, 3};
 		static constexpr BitField<uint16_t, uint8_t> BASE {14, 1};
+		// set for non-pcm data, which is sent to the codec as is
+		static constexpr BitField<uint16_t, bool> TYPE {15, 1};
 
 		static constexpr uint8_t BASE_48KHZ = 0;
 		static constexpr uint8_t BASE_441KHZ = 1;
@@ -461,6 +463,11 @@ namespace uhda {
 			return channels;
 		}
 
+		constexpr void set_non_pcm(bool non_pcm) {
+			value &= ~pcm_format::TYPE;
+			value |= pcm_format::TYPE(non_pcm);
+		}
+
 		constexpr uint32_t set_bits_per_sample(uint32_t bits) {
 			uint8_t bits_value = 0;
 			if (bits <= 8) {
@@ -538,6 +545,7 @@ namespace uhda {
 			GET_PIN_CONTROL = 0xF07,
 			GET_PIN_SENSE = 0xF09,
 			GET_EAPD_ENABLE = 0xF0C,
+			GET_DIGI_CONVERTER = 0xF0D,
 			GET_VOLUME_KNOB = 0xF0F,
 			GET_CONFIG_DEFAULT = 0xF1C,
 			GET_CONVERTER_CHANNEL_COUNT = 0xF2D,
@@ -545,8 +553,11 @@ namespace uhda {
 			SET_POWER_STATE = 0X705,
 			SET_CONVERTER_CONTROL = 0x706,
 			SET_PIN_CONTROL = 0x707,
+			SET_UNSOL_ENABLE = 0x708,
 			SET_PIN_SENSE = 0x709,
 			SET_EAPD_ENABLE = 0x70C,
+			SET_DIGI_CONVERTER_1 = 0x70D,
+			SET_DIGI_CONVERTER_2 = 0x70E,
 			SET_VOLUME_KNOB = 0x70F,
 			SET_CONVERTER_CHANNEL_COUNT = 0x72D
 		};
@@ -554,9 +565,13 @@ namespace uhda {
 
 	namespace param {
 		enum : uint8_t {
+			VENDOR_ID = 0x0,
+			REVISION_ID = 0x2,
 			NODE_COUNT = 0x4,
 			FUNC_GROUP_TYPE = 0x5,
 			AUDIO_CAPS = 0x9,
+			PCM_SIZE_RATE = 0xA,
+			STREAM_FORMATS = 0xB,
 			PIN_CAPS = 0xC,
 			IN_AMP_CAPS = 0xD,
 			CONN_LIST_LEN = 0xE,
@@ -583,6 +598,30 @@ namespace uhda {
 		};
 	}
 
+	// fields of the amp capabilities parameter
+	namespace amp_caps {
+		// the step that is 0 dB, it's used as the default gain
+		constexpr uint8_t get_offset(uint32_t caps) {
+			return caps & 0x7F;
+		}
+
+		// the highest step, zero if the amp doesn't have a gain control
+		constexpr uint8_t get_num_steps(uint32_t caps) {
+			return caps >> 8 & 0x7F;
+		}
+	}
+
+	// bits of the low byte of the digital converter control
+	namespace digi_converter {
+		static constexpr uint8_t DIGEN = 1 << 0;
+		static constexpr uint8_t NON_AUDIO = 1 << 5;
+	}
+
+	// bits of the stream formats parameter
+	namespace stream_formats {
+		static constexpr uint32_t PCM = 1 << 0;
+	}
+
 	namespace default_dev {
 		enum : uint8_t {
 			LINE_OUT = 0,
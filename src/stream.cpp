@@ -1,21 +1,112 @@
 #include "stream.hpp"
+#include "convert.hpp"
+#include "mixer.hpp"
+#include "controller.hpp"
+#include "dma_copy.hpp"
 #include "lock_guard.hpp"
+#include "trace.hpp"
 #include "uhda/kernel_api.h"
 
 using namespace uhda;
 
 UhdaStream::~UhdaStream() {
-	destroy();
+	// the controller has already been reset at this point
+	// and the lock might not exist anymore, so only free the memory.
+	free_buffers();
 }
 
 static constexpr size_t MAX_DESCRIPTORS = 0x1000 / sizeof(BufferDescriptor);
-static constexpr size_t BUFFER_SIZE = 0x1000 * MAX_DESCRIPTORS;
-static constexpr uint32_t ALLOWED_SOFTWARE_AHEAD = 0x1000 * 4;
+static constexpr uint32_t DEFAULT_PERIOD_SIZE = 0x1000;
+static constexpr uint32_t DEFAULT_BUFFER_SIZE = 0x1000 * 256;
+static constexpr uint32_t DEFAULT_SOFTWARE_AHEAD = 0x1000 * 4;
+// number of irqs without an underrun after which the adaptive latency is lowered
+static constexpr uint32_t ADAPT_WINDOW = 64;
+// bdl entries have to be 128 byte aligned
+static constexpr uint32_t STREAM_ALIGN = 128;
 
 #define memcpy __builtin_memcpy
 #define memset __builtin_memset
 
-UhdaStatus UhdaStream::setup(uint32_t buffer_size) {
+UhdaStatus UhdaStream::setup(uint32_t ring_size, UhdaStreamBufferParams* params, uint32_t byte_rate) {
+	if (params->period_size > UINT32_MAX - STREAM_ALIGN) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	this->byte_rate = byte_rate;
+	position_total = 0;
+	position_last = 0;
+	stats = {};
+	last_irq_clock_valid = false;
+
+	period_size = params->period_size ? params->period_size : DEFAULT_PERIOD_SIZE;
+	period_size = (period_size + STREAM_ALIGN - 1) & ~(STREAM_ALIGN - 1);
+
+	period_count = params->period_count;
+	if (!period_count) {
+		period_count = DEFAULT_BUFFER_SIZE / period_size;
+	}
+	// input streams keep two periods free so that the hardware can't reach the read position
+	uint32_t min_period_count = output ? 2 : 3;
+	if (period_count < min_period_count) {
+		period_count = min_period_count;
+	}
+	else if (period_count > MAX_DESCRIPTORS) {
+		period_count = MAX_DESCRIPTORS;
+	}
+
+	if (period_size > UINT32_MAX / period_count) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+	buffer_size = period_size * period_count;
+
+	uint32_t ahead = DEFAULT_SOFTWARE_AHEAD;
+	if (params->target_latency_us) {
+		uint64_t target = static_cast<uint64_t>(params->target_latency_us) * byte_rate / 1000000;
+		ahead = target > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(target);
+	}
+
+	// the hardware has to be at least a period behind when the period's irq arrives,
+	// and the ahead can't reach a full buffer or it would look like an empty one.
+	uint32_t max_ahead = buffer_size - STREAM_ALIGN;
+	uint32_t min_ahead = 2 * period_size;
+	if (min_ahead > max_ahead) {
+		min_ahead = max_ahead;
+	}
+
+	if (ahead < min_ahead) {
+		ahead = min_ahead;
+	}
+	else if (ahead > max_ahead) {
+		ahead = max_ahead;
+	}
+	software_ahead_limit = ahead;
+	refill_low = ahead;
+
+	adaptive_latency = output && params->max_latency_us && byte_rate;
+	if (adaptive_latency) {
+		uint64_t max_latency = static_cast<uint64_t>(params->max_latency_us) * byte_rate / 1000000;
+		if (max_latency > max_ahead) {
+			max_latency = max_ahead;
+		}
+
+		// the buffer is filled a period past the low watermark,
+		// and the data below it has to last at least a period until the next irq.
+		max_refill_low = max_latency > period_size ? static_cast<uint32_t>(max_latency) - period_size : 0;
+		min_refill_low = period_size < max_refill_low ? period_size : max_refill_low;
+		period_ticks = static_cast<uint32_t>(static_cast<uint64_t>(period_size) * 24000000 / byte_rate);
+		max_irq_lateness = 0;
+		adapt_irqs = 0;
+		adapt_underrun = false;
+		set_refill_low(ahead > period_size ? ahead - period_size : 0);
+		ahead = software_ahead_limit;
+	}
+
+	params->period_size = period_size;
+	params->period_count = period_count;
+	params->actual_latency_us = byte_rate
+		? static_cast<uint32_t>(static_cast<uint64_t>(ahead) * 1000000 / byte_rate)
+		: 0;
+
 	auto status = uhda_kernel_allocate_physical(0x1000, &bdl_phys);
 	if (status != UHDA_STATUS_SUCCESS) {
 		return status;
@@ -31,67 +122,58 @@ UhdaStatus UhdaStream::setup(uint32_t buffer_size) {
 
 	bdl = launder(static_cast<BufferDescriptor*>(bdl_ptr));
 
-	buffer_pages = static_cast<void**>(uhda_kernel_malloc(MAX_DESCRIPTORS * sizeof(void*)));
-	if (!buffer_pages) {
-		uhda_kernel_unmap(bdl, 0x1000);
-		uhda_kernel_deallocate_physical(bdl_phys, 0x1000);
-		bdl = nullptr;
-		bdl_phys = 0;
-		return UHDA_STATUS_NO_MEMORY;
+	status = allocate_buffer();
+	if (status == UHDA_STATUS_SUCCESS) {
+		status = build_bdl();
+	}
+	if (status != UHDA_STATUS_SUCCESS) {
+		free_buffers();
+		return status;
 	}
 
-	for (size_t i = 0; i < MAX_DESCRIPTORS; ++i) {
-		uintptr_t page = 0;
-		status = uhda_kernel_allocate_physical(0x1000, &page);
-
-		buffer_pages[i] = nullptr;
-		if (status == UHDA_STATUS_SUCCESS) {
-			status = uhda_kernel_map(page, 0x1000, &buffer_pages[i]);
+	if (ring_size) {
+		// the ring positions run up to twice the capacity
+		if (ring_size > UINT32_MAX / 2) {
+			free_buffers();
+			return UHDA_STATUS_UNSUPPORTED;
 		}
 
-		if (status != UHDA_STATUS_SUCCESS) {
-			for (size_t j = 0; j < i; ++j) {
-				uhda_kernel_unmap(buffer_pages[j], 0x1000);
-				uhda_kernel_deallocate_physical(bdl[j].address, 0x1000);
-			}
-
-			if (buffer_pages[i]) {
-				uhda_kernel_unmap(buffer_pages[i], 0x1000);
-			}
-			if (page) {
-				uhda_kernel_deallocate_physical(page, 0x1000);
+		if (spare_ring_buffer && spare_ring_buffer_capacity == ring_size) {
+			ring_buffer = spare_ring_buffer;
+			spare_ring_buffer = nullptr;
+		}
+		else {
+			ring_buffer = uhda_kernel_malloc(ring_size);
+			if (!ring_buffer) {
+				free_buffers();
+				return UHDA_STATUS_NO_MEMORY;
 			}
-
-			uhda_kernel_free(buffer_pages, MAX_DESCRIPTORS * sizeof(void*));
-
-			uhda_kernel_unmap(bdl, 0x1000);
-			uhda_kernel_deallocate_physical(bdl_phys, 0x1000);
-			buffer_pages = nullptr;
-			bdl = nullptr;
-			bdl_phys = 0;
-			return status;
 		}
-
-		bdl[i].address = page;
-		bdl[i].length = 0x1000;
-		bdl[i].ioc = 1;
+		ring_buffer_capacity = ring_size;
 	}
 
-	ring_buffer_capacity = buffer_size;
-	ring_buffer = uhda_kernel_malloc(ring_buffer_capacity);
-	if (!ring_buffer) {
-		destroy();
-		return UHDA_STATUS_NO_MEMORY;
+	if (spare_ring_buffer) {
+		uhda_kernel_free(spare_ring_buffer, spare_ring_buffer_capacity);
+		spare_ring_buffer = nullptr;
+		spare_ring_buffer_capacity = 0;
 	}
 
+	program_registers();
+
+	return UHDA_STATUS_SUCCESS;
+}
+
+void UhdaStream::program_registers() {
+	space.store(regs::stream::FMT, format);
+
 	space.store(regs::stream::BDPL, bdl_phys);
 	space.store(regs::stream::BDPU, bdl_phys >> 32);
 
-	space.store(regs::stream::CBL, MAX_DESCRIPTORS * 0x1000);
+	space.store(regs::stream::CBL, buffer_size);
 
 	auto lvi = space.load(regs::stream::LVI);
 	lvi &= ~sdlvi::LVI;
-	lvi |= sdlvi::LVI(MAX_DESCRIPTORS - 1);
+	lvi |= sdlvi::LVI(bdl_entries - 1);
 	space.store(regs::stream::LVI, lvi);
 
 	auto ctl2 = space.load(regs::stream::CTL2);
@@ -102,319 +184,1458 @@ UhdaStatus UhdaStream::setup(uint32_t buffer_size) {
 	auto ctl0 = space.load(regs::stream::CTL0);
 	ctl0 |= sdctl0::IOCE(true);
 	space.store(regs::stream::CTL0, ctl0);
-
-	return UHDA_STATUS_SUCCESS;
 }
 
-void UhdaStream::destroy() {
-	LockGuard guard {lock};
+void UhdaStream::resume(bool restart) {
+	bool was_running;
+	{
+		LockGuard guard {lock};
 
-	if (buffer_pages) {
-		for (size_t i = 0; i < MAX_DESCRIPTORS; ++i) {
-			uhda_kernel_unmap(buffer_pages[i], 0x1000);
-			uhda_kernel_deallocate_physical(bdl[i].address, 0x1000);
+		if (!bdl) {
+			return;
 		}
 
-		uhda_kernel_free(buffer_pages, MAX_DESCRIPTORS * sizeof(void*));
-
-		if (ring_buffer) {
-			uhda_kernel_free(ring_buffer, ring_buffer_capacity);
-			ring_buffer = nullptr;
+		// the converters already have the new format from the verb shadow,
+		// so a format switch that hasn't happened yet is finished right away.
+		if (format_switch == FormatSwitch::Pending || format_switch == FormatSwitch::Armed) {
+			apply_switch_params();
+			format_switch = FormatSwitch::None;
 		}
 
-		uhda_kernel_unmap(bdl, 0x1000);
-		uhda_kernel_deallocate_physical(bdl_phys, 0x1000);
+		// the controller reset cleared the stream registers and the position,
+		// the data that was queued in the dma buffer is dropped and refilled from the start.
+		program_registers();
 
-		buffer_pages = nullptr;
-		bdl = nullptr;
-		bdl_phys = 0;
+		// the total isn't reset so that the frame count stays monotonic across a suspend
+		prev_irq_pos = 0;
+		current_fill_pos = 0;
+		position_last = 0;
+
+		was_running = running;
+		running = false;
 	}
 
-	space.store(regs::stream::CTL0, sdctl0::RST(true));
-	// todo maybe a timeout here,
-	// it's unlikely that the controller is broken at this point though.
-	while (!(space.load(regs::stream::CTL0) & sdctl0::RST));
-	space.store(regs::stream::CTL0, 0);
-	while (space.load(regs::stream::CTL0) & sdctl0::RST);
+	if (restart && was_running) {
+		play(true);
+	}
+}
 
-	current_fill_pos = 0;
-	ring_buffer_read_pos = 0;
-	ring_buffer_write_pos = 0;
+static UhdaStatus map_stream_buffer(uintptr_t phys, size_t size, void** virt, bool output) {
+	// write-combining is only good for the buffers that the cpu writes to,
+	// reads from it aren't cached so the input buffers are mapped as uncacheable.
+	if (!output) {
+		return uhda_kernel_map(phys, size, virt);
+	}
+
+	auto status = uhda_kernel_map_write_combining(phys, size, virt);
+	if (status == UHDA_STATUS_UNSUPPORTED) {
+		status = uhda_kernel_map(phys, size, virt);
+	}
+	return status;
 }
 
-void UhdaStream::play(bool play) {
-	LockGuard guard {lock};
+UhdaStatus UhdaStream::allocate_buffer() {
+	uint32_t alloc_size = (buffer_size + 0xFFF) & ~0xFFF;
 
-	auto ctl0 = space.load(regs::stream::CTL0);
-	if (play) {
-		if (ctl0 & sdctl0::RUN) {
-			return;
+	// the buffer kept from the previous setup is reused if it's large enough
+	if (buffer_pages) {
+		if (buffer_alloc_size >= alloc_size) {
+			return UHDA_STATUS_SUCCESS;
+		}
+		free_pages();
+	}
+	buffer_alloc_size = alloc_size;
+
+	// prefer a single contiguous region, it only needs one mapping
+	// and lets the bdl entries be as large as the periods.
+	uintptr_t phys;
+	if (uhda_kernel_allocate_physical(alloc_size, &phys) == UHDA_STATUS_SUCCESS) {
+		buffer_pages = static_cast<BufferPage*>(uhda_kernel_malloc(sizeof(BufferPage)));
+		if (!buffer_pages) {
+			uhda_kernel_deallocate_physical(phys, alloc_size);
+			return UHDA_STATUS_NO_MEMORY;
 		}
 
-		auto pos = get_pos() % BUFFER_SIZE;
-		auto software_ahead = get_software_ahead(pos);
-
-		if (software_ahead < ALLOWED_SOFTWARE_AHEAD) {
-			auto allowed_copy = ALLOWED_SOFTWARE_AHEAD - software_ahead;
-			allowed_copy = (allowed_copy + 0xFFF) & ~0xFFF;
+		void* virt;
+		auto status = map_stream_buffer(phys, alloc_size, &virt, output);
+		if (status != UHDA_STATUS_SUCCESS) {
+			uhda_kernel_free(buffer_pages, sizeof(BufferPage));
+			uhda_kernel_deallocate_physical(phys, alloc_size);
+			buffer_pages = nullptr;
+			buffer_alloc_size = 0;
+			return status;
+		}
 
-			if (ring_buffer_size >= 0x1000) {
-				auto to_copy = allowed_copy;
+		buffer_pages[0] = {virt, phys};
+		buffer_page_count = 1;
+		buffer_page_size = alloc_size;
+		return UHDA_STATUS_SUCCESS;
+	}
 
-				if (ring_buffer_size < allowed_copy) {
-					to_copy = ring_buffer_size & ~0xFFF;
-				}
+	// fall back to separate pages if the kernel can't provide that much contiguous memory
+	uint32_t page_count = alloc_size / 0x1000;
+	buffer_pages = static_cast<BufferPage*>(uhda_kernel_malloc(page_count * sizeof(BufferPage)));
+	if (!buffer_pages) {
+		buffer_alloc_size = 0;
+		return UHDA_STATUS_NO_MEMORY;
+	}
+	buffer_page_size = 0x1000;
 
-				for (uint32_t i = 0; i < to_copy; i += 0x1000) {
-					auto desc_index = current_fill_pos / 0x1000;
-					auto desc_ptr = buffer_pages[desc_index];
-
-					auto ptr = launder(
-						static_cast<char*>(ring_buffer) +
-						ring_buffer_read_pos);
-					memcpy(desc_ptr, ptr, 0x1000);
-					ring_buffer_read_pos += 0x1000;
-					if (ring_buffer_read_pos == ring_buffer_capacity) {
-						ring_buffer_read_pos = 0;
-					}
-					ring_buffer_size -= 0x1000;
-
-					current_fill_pos += 0x1000;
-					if (current_fill_pos == BUFFER_SIZE) {
-						current_fill_pos = 0;
-					}
-				}
+	for (uint32_t i = 0; i < page_count; ++i) {
+		auto status = uhda_kernel_allocate_physical(0x1000, &phys);
+		if (status != UHDA_STATUS_SUCCESS) {
+			return status;
+		}
 
-				allowed_copy = to_copy;
-			}
+		void* virt;
+		status = map_stream_buffer(phys, 0x1000, &virt, output);
+		if (status != UHDA_STATUS_SUCCESS) {
+			uhda_kernel_deallocate_physical(phys, 0x1000);
+			return status;
+		}
 
-			if (allowed_copy) {
-				for (uint32_t i = 0; i < allowed_copy; i += 0x1000) {
-					auto desc_index = current_fill_pos / 0x1000;
-					auto desc_ptr = buffer_pages[desc_index];
+		// only count the pages that are fully set up, free_buffers frees the rest on failure
+		buffer_pages[i] = {virt, phys};
+		buffer_page_count = i + 1;
+	}
 
-					memset(desc_ptr, 0, 0x1000);
+	return UHDA_STATUS_SUCCESS;
+}
 
-					current_fill_pos += 0x1000;
-					if (current_fill_pos == BUFFER_SIZE) {
-						current_fill_pos = 0;
-					}
-				}
-			}
+bool UhdaStream::bind_converter(UhdaCodec* codec, uint8_t nid) {
+	for (uint8_t i = 0; i < bound_converter_count; ++i) {
+		if (bound_converters[i].codec == codec && bound_converters[i].nid == nid) {
+			return true;
 		}
+	}
 
-		ctl0 |= sdctl0::RUN(true);
-		space.store(regs::stream::CTL0, ctl0);
+	// a converter that isn't bound would stay in the old format when the format is switched
+	if (bound_converter_count == sizeof(bound_converters) / sizeof(*bound_converters)) {
+		return false;
 	}
-	else {
-		if (ctl0 & sdctl0::RUN) {
-			ctl0 &= ~sdctl0::RUN;
-			space.store(regs::stream::CTL0, ctl0);
+	bound_converters[bound_converter_count++] = {codec, nid};
+	return true;
+}
+
+void UhdaStream::unbind_converter(UhdaCodec* codec, uint8_t nid) {
+	for (uint8_t i = 0; i < bound_converter_count; ++i) {
+		if (bound_converters[i].codec == codec && bound_converters[i].nid == nid) {
+			bound_converters[i] = bound_converters[--bound_converter_count];
+			return;
 		}
 	}
 }
 
-void UhdaStream::queue_data(const void* data, uint32_t* size) {
-	LockGuard guard {lock};
+void UhdaStream::queue_format_switch(
+	const UhdaStreamParams& new_params,
+	uint16_t new_format,
+	uint32_t new_byte_rate,
+	uint32_t new_frame_size) {
+	switch_params = new_params;
+	switch_format = new_format;
+	switch_byte_rate = new_byte_rate;
+	switch_frame_size = new_frame_size;
+	// the producer is the only one that moves the write position
+	switch_ring_pos = ring_buffer_write_pos;
+	format_switch = FormatSwitch::Pending;
+
+	arm_format_switch();
+}
 
-	auto ring_remaining = ring_buffer_size;
+void UhdaStream::arm_format_switch() {
+	// the refill work is writing data in the old format
+	if (fill_reserved) {
+		return;
+	}
+	if (ring_buffer && ring_buffer_read_pos != switch_ring_pos) {
+		return;
+	}
 
-	uint32_t to_copy = ring_buffer_capacity - ring_remaining;
-	if (*size < to_copy) {
-		to_copy = *size;
+	auto pos = get_pos() % buffer_size;
+	auto software_ahead = get_queued_ahead(pos);
+
+	// nothing is played in the old format anymore
+	if (!running && !software_ahead) {
+		skip_fill_pos(pos);
+		start_format_switch(pos);
+		return;
 	}
 
-	auto remaining_at_end = ring_buffer_capacity - ring_buffer_write_pos;
+	// the data in the old format is padded to the end of its period and followed by a period of silence,
+	// which is what the hardware plays in the old format before the irq stops it.
+	auto remainder = current_fill_pos % period_size;
+	uint32_t padding = remainder ? period_size - remainder : 0;
+	if (get_software_ahead(prev_irq_pos) + padding + period_size + STREAM_ALIGN >= buffer_size) {
+		return;
+	}
 
-	if (remaining_at_end >= to_copy) {
-		memcpy(
-			launder(static_cast<char*>(ring_buffer) + ring_buffer_write_pos),
-			data,
-			to_copy);
-		ring_buffer_write_pos += to_copy;
-		if (ring_buffer_write_pos == ring_buffer_capacity) {
-			ring_buffer_write_pos = 0;
-		}
+	if (!software_ahead) {
+		skip_fill_pos(pos);
 	}
-	else {
-		memcpy(
-			launder(static_cast<char*>(ring_buffer) + ring_buffer_write_pos),
-			data,
-			remaining_at_end);
+	fill_silence(padding);
+	switch_pos = current_fill_pos;
+	fill_silence(period_size);
+	format_switch = FormatSwitch::Armed;
+}
 
-		auto remaining = to_copy - remaining_at_end;
-		memcpy(
-			ring_buffer,
-			launder(static_cast<const char*>(data) + remaining_at_end),
-			remaining);
-		ring_buffer_write_pos = remaining;
-		if (ring_buffer_write_pos == ring_buffer_capacity) {
-			ring_buffer_write_pos = 0;
-		}
+void UhdaStream::start_format_switch(uint32_t pos) {
+	auto ctl0 = space.load(regs::stream::CTL0);
+	if (ctl0 & sdctl0::RUN) {
+		ctl0 &= ~sdctl0::RUN;
+		space.store(regs::stream::CTL0, ctl0);
 	}
 
-	ring_buffer_size += to_copy;
+	update_position(pos);
+	apply_switch_params();
+	space.store(regs::stream::FMT, format);
 
-	*size = to_copy;
+	if (!bound_converter_count) {
+		finish_format_switch();
+		return;
+	}
+
+	// the completions run once the controller lock is released, they take the stream lock
+	format_switch = FormatSwitch::Switching;
+	switch_batches_pending = bound_converter_count;
+	for (uint8_t i = 0; i < bound_converter_count; ++i) {
+		auto& converter = bound_converters[i];
+		switch_verbs[i] = Verb::make_long(converter.nid, cmd::SET_CONVERTER_FORMAT, format);
+
+		auto& batch = switch_batches[i];
+		batch = {};
+		batch.verbs = &switch_verbs[i];
+		batch.count = 1;
+		batch.fn = format_switch_done;
+		batch.arg = this;
+		batch.cid = converter.codec->cid;
+		converter.codec->controller->submit_batch(batch);
+	}
 }
 
-uint32_t UhdaStream::get_pos() const {
-	return *dma_pos;
+void UhdaStream::apply_switch_params() {
+	// the frame count stays monotonic, the bytes played so far are counted in frames of the new format
+	if (frame_size) {
+		position_total = position_total / frame_size * switch_frame_size;
+	}
+
+	params = switch_params;
+	format = switch_format;
+	// the data in the new format starts with a new frame
+	gain.channel = 0;
+	byte_rate = switch_byte_rate;
+	frame_size = switch_frame_size;
+	if (adaptive_latency && byte_rate) {
+		period_ticks = static_cast<uint32_t>(static_cast<uint64_t>(period_size) * 24000000 / byte_rate);
+	}
 }
 
-uint32_t UhdaStream::get_software_ahead(uint32_t pos) const {
-	uint32_t software_ahead;
-	if (current_fill_pos >= pos) {
-		software_ahead = current_fill_pos - pos;
+void UhdaStream::format_switch_done(void* arg, UhdaStatus status) {
+	auto* stream = static_cast<UhdaStream*>(arg);
+	if (status != UHDA_STATUS_SUCCESS) {
+		uhda_kernel_log("warning: failed to set the converter format for a format switch");
 	}
-	else {
-		software_ahead = BUFFER_SIZE - pos + current_fill_pos;
+
+	LockGuard guard {stream->lock};
+	if (!--stream->switch_batches_pending) {
+		stream->finish_format_switch();
 	}
-	return software_ahead;
 }
 
-void UhdaStream::ring_buffer_read(void* dest, size_t size) {
-	auto src_ptr = launder(static_cast<char*>(ring_buffer) + ring_buffer_read_pos);
-	auto dest_ptr = launder(static_cast<char*>(dest));
+void UhdaStream::finish_format_switch() {
+	format_switch = FormatSwitch::None;
+	if (running) {
+		// the time the stream was stopped doesn't count as an irq interval
+		last_irq_clock_valid = false;
+
+		auto ctl0 = space.load(regs::stream::CTL0);
+		ctl0 |= sdctl0::RUN(true);
+		space.store(regs::stream::CTL0, ctl0);
+	}
+}
+
+UhdaStatus UhdaStream::build_bdl() {
+	// one entry per period, split when a period crosses a page boundary.
+	uint32_t entries = 0;
+	for (uint32_t offset = 0; offset < buffer_size;) {
+		if (entries == MAX_DESCRIPTORS) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+
+		auto page_offset = offset % buffer_page_size;
+		auto period_end = (offset / period_size + 1) * period_size;
 
-	auto remaining_at_end = ring_buffer_capacity - ring_buffer_read_pos;
-	if (size <= remaining_at_end) {
-		memcpy(dest_ptr, src_ptr, size);
-		ring_buffer_read_pos += size;
-		if (ring_buffer_read_pos == ring_buffer_capacity) {
-			ring_buffer_read_pos = 0;
+		uint32_t size = period_end - offset;
+		if (size > buffer_page_size - page_offset) {
+			size = buffer_page_size - page_offset;
 		}
-		ring_buffer_size -= size;
+
+		bdl[entries].address = buffer_pages[offset / buffer_page_size].phys + page_offset;
+		bdl[entries].length = size;
+		bdl[entries].ioc = offset + size == period_end;
+		++entries;
+
+		offset += size;
 	}
-	else {
-		memcpy(dest_ptr, src_ptr, remaining_at_end);
-		memcpy(dest_ptr + remaining_at_end, ring_buffer, size - remaining_at_end);
 
-		ring_buffer_read_pos = size - remaining_at_end;
-		if (ring_buffer_read_pos == ring_buffer_capacity) {
-			ring_buffer_read_pos = 0;
+	bdl_entries = entries;
+	return UHDA_STATUS_SUCCESS;
+}
+
+void UhdaStream::destroy() {
+	// wait for a pending refill, it may be running on another cpu,
+	// and for the verbs of a format switch which point to the stream.
+	while (true) {
+		{
+			LockGuard guard {lock};
+			if (!refill_scheduled && !refill_running && format_switch != FormatSwitch::Switching) {
+				break;
+			}
 		}
-		ring_buffer_size -= size;
+		uhda_kernel_delay(10);
 	}
+
+	LockGuard guard {lock};
+
+	release_buffers();
+	format_switch = FormatSwitch::None;
+
+	space.store(regs::stream::CTL0, sdctl0::RST(true));
+	// todo maybe a timeout here,
+	// it's unlikely that the controller is broken at this point though.
+	while (!(space.load(regs::stream::CTL0) & sdctl0::RST));
+	space.store(regs::stream::CTL0, 0);
+	while (space.load(regs::stream::CTL0) & sdctl0::RST);
+
+	prev_irq_pos = 0;
+	current_fill_pos = 0;
+	ring_buffer_read_pos = 0;
+	ring_buffer_write_pos = 0;
+	running = false;
 }
 
-void UhdaStream::output_irq() {
-	auto pos = get_pos() % BUFFER_SIZE;
+void UhdaStream::release_buffers() {
+	if (mixer) {
+		mixer->~Mixer();
+		uhda_kernel_free(mixer, sizeof(Mixer));
+		mixer = nullptr;
+	}
 
-	auto software_ahead = get_software_ahead(pos);
+	if (converter) {
+		uhda_kernel_free(converter, sizeof(Converter));
+		converter = nullptr;
+	}
 
-	if (software_ahead > ALLOWED_SOFTWARE_AHEAD) {
-		prev_irq_pos = pos;
+	if (ring_buffer) {
+		if (spare_ring_buffer) {
+			uhda_kernel_free(spare_ring_buffer, spare_ring_buffer_capacity);
+		}
+		spare_ring_buffer = ring_buffer;
+		spare_ring_buffer_capacity = ring_buffer_capacity;
+		ring_buffer = nullptr;
+	}
+	ring_buffer_capacity = 0;
 
-		space.store(regs::stream::STS, sdsts::BCIS(true));
+	if (bdl) {
+		uhda_kernel_unmap(bdl, 0x1000);
+		uhda_kernel_deallocate_physical(bdl_phys, 0x1000);
+		bdl = nullptr;
+		bdl_phys = 0;
+	}
+	bdl_entries = 0;
+}
 
+void UhdaStream::free_pages() {
+	if (!buffer_pages) {
 		return;
 	}
 
-	uint32_t bytes_after_last_irq;
-	if (pos >= prev_irq_pos) {
-		bytes_after_last_irq = pos - prev_irq_pos;
+	for (uint32_t i = 0; i < buffer_page_count; ++i) {
+		uhda_kernel_unmap(buffer_pages[i].virt, buffer_page_size);
+		uhda_kernel_deallocate_physical(buffer_pages[i].phys, buffer_page_size);
 	}
-	else {
-		bytes_after_last_irq = BUFFER_SIZE - prev_irq_pos + pos;
+
+	uint32_t array_size = buffer_alloc_size / buffer_page_size;
+	uhda_kernel_free(buffer_pages, array_size * sizeof(BufferPage));
+
+	buffer_pages = nullptr;
+	buffer_page_count = 0;
+	buffer_page_size = 0;
+	buffer_alloc_size = 0;
+}
+
+void UhdaStream::free_buffers() {
+	release_buffers();
+	free_pages();
+
+	if (spare_ring_buffer) {
+		uhda_kernel_free(spare_ring_buffer, spare_ring_buffer_capacity);
+		spare_ring_buffer = nullptr;
+		spare_ring_buffer_capacity = 0;
 	}
+}
 
-	LockGuard guard {lock};
+char* UhdaStream::get_buffer_ptr(uint32_t offset, uint32_t* contiguous) const {
+	// a contiguous buffer is only split by its end
+	if (buffer_page_count == 1) {
+		*contiguous = buffer_size - offset;
+		return static_cast<char*>(buffer_pages[0].virt) + offset;
+	}
 
-	if (buffer_trip_threshold && ring_buffer_size < buffer_trip_threshold) {
-		buffer_trip_fn(buffer_trip_fn_arg, ring_buffer_size);
+	// otherwise the pages are always 0x1000 bytes
+	auto page_offset = offset & 0xFFF;
+
+	*contiguous = 0x1000 - page_offset;
+	if (*contiguous > buffer_size - offset) {
+		*contiguous = buffer_size - offset;
+	}
+
+	return static_cast<char*>(buffer_pages[offset >> 12].virt) + page_offset;
+}
+
+void UhdaStream::advance_fill_pos(uint32_t size) {
+	current_fill_pos += size;
+	if (current_fill_pos >= buffer_size) {
+		current_fill_pos -= buffer_size;
 	}
+}
 
-	for (uint32_t remaining = bytes_after_last_irq; remaining;) {
-		auto desc_index = current_fill_pos / 0x1000;
-		auto desc_offset = current_fill_pos % 0x1000;
-		auto desc_ptr = static_cast<char*>(buffer_pages[desc_index]) + desc_offset;
+void UhdaStream::skip_fill_pos(uint32_t pos) {
+	uint32_t skipped;
+	if (pos >= current_fill_pos) {
+		skipped = pos - current_fill_pos;
+	}
+	else {
+		skipped = buffer_size - current_fill_pos + pos;
+	}
 
-		uint32_t to_copy_desc = 0x1000 - desc_offset;
+	advance_fill_pos(skipped);
 
-		if (remaining < to_copy_desc) {
-			to_copy_desc = remaining;
+	// the hardware played whatever was in the buffer past the queued data
+	if (running && skipped) {
+		if (!client_starved) {
+			adapt_underrun = true;
 		}
+		++stats.underruns;
+		stats.silence_bytes += skipped;
+		UHDA_TRACEPOINT(UHDA_TRACE_UNDERRUN, get_trace_id(), skipped);
+	}
+
+	// the hardware position isn't necessarily at the start of a frame,
+	// the following data would end up in the wrong channels if part of a frame was skipped.
+	auto remainder = skipped % frame_size;
+	if (remainder) {
+		fill_silence(frame_size - remainder);
+	}
+}
+
+void UhdaStream::play(bool play) {
+	LockGuard guard {lock};
 
-		auto orig_to_copy = to_copy_desc;
+	auto ctl0 = space.load(regs::stream::CTL0);
+	if (play) {
+		if (ctl0 & sdctl0::RUN) {
+			return;
+		}
 
-		auto ring_buffer_available = ring_buffer_size;
-		if (ring_buffer_available >= to_copy_desc) {
-			ring_buffer_read(desc_ptr, to_copy_desc);
+		// input streams don't need anything written before starting,
+		// the wall clock is sampled so that the reads can be timestamped before the first irq.
+		if (!output) {
+			prev_irq_pos = get_pos() % buffer_size;
+			irq_wall_clock = controller_space.load(regs::WALCLK);
 		}
 		else {
-			if (ring_buffer_available) {
-				ring_buffer_read(desc_ptr, ring_buffer_available);
-				desc_ptr += ring_buffer_available;
-				to_copy_desc -= ring_buffer_available;
-				ring_buffer_available = 0;
+			auto pos = get_pos() % buffer_size;
+			auto software_ahead = get_queued_ahead(pos);
+			if (!software_ahead) {
+				skip_fill_pos(pos);
 			}
 
-			if (buffer_fill_fn) {
-				uint32_t can_copy = ring_buffer_capacity - ring_buffer_size;
-
-				auto remaining_at_end = ring_buffer_capacity - ring_buffer_write_pos;
-
-				if (remaining_at_end >= can_copy) {
-					auto copied = buffer_fill_fn(
-						buffer_fill_fn_arg,
-						launder(static_cast<char*>(ring_buffer) + ring_buffer_write_pos),
-						can_copy);
-					ring_buffer_write_pos += copied;
-					if (ring_buffer_write_pos == ring_buffer_capacity) {
-						ring_buffer_write_pos = 0;
-					}
-					ring_buffer_size += copied;
-				}
-				else {
-					auto copied = buffer_fill_fn(
-						buffer_fill_fn_arg,
-						launder(static_cast<char*>(ring_buffer) + ring_buffer_write_pos),
-						remaining_at_end);
-					can_copy -= copied;
-					ring_buffer_size += copied;
-
-					if (copied == remaining_at_end) {
-						ring_buffer_write_pos = 0;
-						copied = buffer_fill_fn(
-							buffer_fill_fn_arg,
-							ring_buffer,
-							can_copy);
-						ring_buffer_write_pos += copied;
-						if (ring_buffer_write_pos == ring_buffer_capacity) {
-							ring_buffer_write_pos = 0;
-						}
-						ring_buffer_size += copied;
-					}
-					else {
-						ring_buffer_write_pos += copied;
-					}
-				}
-			}
+			if (software_ahead < software_ahead_limit) {
+				auto allowed_copy = software_ahead_limit - software_ahead;
 
-			if (ring_buffer_available >= to_copy_desc) {
-				ring_buffer_read(desc_ptr, to_copy_desc);
-			}
-			else {
-				if (ring_buffer_available) {
-					ring_buffer_read(desc_ptr, ring_buffer_available);
-					desc_ptr += ring_buffer_available;
-					to_copy_desc -= ring_buffer_available;
+				auto to_copy = allowed_copy;
+				auto ring_size = get_ring_playable();
+				if (ring_size < allowed_copy) {
+					to_copy = ring_size;
 				}
 
-				memset(desc_ptr, 0, to_copy_desc);
+				copy_from_ring(to_copy);
+				allowed_copy -= to_copy;
+
+				// data queued later is written over the padding
+				auto fill_pos = current_fill_pos;
+				fill_silence(allowed_copy);
+				current_fill_pos = fill_pos;
 			}
 		}
 
-		remaining -= orig_to_copy;
+		dma_write_barrier();
 
-		current_fill_pos += orig_to_copy;
-		if (current_fill_pos == BUFFER_SIZE) {
-			current_fill_pos = 0;
+		// the stream is started once the converters have the new format
+		if (format_switch != FormatSwitch::Switching) {
+			ctl0 |= sdctl0::RUN(true);
+			space.store(regs::stream::CTL0, ctl0);
 		}
+		running = true;
+		// the time while the stream was paused doesn't count as an irq interval
+		last_irq_clock_valid = false;
+		// the prefill is silence until the fill function has been called
+		client_starved = buffer_fill_fn != nullptr;
 	}
-
-	prev_irq_pos = pos;
-
+	else {
+		running = false;
+		if (ctl0 & sdctl0::RUN) {
+			ctl0 &= ~sdctl0::RUN;
+			space.store(regs::stream::CTL0, ctl0);
+		}
+	}
+}
+
+void UhdaStream::queue_data(const void* data, uint32_t* size) {
+	if (!ring_buffer) {
+		LockGuard guard {lock};
+		if (converter) {
+			queue_converted(data, size);
+		}
+		else {
+			queue_data_direct(data, size);
+		}
+		return;
+	}
+
+	if (converter) {
+		queue_converted(data, size);
+		return;
+	}
+
+	// the ring buffer has a single producer, so this doesn't need the lock
+	uint32_t to_copy = ring_buffer_capacity - get_ring_size();
+	if (*size < to_copy) {
+		to_copy = *size;
+	}
+
+	auto write_offset = get_ring_offset(ring_buffer_write_pos);
+	auto remaining_at_end = ring_buffer_capacity - write_offset;
+
+	if (remaining_at_end >= to_copy) {
+		memcpy(
+			launder(static_cast<char*>(ring_buffer) + write_offset),
+			data,
+			to_copy);
+	}
+	else {
+		memcpy(
+			launder(static_cast<char*>(ring_buffer) + write_offset),
+			data,
+			remaining_at_end);
+		memcpy(
+			ring_buffer,
+			launder(static_cast<const char*>(data) + remaining_at_end),
+			to_copy - remaining_at_end);
+	}
+
+	ring_buffer_commit(to_copy);
+
+	*size = to_copy;
+}
+
+UhdaStatus UhdaStream::set_source_format(const UhdaStreamParams* source_params) {
+	if (converter) {
+		uhda_kernel_free(converter, sizeof(Converter));
+		converter = nullptr;
+	}
+
+	if (!source_params) {
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	auto* ptr = uhda_kernel_malloc(sizeof(Converter));
+	if (!ptr) {
+		return UHDA_STATUS_NO_MEMORY;
+	}
+
+	auto* new_converter = construct<Converter>(ptr);
+	auto status = new_converter->init(*source_params, params);
+	if (status != UHDA_STATUS_SUCCESS) {
+		uhda_kernel_free(ptr, sizeof(Converter));
+		return status;
+	}
+
+	converter = new_converter;
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus UhdaStream::create_virtual(uint32_t ring_size, UhdaVirtualStream** res) {
+	// allocated up front so that it isn't done with the lock held
+	auto* ptr = uhda_kernel_malloc(sizeof(Mixer));
+	if (!ptr) {
+		return UHDA_STATUS_NO_MEMORY;
+	}
+	auto* new_mixer = construct<Mixer>(ptr);
+
+	auto status = uhda_kernel_create_spinlock(&new_mixer->lock);
+	if (status != UHDA_STATUS_SUCCESS) {
+		new_mixer->lock = nullptr;
+		new_mixer->~Mixer();
+		uhda_kernel_free(ptr, sizeof(Mixer));
+		return status;
+	}
+
+	{
+		LockGuard guard {lock};
+
+		// the mixer writes to the dma buffer itself, so the stream has to be zero-copy
+		// and not have any other writers.
+		if (!bdl || ring_buffer || converter || (buffer_fill_fn && !mixer) ||
+			params.fmt == UHDA_FORMAT_PCM8 || params.fmt == UHDA_FORMAT_IEC61937) {
+			status = UHDA_STATUS_UNSUPPORTED;
+		}
+		else if (!mixer) {
+			new_mixer->sample_size = params.fmt == UHDA_FORMAT_PCM16 ? 2 : 4;
+			new_mixer->frame_size = frame_size;
+			mixer = new_mixer;
+			new_mixer = nullptr;
+
+			buffer_fill_fn = Mixer::fill;
+			buffer_fill_fn_arg = mixer;
+		}
+	}
+
+	if (new_mixer) {
+		new_mixer->~Mixer();
+		uhda_kernel_free(ptr, sizeof(Mixer));
+	}
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	return mixer->create_stream(ring_size, res);
+}
+
+bool UhdaStream::has_virtual_streams() {
+	LockGuard guard {lock};
+	if (!mixer) {
+		return false;
+	}
+
+	LockGuard mixer_guard {mixer->lock};
+	return mixer->streams.size();
+}
+
+void UhdaStream::queue_converted(const void* data, uint32_t* size) {
+	// the data is converted straight into the buffer, so it's only touched once.
+	// the free space of the ring buffer is split in at most two spans by its end,
+	// the dma buffer is split by the pages.
+	uint32_t consumed = 0;
+	while (true) {
+		void* ptr;
+		auto span = ring_buffer ? get_ring_write_span(&ptr) : get_write_span(&ptr);
+		if (!span) {
+			break;
+		}
+
+		uint32_t read;
+		auto written = converter->convert(
+			launder(static_cast<const char*>(data) + consumed),
+			*size - consumed,
+			&read,
+			ptr,
+			span);
+		consumed += read;
+
+		if (ring_buffer) {
+			ring_buffer_commit(written);
+		}
+		else {
+			UHDA_TRACEPOINT(UHDA_TRACE_DMA_WRITE, get_trace_id(), written);
+			commit_write(written);
+		}
+
+		if (written < span) {
+			break;
+		}
+	}
+
+	*size = consumed;
+}
+
+void UhdaStream::fill_silence(uint32_t size) {
+	UHDA_TRACEPOINT(UHDA_TRACE_DMA_WRITE, get_trace_id(), size);
+	while (size) {
+		uint32_t to_fill;
+		auto ptr = get_buffer_ptr(current_fill_pos, &to_fill);
+		if (size < to_fill) {
+			to_fill = size;
+		}
+
+		memset(ptr, 0, to_fill);
+		size -= to_fill;
+
+		advance_fill_pos(to_fill);
+	}
+}
+
+void UhdaStream::copy_from_ring(uint32_t size) {
+	while (size) {
+		uint32_t to_copy;
+		auto ptr = get_buffer_ptr(current_fill_pos, &to_copy);
+		if (size < to_copy) {
+			to_copy = size;
+		}
+		to_copy = get_copy_size(to_copy);
+		if (!to_copy) {
+			break;
+		}
+
+		ring_buffer_read(ptr, to_copy);
+		UHDA_TRACEPOINT(UHDA_TRACE_DMA_WRITE, get_trace_id(), to_copy);
+		size -= to_copy;
+
+		advance_fill_pos(to_copy);
+	}
+}
+
+UhdaStatus UhdaStream::set_gain(int volume, uint32_t ramp_us) {
+	if (volume < 0) {
+		volume = 0;
+	}
+	else if (volume > 100) {
+		volume = 100;
+	}
+
+	LockGuard guard {lock};
+
+	// the gain is applied when the data is copied into the dma buffer,
+	// the streams that are filled in place don't have a copy to do it in.
+	// the samples also can't be split by the end of the ring buffer.
+	if (!output || !bdl || params.fmt == UHDA_FORMAT_IEC61937 ||
+		(!ring_buffer && (buffer_fill_fn || converter)) ||
+		(ring_buffer && ring_buffer_capacity % (frame_size / params.channels))) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	auto ramp_frames = static_cast<uint64_t>(ramp_us) * params.sample_rate / 1000000;
+	if (ramp_frames > UINT32_MAX) {
+		ramp_frames = UINT32_MAX;
+	}
+	gain.set(static_cast<int32_t>(static_cast<int64_t>(Gain::UNITY) * volume / 100), static_cast<uint32_t>(ramp_frames));
+	return UHDA_STATUS_SUCCESS;
+}
+
+uint32_t UhdaStream::get_copy_size(uint32_t size) const {
+	if (gain.is_unity()) {
+		return size;
+	}
+
+	auto sample_size = frame_size / params.channels;
+	return size - size % sample_size;
+}
+
+uint32_t UhdaStream::get_queued_ahead(uint32_t pos) const {
+	uint32_t bytes_after_last_irq;
+	if (pos >= prev_irq_pos) {
+		bytes_after_last_irq = pos - prev_irq_pos;
+	}
+	else {
+		bytes_after_last_irq = buffer_size - prev_irq_pos + pos;
+	}
+
+	// data can be queued almost a full buffer ahead so a software position
+	// behind the hardware one can only be detected relative to the last irq.
+	auto software_ahead = get_software_ahead(prev_irq_pos);
+	if (bytes_after_last_irq >= software_ahead) {
+		return 0;
+	}
+	return software_ahead - bytes_after_last_irq;
+}
+
+uint32_t UhdaStream::get_write_span(void** ptr) {
+	// the refill work is writing to the buffer or the data written now would be
+	// in the new format of a switch that doesn't have its place in the buffer yet.
+	if (fill_reserved || format_switch == FormatSwitch::Pending) {
+		*ptr = nullptr;
+		return 0;
+	}
+
+	auto pos = get_pos() % buffer_size;
+	// the hardware went past everything the client had written
+	if (!get_queued_ahead(pos)) {
+		skip_fill_pos(pos);
+	}
+
+	// the queued data is tracked relative to the last irq position, keep a gap
+	// between it and the software position so that a full buffer can't be confused
+	// with an empty one.
+	auto queued = get_software_ahead(prev_irq_pos);
+	if (queued + STREAM_ALIGN >= buffer_size) {
+		*ptr = nullptr;
+		return 0;
+	}
+
+	uint32_t contiguous;
+	*ptr = get_buffer_ptr(current_fill_pos, &contiguous);
+
+	uint32_t span = buffer_size - STREAM_ALIGN - queued;
+	if (span > contiguous) {
+		span = contiguous;
+	}
+	return span;
+}
+
+void UhdaStream::commit_write(uint32_t size) {
+	dma_write_barrier();
+	advance_fill_pos(size);
+}
+
+void UhdaStream::queue_data_direct(const void* data, uint32_t* size) {
+	uint32_t written = 0;
+	while (written < *size) {
+		void* ptr;
+		auto span = get_write_span(&ptr);
+		if (!span) {
+			break;
+		}
+
+		if (span > *size - written) {
+			span = *size - written;
+		}
+		span = get_copy_size(span);
+		if (!span) {
+			break;
+		}
+
+		auto* src = launder(static_cast<const char*>(data) + written);
+		if (gain.is_unity()) {
+			copy_to_dma(ptr, src, span);
+		}
+		else {
+			gain.apply(ptr, src, span, params.fmt, params.channels);
+		}
+		UHDA_TRACEPOINT(UHDA_TRACE_DMA_WRITE, get_trace_id(), span);
+		commit_write(span);
+		written += span;
+	}
+
+	*size = written;
+}
+
+void UhdaStream::zero_copy_irq(uint32_t pos, uint32_t limit, bool call_client) {
+	if (format_switch == FormatSwitch::Pending) {
+		arm_format_switch();
+	}
+
+	auto software_ahead = get_queued_ahead(pos);
+	if (!software_ahead && !fill_reserved) {
+		skip_fill_pos(pos);
+	}
+
+	if (call_client && buffer_trip_threshold && software_ahead < buffer_trip_threshold) {
+		buffer_trip_fn(buffer_trip_fn_arg, software_ahead);
+	}
+
+	FillTime fill_time {};
+	while (call_client && buffer_fill_fn && software_ahead < limit) {
+		void* ptr;
+		auto span = get_write_span(&ptr);
+		if (span > limit - software_ahead) {
+			span = limit - software_ahead;
+		}
+		if (!span) {
+			break;
+		}
+
+		auto written = call_buffer_fill(ptr, span, fill_time);
+		commit_write(written);
+		software_ahead += written;
+
+		if (written < span) {
+			break;
+		}
+	}
+	record_fill(fill_time);
+
+	// the client is running late, make sure that the hardware plays silence
+	// instead of whatever was left in the buffer from the previous lap.
+	// the position isn't advanced so the client can still write over it,
+	// a span that is being filled by the refill work is skipped.
+	if (software_ahead + fill_reserved < limit) {
+		auto fill_pos = current_fill_pos;
+		advance_fill_pos(fill_reserved);
+		fill_silence(limit - software_ahead - fill_reserved);
+		current_fill_pos = fill_pos;
+	}
+}
+
+void UhdaStream::ring_irq(uint32_t pos, uint32_t limit, bool call_client) {
+	auto software_ahead = get_queued_ahead(pos);
+	// the hardware went past everything that was queued, continue right after it
+	if (!software_ahead) {
+		skip_fill_pos(pos);
+	}
+
+	if (call_client && buffer_trip_threshold) {
+		auto ring_size = get_ring_size();
+		if (ring_size < buffer_trip_threshold) {
+			buffer_trip_fn(buffer_trip_fn_arg, ring_size);
+		}
+	}
+
+	uint32_t to_fill = 0;
+	if (software_ahead < limit) {
+		to_fill = limit - software_ahead;
+	}
+
+	if (to_fill) {
+		auto ring_size = get_ring_size();
+		if (call_client && ring_size < to_fill && buffer_fill_fn) {
+			FillTime fill_time {};
+			refill_ring(fill_time);
+			record_fill(fill_time);
+			ring_size = get_ring_size();
+		}
+
+		ring_size = get_ring_playable();
+		auto to_copy = to_fill;
+		if (ring_size < to_copy) {
+			to_copy = ring_size;
+		}
+		copy_from_ring(to_copy);
+		to_fill -= to_copy;
+
+		// not enough data is queued, make sure that the hardware plays silence
+		// instead of whatever was left in the buffer from the previous lap.
+		// the position isn't advanced so that the data queued later isn't delayed.
+		if (to_fill) {
+			auto fill_pos = current_fill_pos;
+			fill_silence(to_fill);
+			current_fill_pos = fill_pos;
+		}
+	}
+
+	if (format_switch == FormatSwitch::Pending) {
+		arm_format_switch();
+	}
+}
+
+uint32_t UhdaStream::get_pos() const {
+	return *dma_pos;
+}
+
+uint32_t UhdaStream::get_software_ahead(uint32_t pos) const {
+	uint32_t software_ahead;
+	if (current_fill_pos >= pos) {
+		software_ahead = current_fill_pos - pos;
+	}
+	else {
+		software_ahead = buffer_size - pos + current_fill_pos;
+	}
+	return software_ahead;
+}
+
+uint32_t UhdaStream::get_remaining() const {
+	if (ring_buffer) {
+		return get_ring_size();
+	}
+
+	LockGuard guard {lock};
+	// nothing is queued on a stream that isn't set up
+	if (!bdl) {
+		return 0;
+	}
+	if (output) {
+		return get_queued_ahead(get_pos() % buffer_size);
+	}
+	else {
+		return get_captured(get_pos() % buffer_size);
+	}
+}
+
+void UhdaStream::update_position(uint32_t pos) const {
+	if (pos >= position_last) {
+		position_total += pos - position_last;
+	}
+	else {
+		position_total += buffer_size - position_last + pos;
+	}
+	position_last = pos;
+}
+
+void UhdaStream::get_position(UhdaStreamPosition* position) const {
+	// the position buffer is updated when the dma engine moves data from or to memory,
+	// the link position is where the data is on the link so the difference
+	// between them is what is buffered in the controller's fifo.
+	auto pos = get_pos() % buffer_size;
+	auto link_pos = space.load(regs::stream::LPIB) % buffer_size;
+	auto wall_clock = controller_space.load(regs::WALCLK);
+
+	update_position(pos);
+
+	// the link position is within a fifo of the dma position, anything further away
+	// is a stale position that wasn't updated yet.
+	uint32_t fifo;
+	if (output) {
+		fifo = pos >= link_pos ? pos - link_pos : buffer_size - link_pos + pos;
+	}
+	else {
+		fifo = link_pos >= pos ? link_pos - pos : buffer_size - pos + link_pos;
+	}
+	if (fifo >= period_size) {
+		fifo = 0;
+	}
+
+	uint64_t bytes;
+	uint64_t queued;
+	if (output) {
+		bytes = position_total > fifo ? position_total - fifo : 0;
+		queued = get_queued_ahead(pos) + fifo;
+		if (ring_buffer) {
+			queued += get_ring_size();
+		}
+	}
+	else {
+		bytes = position_total + fifo;
+		queued = get_captured(pos);
+	}
+
+	position->frames = frame_size ? bytes / frame_size : 0;
+	position->queued_frames = frame_size ? static_cast<uint32_t>(queued / frame_size) : 0;
+	position->wall_clock = wall_clock;
+}
+
+uint32_t UhdaStream::get_captured(uint32_t pos) const {
+	// the irq drops the oldest data before the hardware can get a full buffer ahead
+	// of the read position, so the distance between them can't wrap around.
+	if (pos >= current_fill_pos) {
+		return pos - current_fill_pos;
+	}
+	else {
+		return buffer_size - current_fill_pos + pos;
+	}
+}
+
+uint32_t UhdaStream::get_read_span(const void** ptr) {
+	auto captured = get_captured(get_pos() % buffer_size);
+
+	uint32_t contiguous;
+	*ptr = get_buffer_ptr(current_fill_pos, &contiguous);
+
+	if (captured > contiguous) {
+		captured = contiguous;
+	}
+	return captured;
+}
+
+uint32_t UhdaStream::get_read_timestamp() const {
+	if (!byte_rate) {
+		return irq_wall_clock;
+	}
+
+	auto pos = get_pos() % buffer_size;
+
+	uint32_t bytes_after_last_irq;
+	if (pos >= prev_irq_pos) {
+		bytes_after_last_irq = pos - prev_irq_pos;
+	}
+	else {
+		bytes_after_last_irq = buffer_size - prev_irq_pos + pos;
+	}
+
+	// the read position can be on either side of the position sampled in the irq
+	auto delta = static_cast<int64_t>(bytes_after_last_irq) - get_captured(pos);
+
+	// the wall clock runs at 24 MHz
+	auto ticks = delta * 24000000 / byte_rate;
+	return irq_wall_clock + static_cast<uint32_t>(ticks);
+}
+
+uint32_t UhdaStream::get_ring_size() const {
+	// acquire pairs with the release in the commit of the other side
+	auto write_pos = __atomic_load_n(&ring_buffer_write_pos, __ATOMIC_ACQUIRE);
+	auto read_pos = __atomic_load_n(&ring_buffer_read_pos, __ATOMIC_ACQUIRE);
+	if (write_pos >= read_pos) {
+		return write_pos - read_pos;
+	}
+	else {
+		return 2 * ring_buffer_capacity - read_pos + write_pos;
+	}
+}
+
+uint32_t UhdaStream::get_ring_playable() const {
+	auto ring_size = get_ring_size();
+	if (format_switch != FormatSwitch::Pending) {
+		return ring_size;
+	}
+
+	auto before_switch = switch_ring_pos >= ring_buffer_read_pos
+		? switch_ring_pos - ring_buffer_read_pos
+		: 2 * ring_buffer_capacity - ring_buffer_read_pos + switch_ring_pos;
+	return before_switch < ring_size ? before_switch : ring_size;
+}
+
+uint32_t UhdaStream::get_ring_offset(uint32_t pos) const {
+	return pos >= ring_buffer_capacity ? pos - ring_buffer_capacity : pos;
+}
+
+void UhdaStream::ring_buffer_commit(uint32_t size) {
+	auto pos = ring_buffer_write_pos + size;
+	if (pos >= 2 * ring_buffer_capacity) {
+		pos -= 2 * ring_buffer_capacity;
+	}
+	// publishes the data written before it to the consumer
+	__atomic_store_n(&ring_buffer_write_pos, pos, __ATOMIC_RELEASE);
+}
+
+void UhdaStream::ring_buffer_read(void* dest, size_t size) {
+	auto read_offset = get_ring_offset(ring_buffer_read_pos);
+	auto src_ptr = launder(static_cast<char*>(ring_buffer) + read_offset);
+	auto dest_ptr = launder(static_cast<char*>(dest));
+
+	auto remaining_at_end = ring_buffer_capacity - read_offset;
+	if (!gain.is_unity()) {
+		auto first = size <= remaining_at_end ? size : remaining_at_end;
+		gain.apply(dest_ptr, src_ptr, static_cast<uint32_t>(first), params.fmt, params.channels);
+		if (size > first) {
+			gain.apply(dest_ptr + first, ring_buffer, static_cast<uint32_t>(size - first), params.fmt, params.channels);
+		}
+	}
+	else if (size <= remaining_at_end) {
+		copy_to_dma(dest_ptr, src_ptr, size);
+	}
+	else {
+		copy_to_dma(dest_ptr, src_ptr, remaining_at_end);
+		copy_to_dma(dest_ptr + remaining_at_end, ring_buffer, size - remaining_at_end);
+	}
+
+	auto pos = ring_buffer_read_pos + size;
+	if (pos >= 2 * ring_buffer_capacity) {
+		pos -= 2 * ring_buffer_capacity;
+	}
+	// the producer can write over the data after this
+	__atomic_store_n(&ring_buffer_read_pos, pos, __ATOMIC_RELEASE);
+}
+
+uint32_t UhdaStream::get_ring_write_span(void** ptr) const {
+	auto write_offset = get_ring_offset(ring_buffer_write_pos);
+	*ptr = launder(static_cast<char*>(ring_buffer) + write_offset);
+
+	uint32_t span = ring_buffer_capacity - get_ring_size();
+	if (span > ring_buffer_capacity - write_offset) {
+		span = ring_buffer_capacity - write_offset;
+	}
+	return span;
+}
+
+void UhdaStream::refill_ring(FillTime& time) {
+	// the free space is at most split in two at the end of the ring
+	for (int i = 0; i < 2; ++i) {
+		void* ptr;
+		auto span = get_ring_write_span(&ptr);
+		if (!span) {
+			break;
+		}
+
+		auto copied = call_buffer_fill(ptr, span, time);
+		ring_buffer_commit(copied);
+
+		if (copied < span) {
+			break;
+		}
+	}
+}
+
+uint32_t UhdaStream::call_buffer_fill(void* ptr, uint32_t size, FillTime& time) {
+	auto start = controller_space.load(regs::WALCLK);
+	auto written = buffer_fill_fn(buffer_fill_fn_arg, ptr, size);
+	auto elapsed = controller_space.load(regs::WALCLK) - start;
+
+	++time.calls;
+	time.short_fill = written < size;
+	time.total += elapsed;
+	if (elapsed > time.max) {
+		time.max = elapsed;
+	}
+
+	if (written > size) {
+		written = size;
+	}
+	// the mixer is the fill function of its stream, it sums the virtual streams straight into the buffer
+	if (mixer) {
+		UHDA_TRACEPOINT(UHDA_TRACE_DMA_WRITE, get_trace_id(), written);
+	}
+	return written;
+}
+
+void UhdaStream::record_fill(const FillTime& time) {
+	if (!time.calls) {
+		return;
+	}
+
+	client_starved = time.short_fill;
+	stats.callback_count += time.calls;
+	stats.callback_time += time.total;
+	if (time.max > stats.max_callback_time) {
+		stats.max_callback_time = time.max;
+	}
+
+	UHDA_TRACEPOINT(UHDA_TRACE_FILL, get_trace_id(), time.total);
+}
+
+void UhdaStream::record_irq(uint32_t wall_clock, uint32_t pos) {
+	++stats.irq_count;
+
+	uint32_t interval;
+	if (last_irq_clock_valid) {
+		interval = wall_clock - last_irq_clock;
+		if (!stats.min_irq_interval || interval < stats.min_irq_interval) {
+			stats.min_irq_interval = interval;
+		}
+		if (interval > stats.max_irq_interval) {
+			stats.max_irq_interval = interval;
+		}
+	}
+	else {
+		interval = 0;
+	}
+	last_irq_clock = wall_clock;
+	last_irq_clock_valid = running;
+
+	if (adaptive_latency && interval) {
+		adapt_latency(interval);
+	}
+
+	UHDA_TRACEPOINT(UHDA_TRACE_STREAM_IRQ, get_trace_id(), pos);
+}
+
+void UhdaStream::adapt_latency(uint32_t interval) {
+	if (interval > period_ticks && interval - period_ticks > max_irq_lateness) {
+		max_irq_lateness = interval - period_ticks;
+	}
+
+	// never go back to a latency that underran
+	if (adapt_underrun) {
+		adapt_underrun = false;
+		min_refill_low = refill_low + frame_size < max_refill_low ? refill_low + frame_size : max_refill_low;
+		set_refill_low(refill_low > max_refill_low / 2 ? max_refill_low : 2 * refill_low);
+		max_irq_lateness = 0;
+		adapt_irqs = 0;
+		return;
+	}
+
+	// the next irq can be late by as much as the latest one seen, keep twice that as a margin
+	uint64_t lateness = static_cast<uint64_t>(max_irq_lateness) * byte_rate / 24000000;
+	uint64_t needed = period_size + 2 * lateness;
+	if (needed > refill_low) {
+		set_refill_low(needed > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(needed));
+		adapt_irqs = 0;
+	}
+	else if (++adapt_irqs >= ADAPT_WINDOW) {
+		// lower the latency gradually, the jitter is measured again for the next window
+		set_refill_low(static_cast<uint32_t>((refill_low + needed) / 2));
+		max_irq_lateness = 0;
+		adapt_irqs = 0;
+	}
+}
+
+void UhdaStream::set_refill_low(uint32_t low) {
+	if (low < min_refill_low) {
+		low = min_refill_low;
+	}
+	else if (low > max_refill_low) {
+		low = max_refill_low;
+	}
+
+	refill_low = low;
+	software_ahead_limit = low + period_size;
+}
+
+uint32_t UhdaStream::get_trace_id() const {
+	return index | (output ? 0x100 : 0);
+}
+
+void UhdaStream::output_irq() {
+	auto pos = get_pos() % buffer_size;
+	auto wall_clock = controller_space.load(regs::WALCLK);
+
+	LockGuard guard {lock};
+	record_irq(wall_clock, pos);
+
+	// the irq of the period that ends at the switch position, the hardware is already playing the silence after it
+	if (format_switch == FormatSwitch::Armed) {
+		auto to_switch = switch_pos >= prev_irq_pos
+			? switch_pos - prev_irq_pos
+			: buffer_size - prev_irq_pos + switch_pos;
+		auto moved = pos >= prev_irq_pos ? pos - prev_irq_pos : buffer_size - prev_irq_pos + pos;
+		if (to_switch <= moved + period_size / 2) {
+			start_format_switch(pos);
+		}
+	}
+
+	if (deferred_fill) {
+		// only fill what is needed until the refill work runs, without calling the client
+		auto limit = 2 * period_size;
+		if (limit > software_ahead_limit) {
+			limit = software_ahead_limit;
+		}
+
+		if (ring_buffer) {
+			ring_irq(pos, limit, false);
+		}
+		else {
+			zero_copy_irq(pos, limit, false);
+		}
+
+		// zero-copy streams don't need the client until the queued data drops below the low watermark
+		bool need_refill = ring_buffer || get_queued_ahead(pos) < refill_low;
+		if (need_refill && !refill_scheduled && !refill_running) {
+			if (uhda_kernel_schedule_work(refill_work, this) == UHDA_STATUS_SUCCESS) {
+				refill_scheduled = true;
+			}
+			else {
+				// fall back to filling the buffer in the irq
+				deferred_fill = false;
+			}
+		}
+	}
+
+	if (!deferred_fill) {
+		// the refill work from before deferral was turned off may still be calling the client without the lock
+		bool call_client = !refill_scheduled && !refill_running;
+		if (ring_buffer) {
+			ring_irq(pos, software_ahead_limit, call_client);
+		}
+		else {
+			auto limit = get_queued_ahead(pos) < refill_low ? software_ahead_limit : 0;
+			zero_copy_irq(pos, limit, call_client);
+		}
+	}
+
+	dma_write_barrier();
+
+	prev_irq_pos = pos;
+	update_position(pos);
+
 	space.store(regs::stream::STS, sdsts::BCIS(true));
 }
+
+void UhdaStream::input_irq() {
+	auto pos = get_pos() % buffer_size;
+	auto wall_clock = controller_space.load(regs::WALCLK);
+
+	uint32_t captured;
+	{
+		LockGuard guard {lock};
+		record_irq(wall_clock, pos);
+
+		// the hardware writes the next period over the oldest data if it hasn't been read,
+		// drop it now so that a read doesn't return a mix of two laps.
+		// a period is kept free for the irq latency on top of the period being written.
+		captured = get_captured(pos);
+		auto max_captured = buffer_size - 2 * period_size;
+		if (captured > max_captured) {
+			auto dropped = captured - max_captured;
+			advance_fill_pos(dropped);
+			captured = max_captured;
+
+			++stats.overruns;
+			stats.dropped_bytes += dropped;
+			UHDA_TRACEPOINT(UHDA_TRACE_OVERRUN, get_trace_id(), dropped);
+		}
+
+		prev_irq_pos = pos;
+		irq_wall_clock = wall_clock;
+		update_position(pos);
+
+		space.store(regs::stream::STS, sdsts::BCIS(true));
+	}
+
+	// called without the lock so that the client can read the data from the callback
+	if (buffer_trip_threshold && captured >= buffer_trip_threshold) {
+		buffer_trip_fn(buffer_trip_fn_arg, captured);
+	}
+}
+
+void UhdaStream::refill_work(void* arg) {
+	auto* stream = static_cast<UhdaStream*>(arg);
+	stream->deferred_refill();
+}
+
+void UhdaStream::deferred_refill() {
+	uint32_t remaining;
+	{
+		LockGuard guard {lock};
+		refill_scheduled = false;
+		if (!bdl) {
+			return;
+		}
+		refill_running = true;
+
+		if (ring_buffer) {
+			remaining = get_ring_size();
+		}
+		else {
+			remaining = get_queued_ahead(get_pos() % buffer_size);
+		}
+	}
+
+	// the client callbacks are run without the lock so that they don't delay the irqs.
+	if (buffer_trip_threshold && remaining < buffer_trip_threshold) {
+		buffer_trip_fn(buffer_trip_fn_arg, remaining);
+	}
+
+	// the time is recorded once the lock is taken at the end
+	FillTime fill_time {};
+	if (ring_buffer) {
+		// this is the only producer of the ring buffer, it doesn't need the lock
+		if (buffer_fill_fn) {
+			refill_ring(fill_time);
+		}
+	}
+	else {
+		// the span that is being filled is reserved so that nothing else writes to it meanwhile
+		while (buffer_fill_fn) {
+			void* ptr;
+			uint32_t span;
+			{
+				LockGuard guard {lock};
+
+				auto software_ahead = get_queued_ahead(get_pos() % buffer_size);
+				span = software_ahead < software_ahead_limit ? get_write_span(&ptr) : 0;
+				if (span > software_ahead_limit - software_ahead) {
+					span = software_ahead_limit - software_ahead;
+				}
+
+				fill_reserved = span;
+			}
+
+			if (!span) {
+				break;
+			}
+
+			auto written = call_buffer_fill(ptr, span, fill_time);
+
+			{
+				LockGuard guard {lock};
+				fill_reserved = 0;
+				commit_write(written);
+			}
+
+			if (written < span) {
+				break;
+			}
+		}
+	}
+
+	LockGuard guard {lock};
+	record_fill(fill_time);
+
+	if (ring_buffer) {
+		ring_irq(get_pos() % buffer_size, software_ahead_limit, false);
+	}
+	else {
+		zero_copy_irq(get_pos() % buffer_size, software_ahead_limit, false);
+	}
+
+	dma_write_barrier();
+
+	refill_running = false;
+}
@@ -2,25 +2,146 @@
 #include "reg.hpp"
 #include "uhda/types.h"
 #include "spec.hpp"
+#include "verb.hpp"
+#include "gain.hpp"
+
+namespace uhda {
+	struct BufferPage {
+		void* virt;
+		uintptr_t phys;
+	};
+
+	struct Converter;
+	struct Mixer;
+
+	// time spent in the buffer fill function, collected without the lock if needed
+	struct FillTime {
+		uint32_t calls;
+		uint32_t total;
+		uint32_t max;
+		// the last call returned less than it was asked for
+		bool short_fill;
+	};
+
+	// a converter that a path setup connected to the stream
+	struct BoundConverter {
+		UhdaCodec* codec;
+		uint8_t nid;
+	};
+
+	enum class FormatSwitch : uint8_t {
+		None,
+		// waiting for the data in the old format to be queued to the dma buffer
+		Pending,
+		// waiting for the hardware to reach `switch_pos`
+		Armed,
+		// the stream is stopped until the converters have the new format
+		Switching
+	};
+}
 
 struct UhdaStream {
 	~UhdaStream();
 
-	UhdaStatus setup(uint32_t buffer_size);
+	UhdaStatus setup(uint32_t ring_size, UhdaStreamBufferParams* params, uint32_t byte_rate);
+	void program_registers();
+	// reprograms the stream after a controller reset and optionally restarts it if it was running
+	void resume(bool restart);
 	void destroy();
 
 	void play(bool play);
 
 	void queue_data(const void* data, uint32_t* size);
+	UhdaStatus set_source_format(const UhdaStreamParams* params);
+	// converts the data while writing it to the ring buffer or the dma buffer
+	void queue_converted(const void* data, uint32_t* size);
+	UhdaStatus create_virtual(uint32_t ring_size, UhdaVirtualStream** res);
+	[[nodiscard]] bool has_virtual_streams();
+	UhdaStatus set_gain(int volume, uint32_t ramp_us);
+	// the size of the data that can be copied at once, the gain is applied to whole samples only
+	[[nodiscard]] uint32_t get_copy_size(uint32_t size) const;
+
+	[[nodiscard]] uint32_t get_queued_ahead(uint32_t pos) const;
+	[[nodiscard]] uint32_t get_write_span(void** ptr);
+	void commit_write(uint32_t size);
+	void queue_data_direct(const void* data, uint32_t* size);
+	void fill_silence(uint32_t size);
+	void copy_from_ring(uint32_t size);
+
+	[[nodiscard]] char* get_buffer_ptr(uint32_t offset, uint32_t* contiguous) const;
+	void advance_fill_pos(uint32_t size);
+	// moves the fill position up to the hardware position after it went past everything that was written
+	void skip_fill_pos(uint32_t pos);
 
 	[[nodiscard]] uint32_t get_pos() const;
 	[[nodiscard]] uint32_t get_software_ahead(uint32_t pos) const;
+	[[nodiscard]] uint32_t get_remaining() const;
+	// adds the distance the hardware moved since the last call to `position_total`,
+	// this has to be called at least once per lap around the buffer.
+	void update_position(uint32_t pos) const;
+	void get_position(UhdaStreamPosition* position) const;
+
+	// the read position of input streams is kept in `current_fill_pos`
+	[[nodiscard]] uint32_t get_captured(uint32_t pos) const;
+	[[nodiscard]] uint32_t get_read_span(const void** ptr);
+	[[nodiscard]] uint32_t get_read_timestamp() const;
 
+	// the ring buffer has a single producer and a single consumer
+	[[nodiscard]] uint32_t get_ring_size() const;
+	[[nodiscard]] uint32_t get_ring_offset(uint32_t pos) const;
+	[[nodiscard]] uint32_t get_ring_write_span(void** ptr) const;
+	void ring_buffer_commit(uint32_t size);
+	// copies the next `size` bytes of the ring buffer into the dma buffer
 	void ring_buffer_read(void* dest, size_t size);
+	void refill_ring(uhda::FillTime& time);
+
+	// calls `buffer_fill_fn` and measures the time spent in it
+	uint32_t call_buffer_fill(void* ptr, uint32_t size, uhda::FillTime& time);
+	// these must be called with the lock held
+	void record_fill(const uhda::FillTime& time);
+	void record_irq(uint32_t wall_clock, uint32_t pos);
+	// adjusts the adaptive latency after an irq that came `interval` ticks after the previous one
+	void adapt_latency(uint32_t interval);
+	void set_refill_low(uint32_t low);
+	[[nodiscard]] uint32_t get_trace_id() const;
 
 	void output_irq();
+	void input_irq();
+	// fill the buffer up to `limit` bytes ahead of the hardware, with the lock held
+	void zero_copy_irq(uint32_t pos, uint32_t limit, bool call_client);
+	void ring_irq(uint32_t pos, uint32_t limit, bool call_client);
+	static void refill_work(void* arg);
+	void deferred_refill();
+
+	// a converter is bound to the stream it was last set up for until its path is shut down
+	[[nodiscard]] bool bind_converter(UhdaCodec* codec, uint8_t nid);
+	void unbind_converter(UhdaCodec* codec, uint8_t nid);
+	// the data queued after this is in the new format, the channel count has to stay the same
+	void queue_format_switch(
+		const UhdaStreamParams& new_params,
+		uint16_t new_format,
+		uint32_t new_byte_rate,
+		uint32_t new_frame_size);
+	// these must be called with the lock held
+	void arm_format_switch();
+	void start_format_switch(uint32_t pos);
+	void apply_switch_params();
+	void finish_format_switch();
+	static void format_switch_done(void* arg, UhdaStatus status);
+	// the part of the ring that can be copied to the dma buffer before a pending format switch
+	[[nodiscard]] uint32_t get_ring_playable() const;
+
+	UhdaStatus allocate_buffer();
+	UhdaStatus build_bdl();
+	// frees everything but the dma buffer and the ring buffer, which are kept for the next setup
+	void release_buffers();
+	void free_pages();
+	void free_buffers();
 
 	uhda::MemSpace space {0};
+	// used to read the wall clock
+	uhda::MemSpace controller_space {0};
+	UhdaController* controller {};
 	UhdaBufferFillFn buffer_fill_fn {};
 	void* buffer_fill_fn_arg {};
 	UhdaBufferTripFn buffer_trip_fn {};
@@ -29,18 +150,90 @@ struct UhdaStream {
 	uintptr_t bdl_phys {};
 	uhda::BufferDescriptor* bdl {};
 
-	void** buffer_pages {};
+	uhda::BufferPage* buffer_pages {};
+	uint32_t buffer_page_count {};
+	uint32_t buffer_page_size {};
+	// total size of the pages, which can be larger than the buffer if they were kept from a previous setup
+	uint32_t buffer_alloc_size {};
+	uint32_t buffer_size {};
+	uint32_t period_size {};
+	uint32_t period_count {};
+	uint32_t bdl_entries {};
+	uint32_t software_ahead_limit {};
+	// zero-copy streams only call the client once less than `refill_low` bytes are queued,
+	// without adaptive latency this is the same as `software_ahead_limit`.
+	uint32_t refill_low {};
+	// the adaptive latency stays between these, the floor is raised to the latency that underran
+	uint32_t min_refill_low {};
+	uint32_t max_refill_low {};
+	// the wall clock ticks one period takes to play
+	uint32_t period_ticks {};
+	// the longest irq delay seen since the latency was last lowered
+	uint32_t max_irq_lateness {};
+	uint32_t adapt_irqs {};
+	UhdaStreamParams params {};
+	uint32_t byte_rate {};
+	// protected by the lock
+	uhda::Gain gain {};
+	uint32_t frame_size {};
+	// bytes moved by the dma engine since the stream was set up, counted from `position_last`
+	mutable uint64_t position_total {};
+	mutable uint32_t position_last {};
+	// the wall clock sampled together with `prev_irq_pos` when an input stream is started and in its irq
+	uint32_t irq_wall_clock {};
+	UhdaStreamStats stats {};
+	// the wall clock in the previous irq while the stream has been running
+	uint32_t last_irq_clock {};
+	// size of the span the refill work is filling without the lock held
+	uint32_t fill_reserved {};
+	// converts the data queued by the client to `params`, owned by the producer
+	uhda::Converter* converter {};
+	// mixes the virtual streams into the dma buffer as the `buffer_fill_fn`
+	uhda::Mixer* mixer {};
 	void* ring_buffer {};
 	uint32_t ring_buffer_capacity {};
-	uint32_t ring_buffer_size {};
+	// the ring buffer of the previous setup
+	void* spare_ring_buffer {};
+	uint32_t spare_ring_buffer_capacity {};
 	uint32_t prev_irq_pos {};
 	uint32_t current_fill_pos {};
+	// the positions run from zero to twice the capacity so that a full ring can be told apart from an empty one,
+	// the write position is only stored by the producer and the read position by the irq.
 	uint32_t ring_buffer_write_pos {};
 	uint32_t ring_buffer_read_pos {};
 	volatile uint32_t* dma_pos {};
 
+	// the converters are reprogrammed when the format is switched
+	uhda::BoundConverter bound_converters[8] {};
+	uhda::Verb switch_verbs[8] {};
+	uhda::VerbBatch switch_batches[8] {};
+	UhdaStreamParams switch_params {};
+	uint32_t switch_byte_rate {};
+	uint32_t switch_frame_size {};
+	// the ring position where the data in the new format starts
+	uint32_t switch_ring_pos {};
+	// the dma position after the data in the old format, followed by a period of silence
+	uint32_t switch_pos {};
+	uint16_t switch_format {};
+	uint8_t bound_converter_count {};
+	uint8_t switch_batches_pending {};
+	uhda::FormatSwitch format_switch {};
+
 	void* lock {};
 
+	uint16_t format {};
 	uint8_t index {};
 	bool output {};
+	// whether the stream should be running, the hardware state is lost on suspend
+	bool running {};
+	bool last_irq_clock_valid {};
+	bool adaptive_latency {};
+	// an underrun that the latency is to blame for happened since it was last adjusted
+	bool adapt_underrun {};
+	// the fill function ran out of data, the underruns that follow are not caused by the latency
+	bool client_starved {};
+	// the client callbacks are run from work scheduled by the irq
+	bool deferred_fill {};
+	bool refill_scheduled {};
+	bool refill_running {};
 };
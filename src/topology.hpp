@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// layout of the serialized codec topology, all values are in native byte order.
+//
+// header:
+//  u32 magic, u16 version, u16 codec count
+// codec record:
+//  u32 record size, u32 vendor id, u32 revision id, u32 root node count,
+//  u8 cid, u8 function group count, u16 widget count
+//  followed by the function groups and widgets
+// function group:
+//  u8 nid, u8 start nid, u8 widget count, u8 reserved
+// widget:
+//  u8 nid, u8 type, u8 connection count, u8 flags (bit 0: unsolicited response capable, bit 1: digital),
+//  u32 in amp caps, u32 out amp caps, u32 pin caps, u32 default config
+//  followed by the raw connection list entries
+namespace uhda::topology {
+	static constexpr uint32_t MAGIC = 0x54444855;
+	static constexpr uint16_t VERSION = 3;
+
+	static constexpr size_t HEADER_SIZE = 8;
+	static constexpr size_t CODEC_RECORD_SIZE = 20;
+	static constexpr size_t FUNC_GROUP_RECORD_SIZE = 4;
+	static constexpr size_t WIDGET_RECORD_SIZE = 20;
+
+	inline uint32_t load32(const uint8_t* ptr) {
+		uint32_t value;
+		__builtin_memcpy(&value, ptr, 4);
+		return value;
+	}
+
+	inline uint16_t load16(const uint8_t* ptr) {
+		uint16_t value;
+		__builtin_memcpy(&value, ptr, 2);
+		return value;
+	}
+
+	inline void store32(uint8_t* ptr, uint32_t value) {
+		__builtin_memcpy(ptr, &value, 4);
+	}
+
+	inline void store16(uint8_t* ptr, uint16_t value) {
+		__builtin_memcpy(ptr, &value, 2);
+	}
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "uhda/kernel_api.h"
+
+// the arguments are not evaluated unless uHDA is built with UHDA_TRACE defined
+#ifdef UHDA_TRACE
+#define UHDA_TRACEPOINT(event, a, b) uhda_kernel_trace((event), (a), (b))
+#else
+#define UHDA_TRACEPOINT(event, a, b) ((void) sizeof((event) + (a) + (b)))
+#endif
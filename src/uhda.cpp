@@ -1,6 +1,8 @@
 #include "uhda/uhda.h"
 #include "controller.hpp"
 #include "lock_guard.hpp"
+#include "mixer.hpp"
+#include "sample.hpp"
 #include "spec.hpp"
 #include "uhda/kernel_api.h"
 #include "utils.hpp"
@@ -32,13 +34,21 @@ bool uhda_class_matches(uint16_t clazz, uint16_t subclass) {
 }
 
 UhdaStatus uhda_init(void* pci_device, UhdaController** res) {
+	return uhda_init_with_topology(pci_device, nullptr, 0, res);
+}
+
+UhdaStatus uhda_init_with_topology(
+	void* pci_device,
+	const void* topology,
+	size_t topology_size,
+	UhdaController** res) {
 	auto ptr = uhda_kernel_malloc(sizeof(UhdaController));
 	if (!ptr) {
 		return UHDA_STATUS_NO_MEMORY;
 	}
 
 	auto* controller = uhda::construct<UhdaController>(ptr, pci_device);
-	auto status = controller->init();
+	auto status = controller->init(topology, topology_size);
 
 	if (status != UHDA_STATUS_SUCCESS) {
 		controller->~UhdaController();
@@ -63,7 +73,36 @@ UhdaStatus uhda_suspend(UhdaController* controller) {
 }
 
 UhdaStatus uhda_resume(UhdaController* controller) {
-	return controller->resume();
+	return controller->resume(nullptr, 0);
+}
+
+UhdaStatus uhda_resume_fast(UhdaController* controller) {
+	return controller->resume_fast();
+}
+
+UhdaStatus uhda_resume_with_topology(UhdaController* controller, const void* topology, size_t topology_size) {
+	return controller->resume(topology, topology_size);
+}
+
+void uhda_set_autosuspend_delay(UhdaController* controller, uint32_t delay_ms) {
+	controller->autosuspend_delay_ms = delay_ms;
+	controller->idle = false;
+}
+
+bool uhda_autosuspend_poll(UhdaController* controller, uint64_t now_ms) {
+	return controller->autosuspend_poll(now_ms);
+}
+
+UhdaStatus uhda_get_topology(UhdaController* controller, void* buffer, size_t* size) {
+	return controller->get_topology(buffer, size);
+}
+
+void uhda_get_stats(UhdaController* controller, UhdaControllerStats* stats, bool reset) {
+	LockGuard guard {controller->lock};
+	*stats = controller->stats;
+	if (reset) {
+		controller->stats = {};
+	}
 }
 
 void uhda_get_codecs(UhdaController* controller, const UhdaCodec* const** codecs, size_t* codec_count) {
@@ -76,6 +115,11 @@ void uhda_get_output_streams(UhdaController* controller, UhdaStream*** streams,
 	*stream_count = controller->out_stream_count;
 }
 
+void uhda_get_input_streams(UhdaController* controller, UhdaStream*** streams, size_t* stream_count) {
+	*streams = controller->in_stream_ptrs;
+	*stream_count = controller->in_stream_count;
+}
+
 void uhda_codec_get_output_groups(
 	const UhdaCodec* codec,
 	const UhdaOutputGroup* const** output_groups,
@@ -92,22 +136,23 @@ void uhda_output_group_get_outputs(
 	*output_count = output_group->outputs.size();
 }
 
-UhdaStatus uhda_output_get_presence(const UhdaOutput* output, bool* presence) {
-	if (!output->widget->presence_detect) {
-		return UHDA_STATUS_UNSUPPORTED;
-	}
+static UhdaStatus get_pin_presence(const UhdaWidget* pin, bool* presence) {
+	auto codec = pin->codec;
 
-	auto codec = output->widget->codec;
+	auto status = codec->controller->wake();
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
 
-	if (output->widget->trigger) {
-		auto status = codec->set_pin_sense(output->widget->nid, 0);
+	if (pin->trigger) {
+		status = codec->set_pin_sense(pin->nid, 0);
 		if (status != UHDA_STATUS_SUCCESS) {
 			return status;
 		}
 	}
 
 	uint32_t value;
-	auto status = codec->get_pin_sense(output->widget->nid, value);
+	status = codec->get_pin_sense(pin->nid, value);
 	if (status != UHDA_STATUS_SUCCESS) {
 		return status;
 	}
@@ -116,6 +161,78 @@ UhdaStatus uhda_output_get_presence(const UhdaOutput* output, bool* presence) {
 	return UHDA_STATUS_SUCCESS;
 }
 
+UhdaStatus uhda_output_get_presence(const UhdaOutput* output, bool* presence) {
+	if (!output->widget->presence_detect) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	// kept up to date by the presence change reports
+	if (output->unsol_tag) {
+		*presence = output->widget->codec->get_presence(output);
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	return get_pin_presence(output->widget, presence);
+}
+
+UhdaStatus uhda_output_set_presence_callback(const UhdaOutput* output, UhdaPresenceFn fn, void* arg) {
+	if (!output->unsol_tag) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	auto* mutable_output = const_cast<UhdaOutput*>(output);
+
+	LockGuard guard {output->widget->codec->controller->lock};
+	mutable_output->presence_fn = fn;
+	mutable_output->presence_arg = arg;
+	return UHDA_STATUS_SUCCESS;
+}
+
+static void get_pin_color_location(const UhdaWidget* pin, UhdaColor& color, UhdaLocation& location) {
+	uint8_t color_value = pin->pin_caps >> 12 & 0xF;
+	if (color_value >= 0xA && color_value <= 0xD) {
+		color = UHDA_COLOR_UNKNOWN;
+	}
+	else {
+		color = static_cast<UhdaColor>(color_value);
+	}
+
+	uint8_t location_value = pin->pin_caps >> 24 & 0x3F;
+	uint8_t fine_location = location_value & 0xF;
+	uint8_t coarse_location = location_value >> 4 & 0b11;
+
+	if (coarse_location == 0 && fine_location == 7) {
+		location = UHDA_LOCATION_REAR_PANEL;
+	}
+	else if (coarse_location == 0 && fine_location == 8) {
+		location = UHDA_LOCATION_DRIVE_BAY;
+	}
+	else if (coarse_location == 1 && fine_location == 7) {
+		location = UHDA_LOCATION_RISER;
+	}
+	else if (coarse_location == 1 && fine_location == 8) {
+		location = UHDA_LOCATION_DISPLAY;
+	}
+	else if (coarse_location == 1 && fine_location == 9) {
+		location = UHDA_LOCATION_ATAPI;
+	}
+	else if (coarse_location == 3 && fine_location == 7) {
+		location = UHDA_LOCATION_INSIDE_LID;
+	}
+	else if (coarse_location == 3 && fine_location == 8) {
+		location = UHDA_LOCATION_OUTSIDE_LID;
+	}
+	else if (fine_location <= 7) {
+		location = static_cast<UhdaLocation>(fine_location);
+	}
+	else if (fine_location <= 9) {
+		location = UHDA_LOCATION_SPECIAL;
+	}
+	else {
+		location = UHDA_LOCATION_UNKNOWN;
+	}
+}
+
 UhdaOutputInfo uhda_output_get_info(const UhdaOutput* output) {
 	UhdaOutputInfo info {};
 	switch (output->widget->default_dev) {
@@ -142,49 +259,51 @@ UhdaOutputInfo uhda_output_get_info(const UhdaOutput* output) {
 			break;
 	}
 
-	uint8_t color = output->widget->pin_caps >> 12 & 0xF;
-	if (color >= 0xA && color <= 0xD) {
-		info.color = UHDA_COLOR_UNKNOWN;
-	}
-	else {
-		info.color = static_cast<UhdaColor>(color);
-	}
+	get_pin_color_location(output->widget, info.color, info.location);
+	return info;
+}
 
-	uint8_t location = output->widget->pin_caps >> 24 & 0x3F;
-	uint8_t fine_location = location & 0xF;
-	uint8_t coarse_location = location >> 4 & 0b11;
+void uhda_codec_get_inputs(const UhdaCodec* codec, const UhdaInput* const** inputs, size_t* input_count) {
+	*inputs = codec->inputs.data();
+	*input_count = codec->inputs.size();
+}
 
-	if (coarse_location == 0 && fine_location == 7) {
-		info.location = UHDA_LOCATION_REAR_PANEL;
-	}
-	else if (coarse_location == 0 && fine_location == 8) {
-		info.location = UHDA_LOCATION_DRIVE_BAY;
-	}
-	else if (coarse_location == 1 && fine_location == 7) {
-		info.location = UHDA_LOCATION_RISER;
-	}
-	else if (coarse_location == 1 && fine_location == 8) {
-		info.location = UHDA_LOCATION_DISPLAY;
-	}
-	else if (coarse_location == 1 && fine_location == 9) {
-		info.location = UHDA_LOCATION_ATAPI;
-	}
-	else if (coarse_location == 3 && fine_location == 7) {
-		info.location = UHDA_LOCATION_INSIDE_LID;
-	}
-	else if (coarse_location == 3 && fine_location == 8) {
-		info.location = UHDA_LOCATION_OUTSIDE_LID;
-	}
-	else if (fine_location <= 7) {
-		info.location = static_cast<UhdaLocation>(fine_location);
-	}
-	else if (fine_location <= 9) {
-		info.location = UHDA_LOCATION_SPECIAL;
+UhdaStatus uhda_input_get_presence(const UhdaInput* input, bool* presence) {
+	if (!input->widget->presence_detect) {
+		return UHDA_STATUS_UNSUPPORTED;
 	}
-	else {
-		info.location = UHDA_LOCATION_UNKNOWN;
+
+	return get_pin_presence(input->widget, presence);
+}
+
+UhdaInputInfo uhda_input_get_info(const UhdaInput* input) {
+	UhdaInputInfo info {};
+	switch (input->widget->default_dev) {
+		case default_dev::LINE_IN:
+			info.type = UHDA_INPUT_TYPE_LINE_IN;
+			break;
+		case default_dev::MIN_IN:
+			info.type = UHDA_INPUT_TYPE_MIC_IN;
+			break;
+		case default_dev::AUX:
+			info.type = UHDA_INPUT_TYPE_AUX;
+			break;
+		case default_dev::CD:
+			info.type = UHDA_INPUT_TYPE_CD;
+			break;
+		case default_dev::SPDIF_IN:
+			info.type = UHDA_INPUT_TYPE_SPDIF_IN;
+			break;
+		case default_dev::DIGITAL_OTHER_IN:
+			info.type = UHDA_INPUT_TYPE_OTHER_DIGITAL_IN;
+			break;
+		default:
+			info.type = UHDA_INPUT_TYPE_UNKNOWN;
+			break;
 	}
 
+	get_pin_color_location(input->widget, info.color, info.location);
+
 	return info;
 }
 
@@ -222,31 +341,32 @@ const char* UHDA_LOCATION_STRINGS[UHDA_LOCATION_UNKNOWN + 1] {
 	"unknown"
 };
 
-bool uhda_paths_usable_simultaneously(const UhdaPath** paths, size_t count, bool same_stream) {
-	for (size_t i = 0; i < count; ++i) {
-		auto path = paths[i];
+// looks the pair up in the index of the codec if both paths are in the same set
+static bool paths_compatible(const UhdaPath* a, const UhdaPath* b, bool same_stream) {
+	if (a->codec != b->codec) {
+		return true;
+	}
 
-		for (size_t widget_i = 1; widget_i < path->widgets.size(); ++widget_i) {
-			auto widget = path->widgets[widget_i];
+	auto codec = a->codec;
+	for (int i = 0; i < 2; ++i) {
+		auto& paths = i == 0 ? codec->output_paths : codec->input_paths;
+		auto& index = i == 0 ? codec->output_path_index : codec->input_path_index;
 
-			for (size_t j = 0; j < count; ++j) {
-				if (j == i) {
-					continue;
-				}
+		auto a_index = index.index_of(paths, a);
+		auto b_index = index.index_of(paths, b);
+		if (a_index != SIZE_MAX && b_index != SIZE_MAX) {
+			return index.row(a_index, same_stream)[b_index / 64] & 1ULL << (b_index % 64);
+		}
+	}
 
-				auto other_path = paths[j];
-				for (size_t other_widget_i = 1; other_widget_i < other_path->widgets.size(); ++other_widget_i) {
-					auto other_widget = other_path->widgets[other_widget_i];
-
-					if (path->widgets[widget_i - 1] == other_path->widgets[other_widget_i - 1]) {
-						if (!same_stream) {
-							return false;
-						}
-					}
-					else if (widget == other_widget) {
-						return false;
-					}
-				}
+	return PathIndex::compatible(*a, *b, same_stream);
+}
+
+bool uhda_paths_usable_simultaneously(const UhdaPath** paths, size_t count, bool same_stream) {
+	for (size_t i = 0; i < count; ++i) {
+		for (size_t j = i + 1; j < count; ++j) {
+			if (!paths_compatible(paths[i], paths[j], same_stream)) {
+				return false;
 			}
 		}
 	}
@@ -254,21 +374,40 @@ bool uhda_paths_usable_simultaneously(const UhdaPath** paths, size_t count, bool
 	return true;
 }
 
-UhdaStatus uhda_find_path(
-	const UhdaOutput* dest,
+static UhdaStatus find_path(
+	vector<UhdaPath>& all_paths,
+	const PathIndex& index,
+	const UhdaWidget* pin,
 	const UhdaPath** other_paths,
 	size_t other_path_count,
 	bool same_stream,
 	UhdaPath** res) {
-	auto& all_paths = dest->widget->codec->output_paths;
-	for (auto& path : all_paths) {
-		if (path.widgets.front() == dest->widget) {
-			bool not_usable = false;
+	for (size_t word_i = 0; word_i < index.words; ++word_i) {
+		// the candidates compatible with every indexed other path
+		uint64_t candidates = ~0ULL;
+		for (size_t i = 0; i < other_path_count && candidates; ++i) {
+			auto other_index = index.index_of(all_paths, other_paths[i]);
+			if (other_index != SIZE_MAX) {
+				candidates &= index.row(other_index, same_stream)[word_i];
+			}
+		}
+
+		while (candidates) {
+			size_t path_i = word_i * 64 + __builtin_ctzll(candidates);
+			candidates &= candidates - 1;
+			if (path_i >= all_paths.size()) {
+				break;
+			}
 
+			auto& path = all_paths[path_i];
+			if (path.first() != pin) {
+				continue;
+			}
+
+			bool not_usable = false;
 			for (size_t i = 0; i < other_path_count; ++i) {
-				const UhdaPath* paths[] {&path, other_paths[i]};
-				auto usable = uhda_paths_usable_simultaneously(paths, 2, same_stream);
-				if (!usable) {
+				if (index.index_of(all_paths, other_paths[i]) == SIZE_MAX &&
+					!paths_compatible(&path, other_paths[i], same_stream)) {
 					not_usable = true;
 					break;
 				}
@@ -286,6 +425,114 @@ UhdaStatus uhda_find_path(
 	return UHDA_STATUS_UNSUPPORTED;
 }
 
+UhdaStatus uhda_find_path(
+	const UhdaOutput* dest,
+	const UhdaPath** other_paths,
+	size_t other_path_count,
+	bool same_stream,
+	UhdaPath** res) {
+	auto codec = dest->widget->codec;
+	return find_path(
+		codec->output_paths,
+		codec->output_path_index,
+		dest->widget,
+		other_paths,
+		other_path_count,
+		same_stream,
+		res);
+}
+
+UhdaStatus uhda_find_paths(
+	const UhdaOutput* const* dests,
+	size_t count,
+	bool same_stream,
+	UhdaPath** res) {
+	if (!count) {
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	auto codec = dests[0]->widget->codec;
+	for (size_t i = 1; i < count; ++i) {
+		if (dests[i]->widget->codec != codec) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+	}
+
+	auto& paths = codec->output_paths;
+	auto& index = codec->output_path_index;
+	auto words = index.words;
+	if (!words) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	// masks[level] holds the paths compatible with the ones chosen for the previous levels
+	vector<uint64_t> masks;
+	vector<size_t> next;
+	if (!masks.resize((count + 1) * words) || !next.resize(count)) {
+		return UHDA_STATUS_NO_MEMORY;
+	}
+	for (size_t i = 0; i < words; ++i) {
+		masks[i] = ~0ULL;
+	}
+	for (auto& entry : next) {
+		entry = 0;
+	}
+
+	// depth first search over the outputs, backtracking when an output has no candidates left
+	size_t level = 0;
+	while (true) {
+		auto pin = dests[level]->widget;
+		auto mask = masks.data() + level * words;
+
+		size_t found = SIZE_MAX;
+		for (size_t path_i = next[level]; path_i < paths.size(); ++path_i) {
+			if ((mask[path_i / 64] & 1ULL << (path_i % 64)) && paths[path_i].first() == pin) {
+				found = path_i;
+				break;
+			}
+		}
+
+		if (found == SIZE_MAX) {
+			if (level == 0) {
+				return UHDA_STATUS_UNSUPPORTED;
+			}
+			next[level] = 0;
+			--level;
+			continue;
+		}
+
+		next[level] = found + 1;
+		res[level] = &paths[found];
+		if (level + 1 == count) {
+			return UHDA_STATUS_SUCCESS;
+		}
+
+		auto row = index.row(found, same_stream);
+		auto next_mask = mask + words;
+		for (size_t i = 0; i < words; ++i) {
+			next_mask[i] = mask[i] & row[i];
+		}
+		++level;
+	}
+}
+
+UhdaStatus uhda_find_input_path(
+	const UhdaInput* src,
+	const UhdaPath** other_paths,
+	size_t other_path_count,
+	UhdaPath** res) {
+	// different streams can't record from the same path
+	auto codec = src->widget->codec;
+	return find_path(
+		codec->input_paths,
+		codec->input_path_index,
+		src->widget,
+		other_paths,
+		other_path_count,
+		false,
+		res);
+}
+
 static PcmFormat pcm_format_from_params(UhdaStreamParams* params) {
 	PcmFormat fmt {};
 	params->sample_rate = fmt.set_sample_rate(params->sample_rate);
@@ -299,6 +546,11 @@ static PcmFormat pcm_format_from_params(UhdaStreamParams* params) {
 		case UHDA_FORMAT_PCM16:
 			bits = 16;
 			break;
+		// the bursts are sent as 16-bit stereo pcm would be
+		case UHDA_FORMAT_IEC61937:
+			bits = 16;
+			fmt.set_non_pcm(true);
+			break;
 		case UHDA_FORMAT_PCM20:
 			bits = 20;
 			break;
@@ -306,12 +558,14 @@ static PcmFormat pcm_format_from_params(UhdaStreamParams* params) {
 			bits = 24;
 			break;
 		case UHDA_FORMAT_PCM32:
+		// the hardware only plays integer samples
+		case UHDA_FORMAT_FLOAT32:
 			bits = 32;
 			break;
 	}
 
 	uint8_t real_bits = fmt.set_bits_per_sample(bits);
-	if (real_bits != bits) {
+	if (real_bits != bits || params->fmt == UHDA_FORMAT_FLOAT32) {
 		switch (real_bits) {
 			case 8:
 				params->fmt = UHDA_FORMAT_PCM8;
@@ -336,189 +590,488 @@ static PcmFormat pcm_format_from_params(UhdaStreamParams* params) {
 	return fmt;
 }
 
-UhdaStatus uhda_path_setup(UhdaPath* path, UhdaStreamParams* params, UhdaStream* stream) {
-	if (!stream->output) {
-		return UHDA_STATUS_UNSUPPORTED;
+// the connection lists have the ranges expanded, so the index is the position in the list
+static uint8_t get_connection_index(const UhdaWidget* widget, const UhdaWidget* next_widget) {
+	size_t index = 0;
+	for (; index < widget->connections.size(); ++index) {
+		if (widget->connections[index] == next_widget->nid) {
+			break;
+		}
 	}
+	return index;
+}
 
-	auto fmt = pcm_format_from_params(params);
+// amps without a gain control are only unmuted, the others start at 0 dB
+static uint8_t get_default_step(uint32_t caps) {
+	return amp_caps::get_num_steps(caps) ? amp_caps::get_offset(caps) : 0;
+}
+
+static UhdaStatus input_path_setup(UhdaPath* path, PcmFormat fmt, UhdaStream* stream) {
+	auto input = path->last();
+	auto codec = path->codec;
 
-	auto output = path->widgets.back();
-	if (output->type != widget_type::AUDIO_OUT) {
+	if (fmt.value & pcm_format::TYPE) {
 		return UHDA_STATUS_UNSUPPORTED;
 	}
 
-	auto codec = path->codec;
-
-	auto status = codec->set_converter_format(output->nid, fmt.value);
+	auto status = codec->controller->wake();
 	if (status != UHDA_STATUS_SUCCESS) {
 		return status;
 	}
 
-	status = codec->set_converter_channel_count(output->nid, fmt.value & pcm_format::CHAN);
+	status = codec->power_up_path(*path);
 	if (status != UHDA_STATUS_SUCCESS) {
 		return status;
 	}
 
-	for (size_t i = 0; i < path->widgets.size(); ++i) {
-		auto widget = path->widgets[i];
-
-		if (i != path->widgets.size() - 1 && widget->connections.size() > 1) {
-			auto next_widget = path->widgets[i + 1];
-
-			size_t index = 0;
-			for (size_t j = 0; j < widget->connections.size(); ++j) {
-				auto connection = widget->connections[j];
-				if (connection & 1 << 7) {
-					auto start = widget->connections[j - 1];
-					auto end = connection & 0x7F;
-					if (next_widget->nid >= start && next_widget->nid <= end) {
-						index += next_widget->nid - start;
-						break;
-					}
-					index += end - start;
-				}
-				else {
-					if (next_widget->nid == connection) {
-						break;
-					}
-					++index;
-				}
-			}
-
-			status = codec->set_selected_connection(widget->nid, index);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
+	// at most 4 verbs per widget and the converter format and channel count
+	vector<Verb> verbs;
+	if (!verbs.resize(2 + path->length * 4)) {
+		return UHDA_STATUS_NO_MEMORY;
+	}
+	uint32_t count = 0;
+
+	verbs[count++] = Verb::make_long(input->nid, cmd::SET_CONVERTER_FORMAT, fmt.value);
+	verbs[count++] = Verb::make(
+		input->nid,
+		cmd::SET_CONVERTER_CHANNEL_COUNT,
+		fmt.value & pcm_format::CHAN);
+
+	uint8_t gain = path->gain;
+
+	// the audio flows from the pin at the front to the adc at the back,
+	// so each widget selects the one before it.
+	for (size_t i = 0; i < path->length; ++i) {
+		auto widget = path->widget(i);
+
+		uint8_t index = 0;
+		if (i != 0) {
+			index = get_connection_index(widget, path->widget(i - 1));
+			if (widget->connections.size() > 1 && widget->type != widget_type::AUDIO_MIXER) {
+				verbs[count++] = Verb::make(widget->nid, cmd::SET_CONN_SELECT, index);
 			}
 		}
 
-		status = codec->set_power_state(widget->nid, 0);
-		if (status != UHDA_STATUS_SUCCESS) {
-			return status;
-		}
+		verbs[count++] = Verb::make(widget->nid, cmd::SET_POWER_STATE, 0);
 
 		if (widget->type == widget_type::PIN_COMPLEX) {
-			if (widget->pin_caps & 1 << 16) {
-				status = codec->set_eapd_enable(widget->nid, 1 << 1);
-				if (status != UHDA_STATUS_SUCCESS) {
-					return status;
-				}
-			}
-
-			uint8_t step = widget->out_amp_caps & 0x7F;
+			uint8_t step = get_default_step(widget->in_amp_caps);
 
-			// set output amp, set left amp, set right amp and gain
-			uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | step;
-			status = codec->set_amp_gain_mute(widget->nid, amp_data);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
+			// set input amp, set left amp, set right amp and gain
+			uint16_t amp_data = 1 << 14 | 1 << 13 | 1 << 12 | step;
+			verbs[count++] = Verb::make_long(widget->nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
 
-			// headphone amp, out enable
-			uint8_t pin_control = 1 << 7 | 1 << 6;
-			status = codec->set_pin_control(widget->nid, pin_control);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
+			// in enable
+			uint8_t pin_control = 1 << 5;
+			verbs[count++] = Verb::make(widget->nid, cmd::SET_PIN_CONTROL, pin_control);
 		}
 		else if (widget->type == widget_type::AUDIO_MIXER) {
-			uint8_t step = widget->out_amp_caps & 0x7F;
+			uint8_t step = get_default_step(widget->in_amp_caps);
 
-			// set output amp, set left amp, set right amp and gain
-			uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | step;
-			status = codec->set_amp_gain_mute(widget->nid, amp_data);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
-		}
-		else if (widget->type == widget_type::AUDIO_OUT) {
-			status = codec->set_converter_control(widget->nid, stream->index + 1, 0);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
+			// set input amp, set left amp, set right amp, index and gain
+			uint16_t amp_data = 1 << 14 | 1 << 13 | 1 << 12 | index << 8 | step;
+			verbs[count++] = Verb::make_long(widget->nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
 
-			uint8_t step = widget->out_amp_caps & 0x7F;
+			step = get_default_step(widget->out_amp_caps);
 
 			// set output amp, set left amp, set right amp and gain
-			uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | (step / 2);
+			amp_data = 1 << 15 | 1 << 13 | 1 << 12 | step;
+			verbs[count++] = Verb::make_long(widget->nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
+		}
+		else if (widget->type == widget_type::AUDIO_IN) {
+			verbs[count++] = Verb::make(
+				widget->nid,
+				cmd::SET_CONVERTER_CONTROL,
+				(stream->index + 1) << 4);
 
-			path->gain = step / 2;
+			gain = get_default_step(widget->in_amp_caps);
 
-			status = codec->set_amp_gain_mute(widget->nid, amp_data);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
+			// set input amp, set left amp, set right amp, index and gain
+			uint16_t amp_data = 1 << 14 | 1 << 13 | 1 << 12 | index << 8 | gain;
+			verbs[count++] = Verb::make_long(widget->nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
 		}
 	}
 
+	status = codec->run_verbs(verbs.data(), count);
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	path->gain = gain;
 	return UHDA_STATUS_SUCCESS;
 }
 
-UhdaStatus uhda_path_shutdown(UhdaPath* path) {
-	auto codec = path->codec;
-
-	for (auto widget : path->widgets) {
-		if (widget->type == widget_type::PIN_COMPLEX) {
-			// set output amp, set left amp, set right amp and mute
-			uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | 1 << 7;
-			auto status = codec->set_amp_gain_mute(widget->nid, amp_data);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
-
-			status = codec->set_pin_control(widget->nid, 0);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
-		}
-		else if (widget->type == widget_type::AUDIO_MIXER) {
-			// set output amp, set left amp, set right amp and mute
-			uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | 1 << 7;
-			auto status = codec->set_amp_gain_mute(widget->nid, amp_data);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
+// `channel` is the first channel of the stream that the converter of the path plays
+// a converter belongs to the stream that it was last set up for, a null stream unbinds it
+static UhdaStatus bind_converter(UhdaCodec* codec, uint8_t nid, UhdaStream* stream) {
+	// the other streams keep the converter if this one has no room for it
+	if (stream) {
+		LockGuard guard {stream->lock};
+		if (!stream->bind_converter(codec, nid)) {
+			return UHDA_STATUS_NO_MEMORY;
 		}
-		else if (widget->type == widget_type::AUDIO_OUT) {
-			auto status = codec->set_converter_control(widget->nid, 0, 0);
-			if (status != UHDA_STATUS_SUCCESS) {
-				return status;
-			}
+	}
+
+	auto controller = codec->controller;
+	for (uint8_t i = 0; i < controller->out_stream_count; ++i) {
+		auto& other = controller->out_streams[i];
+		if (&other == stream) {
+			continue;
 		}
+
+		LockGuard guard {other.lock};
+		other.unbind_converter(codec, nid);
 	}
 
 	return UHDA_STATUS_SUCCESS;
 }
 
-UhdaStatus uhda_path_set_volume(UhdaPath* path, int volume) {
-	if (volume > 100) {
-		volume = 100;
-	}
+static UhdaStatus output_path_setup(
+	UhdaPath* path,
+	PcmFormat fmt,
+	UhdaStream* stream,
+	uint8_t channel,
+	uint8_t channel_count) {
+	auto output = path->last();
+	auto codec = path->codec;
 
-	auto output = path->widgets.back();
-	if (output->type != widget_type::AUDIO_OUT) {
+	bool non_pcm = fmt.value & pcm_format::TYPE;
+	if (non_pcm && !output->digital) {
 		return UHDA_STATUS_UNSUPPORTED;
 	}
 
-	uint8_t max_value = output->out_amp_caps & 0x7F;
-	uint8_t one_percentage = max_value / 100;
-	if (one_percentage == 0) {
-		one_percentage = 1;
+	// the converter is bound before it's programmed so that a stream that can't switch it isn't set up
+	auto status = bind_converter(codec, output->nid, stream);
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
 	}
-	uint32_t value = one_percentage * volume;
-	if (value > max_value || volume == 100) {
-		value = max_value;
+
+	status = codec->controller->wake();
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
 	}
 
-	path->gain = value;
+	status = codec->power_up_path(*path);
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
 
-	// set output amp, set left amp, set right amp and gain
-	uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | value;
-	return path->codec->set_amp_gain_mute(output->nid, amp_data);
-}
+	// at most 5 verbs per widget and the converter format, channel count and digital control
+	vector<Verb> verbs;
+	if (!verbs.resize(3 + path->length * 5)) {
+		return UHDA_STATUS_NO_MEMORY;
+	}
+	uint32_t count = 0;
+
+	verbs[count++] = Verb::make_long(output->nid, cmd::SET_CONVERTER_FORMAT, fmt.value);
+	verbs[count++] = Verb::make(
+		output->nid,
+		cmd::SET_CONVERTER_CHANNEL_COUNT,
+		channel_count - 1);
+
+	if (output->digital) {
+		// the non-audio bit tells the receiver that the data isn't pcm
+		uint8_t digi = digi_converter::DIGEN | (non_pcm ? digi_converter::NON_AUDIO : 0);
+		verbs[count++] = Verb::make(output->nid, cmd::SET_DIGI_CONVERTER_1, digi);
+	}
+
+	uint8_t gain = path->gain;
+
+	for (size_t i = 0; i < path->length; ++i) {
+		auto widget = path->widget(i);
+
+		if (i + 1 != path->length && widget->connections.size() > 1) {
+			auto next_widget = path->widget(i + 1);
+
+			auto index = get_connection_index(widget, next_widget);
+			verbs[count++] = Verb::make(widget->nid, cmd::SET_CONN_SELECT, index);
+		}
+
+		verbs[count++] = Verb::make(widget->nid, cmd::SET_POWER_STATE, 0);
+
+		if (widget->type == widget_type::PIN_COMPLEX) {
+			if (widget->pin_caps & 1 << 16) {
+				verbs[count++] = Verb::make(widget->nid, cmd::SET_EAPD_ENABLE, 1 << 1);
+			}
+
+			uint8_t step = get_default_step(widget->out_amp_caps);
+
+			// set output amp, set left amp, set right amp and gain
+			uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | step;
+			verbs[count++] = Verb::make_long(widget->nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
+
+			// headphone amp, out enable
+			uint8_t pin_control = 1 << 7 | 1 << 6;
+			verbs[count++] = Verb::make(widget->nid, cmd::SET_PIN_CONTROL, pin_control);
+		}
+		else if (widget->type == widget_type::AUDIO_MIXER) {
+			uint8_t step = get_default_step(widget->out_amp_caps);
+
+			// set output amp, set left amp, set right amp and gain
+			uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | step;
+			verbs[count++] = Verb::make_long(widget->nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
+		}
+		else if (widget->type == widget_type::AUDIO_OUT) {
+			verbs[count++] = Verb::make(
+				widget->nid,
+				cmd::SET_CONVERTER_CONTROL,
+				(stream->index + 1) << 4 | channel);
+
+			uint8_t step = get_default_step(widget->out_amp_caps);
+
+			// set output amp, set left amp, set right amp and gain
+			uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | (step / 2);
+
+			gain = step / 2;
+
+			verbs[count++] = Verb::make_long(widget->nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
+		}
+	}
+
+	status = codec->run_verbs(verbs.data(), count);
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	path->gain = gain;
+	return UHDA_STATUS_SUCCESS;
+}
+
+const uint32_t UHDA_SAMPLE_RATES[UHDA_SAMPLE_RATE_COUNT] {
+	8000,
+	11025,
+	16000,
+	22050,
+	32000,
+	44100,
+	48000,
+	88200,
+	96000,
+	176400,
+	192000,
+	384000
+};
+
+UhdaStatus uhda_path_get_format_caps(const UhdaPath* path, UhdaFormatCaps* caps) {
+	auto converter = path->last();
+
+	auto status = path->codec->controller->wake();
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	uint32_t size_rate;
+	uint32_t formats;
+	status = path->codec->get_converter_formats(converter->nid, size_rate, formats);
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	caps->rates = size_rate & ((1 << UHDA_SAMPLE_RATE_COUNT) - 1);
+	caps->formats = 0;
+	caps->digital = converter->digital;
+
+	if (formats & stream_formats::PCM) {
+		// bits 16 to 20 are the 8, 16, 20, 24 and 32-bit sample sizes in the order of `UhdaFormat`
+		for (uint32_t i = 0; i < 5; ++i) {
+			if (size_rate & 1 << (16 + i)) {
+				caps->formats |= 1 << (UHDA_FORMAT_PCM8 + i);
+			}
+		}
+
+		// compressed data is played as 16-bit pcm with the non-audio bit set
+		if (converter->digital && (caps->formats & 1 << UHDA_FORMAT_PCM16) &&
+			converter->type == widget_type::AUDIO_OUT) {
+			caps->formats |= 1 << UHDA_FORMAT_IEC61937;
+		}
+	}
+
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_path_setup(UhdaPath* path, UhdaStreamParams* params, UhdaStream* stream) {
+	auto output = path->last();
+	if (output->type == widget_type::AUDIO_IN) {
+		if (stream->output) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+
+		auto fmt = pcm_format_from_params(params);
+		return input_path_setup(path, fmt, stream);
+	}
+
+	if (!stream->output || output->type != widget_type::AUDIO_OUT) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	auto fmt = pcm_format_from_params(params);
+	return output_path_setup(path, fmt, stream, 0, (fmt.value & pcm_format::CHAN) + 1);
+}
+
+UhdaStatus uhda_path_setup_multichannel(
+	UhdaPath* const* paths,
+	size_t path_count,
+	UhdaStreamParams* params,
+	UhdaStream* stream) {
+	if (!stream->output || !path_count || path_count > 8) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	for (size_t i = 0; i < path_count; ++i) {
+		if (paths[i]->last()->type != widget_type::AUDIO_OUT) {
+			return UHDA_STATUS_UNSUPPORTED;
+		}
+	}
+
+	// every path needs a converter of its own
+	if (!uhda_paths_usable_simultaneously(const_cast<const UhdaPath**>(paths), path_count, false)) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	if (params->channels > path_count * 2) {
+		params->channels = path_count * 2;
+	}
+	auto fmt = pcm_format_from_params(params);
+
+	// all the converters are set to the format of the whole stream and pick a pair of channels from it,
+	// a path that would be past the last channel isn't needed.
+	for (size_t i = 0; i < path_count && i * 2 < params->channels; ++i) {
+		auto channel = static_cast<uint8_t>(i * 2);
+		uint8_t channel_count = params->channels - channel >= 2 ? 2 : 1;
+
+		auto status = output_path_setup(paths[i], fmt, stream, channel, channel_count);
+		if (status != UHDA_STATUS_SUCCESS) {
+			return status;
+		}
+	}
+
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_path_shutdown(UhdaPath* path) {
+	auto codec = path->codec;
+
+	auto status = codec->controller->wake();
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	// at most 2 verbs per widget and the power down verbs
+	vector<Verb> verbs;
+	if (!verbs.resize(path->length * 4 + 1)) {
+		return UHDA_STATUS_NO_MEMORY;
+	}
+	uint32_t count = 0;
+
+	bool input = path->last()->type == widget_type::AUDIO_IN;
+
+	for (size_t i = 0; i < path->length; ++i) {
+		auto widget = path->widget(i);
+
+		if (input) {
+			// set input amp, set left amp, set right amp, index and mute
+			uint8_t index = i != 0 ? get_connection_index(widget, path->widget(i - 1)) : 0;
+			uint16_t amp_data = 1 << 14 | 1 << 13 | 1 << 12 | index << 8 | 1 << 7;
+
+			if (widget->type == widget_type::PIN_COMPLEX) {
+				verbs[count++] = Verb::make_long(widget->nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
+				verbs[count++] = Verb::make(widget->nid, cmd::SET_PIN_CONTROL, 0);
+			}
+			else if (widget->type == widget_type::AUDIO_MIXER) {
+				verbs[count++] = Verb::make_long(widget->nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
+			}
+			else if (widget->type == widget_type::AUDIO_IN) {
+				verbs[count++] = Verb::make(widget->nid, cmd::SET_CONVERTER_CONTROL, 0);
+			}
+			continue;
+		}
+
+		if (widget->type == widget_type::PIN_COMPLEX) {
+			// set output amp, set left amp, set right amp and mute
+			uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | 1 << 7;
+			verbs[count++] = Verb::make_long(widget->nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
+			verbs[count++] = Verb::make(widget->nid, cmd::SET_PIN_CONTROL, 0);
+		}
+		else if (widget->type == widget_type::AUDIO_MIXER) {
+			// set output amp, set left amp, set right amp and mute
+			uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | 1 << 7;
+			verbs[count++] = Verb::make_long(widget->nid, cmd::SET_AMP_GAIN_MUTE, amp_data);
+		}
+		else if (widget->type == widget_type::AUDIO_OUT) {
+			verbs[count++] = Verb::make(widget->nid, cmd::SET_CONVERTER_CONTROL, 0);
+			if (widget->digital) {
+				verbs[count++] = Verb::make(widget->nid, cmd::SET_DIGI_CONVERTER_1, 0);
+			}
+		}
+	}
+
+	if (!input) {
+		bind_converter(codec, path->last()->nid, nullptr);
+	}
+
+	// the widgets are powered down after they are muted
+	count += codec->power_down_path(*path, verbs.data() + count);
+
+	return codec->run_verbs(verbs.data(), count);
+}
+
+UhdaStatus uhda_path_set_volume(UhdaPath* path, int volume) {
+	if (volume < 0) {
+		volume = 0;
+	}
+	else if (volume > 100) {
+		volume = 100;
+	}
+
+	auto output = path->last();
+	bool input = output->type == widget_type::AUDIO_IN;
+	if (!input && output->type != widget_type::AUDIO_OUT) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	// the volume is rounded to the nearest of the amp's steps, which are often fewer than 100
+	uint32_t max_value = amp_caps::get_num_steps(input ? output->in_amp_caps : output->out_amp_caps);
+	if (!max_value) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+	uint32_t value = (max_value * static_cast<uint32_t>(volume) + 50) / 100;
+	path->gain = value;
+
+	auto status = path->codec->controller->wake();
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	if (input) {
+		// the adc only has amps on its inputs
+		uint8_t index = get_connection_index(output, path->widget(path->length - 2));
+
+		// set input amp, set left amp, set right amp, index and gain
+		uint16_t amp_data = 1 << 14 | 1 << 13 | 1 << 12 | index << 8 | value;
+		return path->codec->set_amp_gain_mute(output->nid, amp_data);
+	}
+
+	// set output amp, set left amp, set right amp and gain
+	uint16_t amp_data = 1 << 15 | 1 << 13 | 1 << 12 | value;
+	return path->codec->set_amp_gain_mute(output->nid, amp_data);
+}
 
 UhdaStatus uhda_path_mute(UhdaPath* path, bool mute) {
-	auto pin = path->widgets.front();
+	auto pin = path->first();
+
+	auto status = path->codec->controller->wake();
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	auto input = path->last();
+	if (input->type == widget_type::AUDIO_IN) {
+		uint8_t index = get_connection_index(input, path->widget(path->length - 2));
+
+		// set input amp, set left amp, set right amp, index, mute and gain
+		uint16_t amp_data = 1 << 14 | 1 << 13 | 1 << 12 | index << 8 | (mute ? (1 << 7) : 0) | path->gain;
+		return path->codec->set_amp_gain_mute(input->nid, amp_data);
+	}
 
 	UhdaWidget* mute_widget;
 
@@ -527,7 +1080,7 @@ UhdaStatus uhda_path_mute(UhdaPath* path, bool mute) {
 		mute_widget = pin;
 	}
 	else {
-		mute_widget = path->widgets.back();
+		mute_widget = path->last();
 	}
 
 	// set output amp, set left amp, set right amp, mute and gain
@@ -538,18 +1091,25 @@ UhdaStatus uhda_path_mute(UhdaPath* path, bool mute) {
 UhdaStatus uhda_stream_setup(
 	UhdaStream* stream,
 	const UhdaStreamParams* params,
+	UhdaStreamBufferParams* buffer_params,
 	uint32_t ring_buffer_size,
 	UhdaBufferFillFn buffer_fill_fn,
 	void* buffer_fill_arg,
 	uint32_t buffer_trip_threshold,
 	UhdaBufferTripFn buffer_trip_fn,
 	void* buffer_trip_arg) {
+	auto status = stream->controller->wake();
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
 	LockGuard guard {stream->lock};
-	if (stream->ring_buffer) {
+	if (stream->bdl) {
 		return UHDA_STATUS_UNSUPPORTED;
 	}
 
-	if (!stream->output) {
+	// input streams are always read straight from the DMA buffer
+	if (!stream->output && (ring_buffer_size || buffer_fill_fn)) {
 		return UHDA_STATUS_UNSUPPORTED;
 	}
 
@@ -563,28 +1123,179 @@ UhdaStatus uhda_stream_setup(
 
 	auto fmt = pcm_format_from_params(&params_copy);
 
-	stream->space.store(regs::stream::FMT, fmt.value);
-	return stream->setup(ring_buffer_size);
+	uint32_t sample_size = get_sample_size(params_copy.fmt);
+	uint32_t byte_rate = params_copy.sample_rate * params_copy.channels * sample_size;
+
+	UhdaStreamBufferParams buffer_params_copy {};
+	if (buffer_params) {
+		buffer_params_copy = *buffer_params;
+	}
+
+	stream->format = fmt.value;
+	stream->frame_size = params_copy.channels * sample_size;
+	stream->params = params_copy;
+	status = stream->setup(ring_buffer_size, &buffer_params_copy, byte_rate);
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	if (buffer_params) {
+		*buffer_params = buffer_params_copy;
+	}
+	return UHDA_STATUS_SUCCESS;
 }
 
 UhdaStatus uhda_stream_shutdown(UhdaStream* stream) {
+	// the virtual streams would be freed with the mixer while the client still has them
+	if (stream->has_virtual_streams()) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
 	stream->destroy();
 	return UHDA_STATUS_SUCCESS;
 }
 
 #define memcpy __builtin_memcpy
+#define memset __builtin_memset
 
-UhdaStatus uhda_stream_play(UhdaStream* stream, bool play) {
+UhdaStatus uhda_stream_switch_format(UhdaStream* stream, UhdaStreamParams* params) {
+	if (!stream->output) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	auto status = stream->controller->wake();
+	if (status != UHDA_STATUS_SUCCESS) {
+		return status;
+	}
+
+	auto params_copy = *params;
+	auto fmt = pcm_format_from_params(&params_copy);
+	uint32_t sample_size = get_sample_size(params_copy.fmt);
+
+	LockGuard guard {stream->lock};
+	if (!stream->bdl || stream->mixer || stream->converter || stream->format_switch != FormatSwitch::None) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+	// the converters keep their channel count and the channels they pick from the stream
+	if (params_copy.channels != stream->params.channels) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	// the digital converters would have to be switched between audio and non-audio mode as well
+	if ((params_copy.fmt == UHDA_FORMAT_IEC61937) != (stream->params.fmt == UHDA_FORMAT_IEC61937)) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	*params = params_copy;
+	if (fmt.value == stream->format) {
+		return UHDA_STATUS_SUCCESS;
+	}
+
+	// the shadows get the new format now so that a resume restores it even if the switch hasn't happened yet
+	for (uint8_t i = 0; i < stream->bound_converter_count; ++i) {
+		auto& converter = stream->bound_converters[i];
+		Verb verb = Verb::make_long(converter.nid, cmd::SET_CONVERTER_FORMAT, fmt.value);
+		status = converter.codec->record_verbs(&verb, 1);
+		if (status != UHDA_STATUS_SUCCESS) {
+			return status;
+		}
+	}
+
+	uint32_t frame_size = params_copy.channels * sample_size;
+	stream->queue_format_switch(params_copy, fmt.value, params_copy.sample_rate * frame_size, frame_size);
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_iec61937_pack_burst(
+	UhdaIec61937Type type,
+	const void* frame,
+	uint32_t frame_size,
+	void* burst,
+	uint32_t burst_size) {
+	// the preamble is 4 16-bit words
+	if (burst_size < 8 || frame_size > burst_size - 8 || burst_size % 4) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	// the length is in bits except for e-ac-3, which uses bytes
+	uint32_t length = type == UHDA_IEC61937_EAC3 ? frame_size : frame_size * 8;
+	if (length > 0xFFFF) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	uint16_t preamble[4] {
+		0xF872,
+		0x4E1F,
+		static_cast<uint16_t>(type),
+		static_cast<uint16_t>(length)
+	};
+
+	auto* src = static_cast<const uint8_t*>(frame);
+	auto* dst = static_cast<uint8_t*>(burst);
+	memcpy(dst, preamble, 8);
+	dst += 8;
+
+	// each 16-bit word holds two bytes of the bitstream with the first one as the most significant byte
+	for (uint32_t i = 0; i + 1 < frame_size; i += 2) {
+		uint16_t word = src[i] << 8 | src[i + 1];
+		memcpy(dst + i, &word, 2);
+	}
+	uint32_t written = frame_size;
+	if (frame_size % 2) {
+		uint16_t word = src[frame_size - 1] << 8;
+		memcpy(dst + frame_size - 1, &word, 2);
+		++written;
+	}
+
+	memset(dst + written, 0, burst_size - 8 - written);
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_stream_set_deferred_fill(UhdaStream* stream, bool deferred) {
 	if (!stream->output) {
 		return UHDA_STATUS_UNSUPPORTED;
 	}
 
+	LockGuard guard {stream->lock};
+	stream->deferred_fill = deferred;
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_stream_set_source_format(UhdaStream* stream, const UhdaStreamParams* params) {
+	if (!stream->output || !stream->bdl) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	return stream->set_source_format(params);
+}
+
+UhdaStatus uhda_stream_play(UhdaStream* stream, bool play) {
+	if (play) {
+		auto status = stream->controller->wake();
+		if (status != UHDA_STATUS_SUCCESS) {
+			return status;
+		}
+	}
+
 	stream->play(play);
 	return UHDA_STATUS_SUCCESS;
 }
 
+UhdaStatus uhda_streams_play_synced(UhdaStream* const* streams, size_t count, bool play) {
+	if (!count) {
+		return UHDA_STATUS_SUCCESS;
+	}
+	return streams[0]->controller->play_synced(streams, count, play);
+}
+
+UhdaStatus uhda_stream_set_gain(UhdaStream* stream, int volume, uint32_t ramp_us) {
+	return stream->set_gain(volume, ramp_us);
+}
+
 UhdaStatus uhda_stream_queue_data(UhdaStream* stream, const void* data, uint32_t* size) {
-	if (!stream->output) {
+	// the dma pages of a stream that was shut down are kept for the next setup
+	if (!stream->output || !stream->bdl) {
+		*size = 0;
 		return UHDA_STATUS_UNSUPPORTED;
 	}
 
@@ -592,10 +1303,122 @@ UhdaStatus uhda_stream_queue_data(UhdaStream* stream, const void* data, uint32_t
 	return UHDA_STATUS_SUCCESS;
 }
 
+UhdaStatus uhda_stream_acquire_write(UhdaStream* stream, void** ptr, uint32_t* size) {
+	if (!stream->output) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	LockGuard guard {stream->lock};
+	if (!stream->bdl || stream->ring_buffer) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	*size = stream->get_write_span(ptr);
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_stream_commit_write(UhdaStream* stream, uint32_t size) {
+	if (!stream->output) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	LockGuard guard {stream->lock};
+	if (!stream->bdl || stream->ring_buffer) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	void* ptr;
+	auto span = stream->get_write_span(&ptr);
+	if (size > span) {
+		size = span;
+	}
+
+	stream->commit_write(size);
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_stream_acquire_read(UhdaStream* stream, const void** ptr, uint32_t* size) {
+	if (stream->output) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	LockGuard guard {stream->lock};
+	if (!stream->bdl) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	*size = stream->get_read_span(ptr);
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_stream_commit_read(UhdaStream* stream, uint32_t size) {
+	if (stream->output) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	LockGuard guard {stream->lock};
+	if (!stream->bdl) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	auto captured = stream->get_captured(stream->get_pos() % stream->buffer_size);
+	if (size > captured) {
+		size = captured;
+	}
+
+	stream->advance_fill_pos(size);
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_stream_get_read_timestamp(const UhdaStream* stream, uint32_t* wall_clock) {
+	if (stream->output) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	LockGuard guard {stream->lock};
+	if (!stream->bdl) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	*wall_clock = stream->get_read_timestamp();
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_stream_get_position(const UhdaStream* stream, UhdaStreamPosition* position) {
+	LockGuard guard {stream->lock};
+	if (!stream->bdl) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	stream->get_position(position);
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_stream_get_stats(UhdaStream* stream, UhdaStreamStats* stats, bool reset) {
+	LockGuard guard {stream->lock};
+	if (!stream->bdl) {
+		return UHDA_STATUS_UNSUPPORTED;
+	}
+
+	*stats = stream->stats;
+	// the data in the ring buffer is still ahead of the hardware, it's just not in the dma buffer yet
+	if (stream->output) {
+		stats->fill_ahead = stream->get_queued_ahead(stream->get_pos() % stream->buffer_size);
+		if (stream->ring_buffer) {
+			stats->fill_ahead += stream->get_ring_size();
+		}
+	}
+	stats->fill_target = stream->software_ahead_limit;
+	if (reset) {
+		stream->stats = {};
+	}
+	return UHDA_STATUS_SUCCESS;
+}
+
 UhdaStreamStatus uhda_stream_get_status(const UhdaStream* stream) {
 	LockGuard guard {stream->lock};
 
-	if (!stream->ring_buffer) {
+	if (!stream->bdl) {
 		return UHDA_STREAM_STATUS_UNINITIALIZED;
 	}
 
@@ -609,15 +1432,46 @@ UhdaStreamStatus uhda_stream_get_status(const UhdaStream* stream) {
 }
 
 UhdaStatus uhda_stream_get_remaining(const UhdaStream* stream, uint32_t* remaining) {
+	*remaining = stream->get_remaining();
+	return UHDA_STATUS_SUCCESS;
+}
+
+uint32_t uhda_stream_get_buffer_size(const UhdaStream* stream) {
+	return stream->ring_buffer_capacity;
+}
+
+UhdaStatus uhda_stream_create_virtual(UhdaStream* stream, uint32_t ring_buffer_size, UhdaVirtualStream** res) {
 	if (!stream->output) {
 		return UHDA_STATUS_UNSUPPORTED;
 	}
 
-	LockGuard guard {stream->lock};
-	*remaining = stream->ring_buffer_size;
+	return stream->create_virtual(ring_buffer_size, res);
+}
+
+UhdaStatus uhda_virtual_stream_destroy(UhdaVirtualStream* stream) {
+	stream->mixer->destroy_stream(stream);
 	return UHDA_STATUS_SUCCESS;
 }
 
-uint32_t uhda_stream_get_buffer_size(const UhdaStream* stream) {
-	return stream->ring_buffer_capacity;
+UhdaStatus uhda_virtual_stream_queue_data(UhdaVirtualStream* stream, const void* data, uint32_t* size) {
+	stream->queue_data(data, size);
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_virtual_stream_set_volume(UhdaVirtualStream* stream, int volume) {
+	if (volume < 0) {
+		volume = 0;
+	}
+	else if (volume > 100) {
+		volume = 100;
+	}
+
+	// read by the mixer without the lock
+	__atomic_store_n(&stream->gain, volume * (1 << 14) / 100, __ATOMIC_RELAXED);
+	return UHDA_STATUS_SUCCESS;
+}
+
+UhdaStatus uhda_virtual_stream_get_remaining(const UhdaVirtualStream* stream, uint32_t* remaining) {
+	*remaining = stream->get_size();
+	return UHDA_STATUS_SUCCESS;
 }
@@ -52,4 +52,13 @@ namespace uhda {
 	constexpr T* launder(T* ptr) {
 		return __builtin_launder(ptr);
 	}
+
+	// makes prior writes to write-combining memory visible to the device.
+	inline void dma_write_barrier() {
+#if defined(__x86_64__) || defined(__i386__)
+		asm volatile("sfence" : : : "memory");
+#else
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+	}
 }
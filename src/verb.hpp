@@ -0,0 +1,51 @@
+#pragma once
+#include "uhda/types.h"
+#include "spec.hpp"
+
+namespace uhda {
+	struct Verb {
+		// verb with a 12-bit command and an 8-bit payload
+		static constexpr Verb make(uint8_t nid, uint16_t cmd, uint8_t data) {
+			VerbDescriptor desc {};
+			desc.set_nid(nid);
+			desc.set_payload(cmd << 8 | data);
+			return {desc.value, 0};
+		}
+
+		// verb with a 4-bit command and a 16-bit payload
+		static constexpr Verb make_long(uint8_t nid, uint8_t cmd, uint16_t data) {
+			VerbDescriptor desc {};
+			desc.set_nid(nid);
+			desc.set_payload(cmd << 16 | data);
+			return {desc.value, 0};
+		}
+
+		// the codec address is filled in when the verb is written to the corb
+		uint32_t value;
+		uint32_t res;
+	};
+
+	using VerbCompletionFn = void (*)(void* arg, UhdaStatus status);
+
+	struct VerbBatch {
+		Verb* verbs {};
+		uint32_t count {};
+		VerbCompletionFn fn {};
+		void* arg {};
+		UhdaStatus status {};
+		uint8_t cid {};
+
+		// owned by the controller while the batch is submitted
+		VerbBatch* next {};
+		uint32_t written {};
+		uint32_t received {};
+		// the wall clock when the first verb was written
+		uint32_t start_clock {};
+		bool done {};
+	};
+
+	struct VerbBatchList {
+		VerbBatch* head {};
+		VerbBatch* tail {};
+	};
+}
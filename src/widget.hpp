@@ -1,11 +1,35 @@
 #pragma once
-#include "vector.hpp"
+#include "arena.hpp"
 
 struct UhdaCodec;
 
+namespace uhda {
+	// set of the widgets of one codec indexed by nid
+	struct WidgetSet {
+		constexpr void add(uint8_t nid) {
+			words[nid / 64] |= 1ULL << (nid % 64);
+		}
+
+		[[nodiscard]] constexpr bool contains(uint8_t nid) const {
+			return words[nid / 64] & 1ULL << (nid % 64);
+		}
+
+		[[nodiscard]] constexpr bool intersects(const WidgetSet& other) const {
+			uint64_t shared = 0;
+			for (int i = 0; i < 4; ++i) {
+				shared |= words[i] & other.words[i];
+			}
+			return shared;
+		}
+
+		uint64_t words[4] {};
+	};
+}
+
 struct UhdaWidget {
 	UhdaCodec* codec;
-	uhda::vector<uint8_t> connections;
+	// allocated from the arena of the codec
+	uhda::span<uint8_t> connections;
 	uint32_t in_amp_caps;
 	uint32_t out_amp_caps;
 	uint32_t pin_caps;
@@ -13,6 +37,11 @@ struct UhdaWidget {
 	uint8_t nid;
 	uint8_t type;
 	uint8_t default_dev;
+	// number of set up paths that use the widget, it's in d3 while this is zero
+	uint8_t power_refs {};
 	bool trigger : 1;
 	bool presence_detect : 1;
+	bool unsol_capable : 1;
+	// converters with a digital output or input such as s/pdif or hdmi
+	bool digital : 1;
 };
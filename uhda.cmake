@@ -3,8 +3,26 @@ set(UHDA_SOURCES
 	"${CMAKE_CURRENT_LIST_DIR}/src/controller.cpp"
 	"${CMAKE_CURRENT_LIST_DIR}/src/codec.cpp"
 	"${CMAKE_CURRENT_LIST_DIR}/src/stream.cpp"
+	"${CMAKE_CURRENT_LIST_DIR}/src/convert.cpp"
+	"${CMAKE_CURRENT_LIST_DIR}/src/mixer.cpp"
+	"${CMAKE_CURRENT_LIST_DIR}/src/gain.cpp"
 )
 
 set(UHDA_INCLUDES
 	"${CMAKE_CURRENT_LIST_DIR}/include"
 )
+
+set(UHDA_HOSTED_SOURCES
+	"${CMAKE_CURRENT_LIST_DIR}/hosted/bench.cpp"
+	"${CMAKE_CURRENT_LIST_DIR}/hosted/codec_script.cpp"
+	"${CMAKE_CURRENT_LIST_DIR}/hosted/emulator.cpp"
+	"${CMAKE_CURRENT_LIST_DIR}/hosted/kernel_api.cpp"
+)
+
+option(UHDA_BUILD_HOSTED "Build the benchmark against an emulated controller" OFF)
+if (UHDA_BUILD_HOSTED)
+	add_executable(uhda_bench ${UHDA_SOURCES} ${UHDA_HOSTED_SOURCES})
+	target_include_directories(uhda_bench PRIVATE ${UHDA_INCLUDES} "${CMAKE_CURRENT_LIST_DIR}/src")
+	target_compile_definitions(uhda_bench PRIVATE UHDA_TRACE)
+	target_compile_features(uhda_bench PRIVATE cxx_std_20)
+endif()